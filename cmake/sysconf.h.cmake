@@ -25,6 +25,17 @@
 #cmakedefine HAVE_KQUEUE 1
 #cmakedefine HAVE_POLL 1
 #cmakedefine HAVE_SELECT 1
+#cmakedefine HAVE_LINUX_OPENAT2_H 1
+#cmakedefine HAVE_PREADV2 1
+#cmakedefine HAVE_PWRITEV 1
+#cmakedefine HAVE_FALLOCATE 1
+#cmakedefine HAVE_SENDMMSG 1
+#cmakedefine HAVE_TIMERFD 1
+#cmakedefine HAVE_MEMFD_CREATE 1
+#cmakedefine HAVE_SO_TXTIME 1
+#cmakedefine HAVE_LINUX_ERRQUEUE_H 1
+#cmakedefine HAVE_SYS_SENDFILE_H 1
+#cmakedefine HAVE_AVX2_TARGET 1
 
 #define VERSION_MAJOR        @PROJECT_MAJOR_VERSION@
 #define VERSION_MINOR        @PROJECT_MINOR_VERSION@
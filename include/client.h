@@ -19,6 +19,11 @@
 #include "packets.h"
 #include "vec.h"
 #include "socket.h"
+#include "iopool.h"
+#include "stream.h"
+#include "timer.h"
+#include "netascii.h"
+#include "vfs.h"
 
 typedef short int tid_t;
 
@@ -27,6 +32,8 @@ typedef struct packetqueue_s
 	packet_t *p;
 	size_t len;
 	uint8_t allocated;
+	// When the kernel should send it (SO_TXTIME), 0 for right away.
+	uint64_t txtime;
 } packetqueue_t;
 
 typedef struct client_s
@@ -35,7 +42,7 @@ typedef struct client_s
 	socket_t s;
 	// Status variables
 	uint16_t currentblockno;
-	size_t actualblockno;
+	uint64_t actualblockno;
 	uint8_t waiting, sendingfile, destroy;
 	time_t nextresend;
 
@@ -48,8 +55,8 @@ typedef struct client_s
 	// been received yet and we need to resend.
 	vec_t(packetqueue_t) packetqueue_vec;
 
-	// Current file we're sending
-	FILE *f;
+	// Current file we're sending (or receiving), NULL if none.
+	vfile_t *file;
 
 	// The client's Transfer ID, just the udp port
 	tid_t tid;
@@ -59,6 +66,100 @@ typedef struct client_s
 	// An actual data block.
 	void *blk;
 
+	// Size of the file we're sending and where the next block starts.
+	uint64_t filesize, offset;
+	// How far ahead we've asked the kernel to read the file.
+	uint64_t readahead;
+	// The next block, read while the current one is in flight, and
+	// where in the file it came from.
+	void *nextblk;
+	ssize_t nextlen;
+	uint64_t nextoffset;
+	uint8_t nextready, prefetch;
+
+	// Disk I/O handed to the I/O pool. nextpending is set while the
+	// next block is being read, ackwaiting when the client ACKed before
+	// it was ready and the block should go out as soon as it is.
+	iorequest_t readreq, writereq;
+	uint8_t nextpending, ackwaiting, writepending, lastblock;
+	// Outstanding I/O requests, the client can't be freed until
+	// they're done. removed is set if it was removed in the meantime.
+	int iopending;
+	uint8_t removed;
+	// An RRQ for a file that's on its way from somewhere else (see
+	// VFSOpenAsync), gone through again once it's here.
+	iorequest_t openreq;
+	packet_t *request;
+	size_t requestlen;
+
+	// The shared read stream this client is attached to, if any, and
+	// the stream block it holds as its next block instead of nextblk.
+	stream_t *stream;
+	streamblock_t *nextslot;
+
+	// RFC 7440 windowed sending. windowsize is what the client agreed to,
+	// cwnd how many blocks of it we send per round trip and burstleft how
+	// many more we can send before waiting for one. Block numbers are the
+	// full (not 16 bit) ones like actualblockno.
+	uint16_t windowsize;
+	uint32_t cwnd, ssthresh, burstleft;
+	uint64_t acked, highestblock;
+	// When the newest block went out and the smoothed round trip time,
+	// in nanoseconds. sendtimes has when each block of the window went
+	// out (indexed by block % windowsize), 0 if it has been resent.
+	uint64_t senttime, srtt;
+	uint64_t *sendtimes;
+	// The newest block sent when we last lost something (see WindowLoss)
+	// and how many repeated ACKs for blocks sent before we went back are
+	// still on their way.
+	uint64_t recover, staleacks;
+	int retries;
+	// Blocks delivered towards opening cwnd by one more.
+	uint32_t cwndcount;
+	// lastsent is set once the end of the file went out, resent if the
+	// newest block we sent had already been sent before.
+	uint8_t lastsent, resent;
+	// Retransmits and spacing out the window.
+	timerevent_t windowtimer;
+	// How the transfer is going.
+	uint64_t blockssent, blocksresent, losses;
+	// Pacing: when the next block may leave and when the last one did
+	// (or will, with txtime pacing). txtime is handed to QueuePacket.
+	uint64_t nexttx, lasttx, txtime;
+	timerevent_t pacetimer;
+
+	// Receiving (WRQ). Blocks wait in recvbuf (windowsize of them, indexed
+	// by block % windowsize, recvlens is -1 for an empty slot) until they
+	// get written in order, actualblockno is the next one to write.
+	// received is the block we have everything up to, finalblock the
+	// short one at the end of the file once we've seen it. gapack is set
+	// when we should ACK received once it's written because the client
+	// skipped something, gapacked is the block we last did that for.
+	uint8_t *recvbuf;
+	ssize_t *recvlens;
+	uint64_t received, finalblock, gapacked;
+	uint8_t gapack;
+	// Blocks ready in order are written together, writeiov points at
+	// their slots and writeblocks is how many are in the write.
+	struct iovec *writeiov;
+	int writeblocks;
+
+	// netascii transfers. The file and the blocks on the wire don't line up,
+	// so sending, carry is the half of a pair the block ending at offset
+	// left over and asciistarts has where each block of the window starts
+	// (windowsize + 1 of them, indexed by the block before it). The next
+	// block is read raw into asciibuf, nextcarryin is the carry it was
+	// encoded with, nextcarry and nextconsumed what it leaves behind.
+	// Receiving, asciicr is set when the last block written ended on a CR.
+	uint8_t netascii, asciicr;
+	int16_t carry, nextcarryin, nextcarry;
+	size_t nextconsumed;
+	uint8_t *asciibuf;
+	asciipos_t *asciistarts;
+
+	// The RFC 2090 multicast session this client belongs to.
+	struct mcsession_s *mcsession;
+
 } client_t;
 
 typedef vec_t(client_t*) client_vec_t;
@@ -75,6 +176,8 @@ extern int CompareClients(client_t *c1, client_t *c2);
 extern client_t *FindClient(socket_t s);
 // Either find a client or allocate a new one, also adds it to the linked list.
 extern client_t *FindOrAllocateClient(socket_t s);
+extern int FinishClientIO(client_t *c);
 extern void DeallocateClients(void);
 extern void CheckClients(void);
+extern void PrintClientStatistics(void);
 
@@ -19,6 +19,9 @@ typedef struct listen_s
 {
 	char *bindaddr;
 	short port;
+	// The largest packet clients on this block can take, 0 to go by
+	// the route to each client alone.
+	int mtu;
 } listen_t;
 
 typedef struct conf_module_s
@@ -27,6 +30,96 @@ typedef struct conf_module_s
 	char *path;
 } conf_module_t;
 
+// Requests matching match are rendered from the template in file,
+// with variables for each client from the optional data file.
+typedef struct conf_template_s
+{
+	char *match;
+	char *file;
+	char *data;
+} conf_template_t;
+
+// A tar or cpio archive whose files are served as if they were
+// unpacked into path (the top of the directory if it isn't set).
+typedef struct conf_archive_s
+{
+	char *file;
+	char *path;
+} conf_archive_t;
+
+// Files under path come from the HTTP origin at url and are kept in
+// cache, checked with the origin once they're revalidate seconds old.
+typedef struct conf_upstream_s
+{
+	char *path;
+	char *url;
+	char *cache;
+	int revalidate;
+	int timeout;
+} conf_upstream_t;
+
+// Other nbstftp nodes, each the owner of the files a consistent hash of
+// their names gives it. We fetch files we don't own from their owner and
+// serve the ones we do to the others on port. self is us as the others
+// have us in their peer lists.
+typedef struct conf_peers_s
+{
+	char *bindaddr;
+	int port;
+	char *self;
+	vec_str_t peers;
+	int revalidate;
+	int timeout;
+} conf_peers_t;
+
+// Where clients can fetch files over HTTP as well as TFTP.
+typedef struct conf_http_s
+{
+	char *bindaddr;
+	int port;
+} conf_http_t;
+
+// Files in the directory matching any of the match globs are read into
+// memory at startup, locked there if pin is set and put in huge pages
+// if hugepages is.
+typedef struct conf_preload_s
+{
+	vec_str_t match;
+	char pin;
+	char hugepages;
+} conf_preload_t;
+
+// How windows are spread out over the round trip.
+enum
+{
+	PACING_OFF,
+	// Hold blocks back with a timer.
+	PACING_TIMER,
+	// Stamp each block with when it should leave and let
+	// the kernel (the fq qdisc) hold on to it.
+	PACING_TXTIME
+};
+
+// How hard we make sure an upload is on disk before ACKing the last block.
+enum
+{
+	SYNC_OFF,
+	// Sync the file before renaming it into place.
+	SYNC_FILE,
+	// And the directory after, so the rename sticks too.
+	SYNC_FULL
+};
+
+// What happens to an event for asynchronous module handlers when
+// their queue is full.
+enum
+{
+	// Throw it away and count it.
+	EVENTS_DROP,
+	// Wait for the module thread to make room.
+	EVENTS_BLOCK
+};
+
 typedef struct config_s
 {
 	char *directory;
@@ -34,11 +127,30 @@ typedef struct config_s
 	char *group;
 	char *pidfile;
 	char *modsearchpath;
+	char *multicastaddr;
 	char daemonize;
 	char fixpath;
+	char sharedstreams;
+	char prefetch;
 	int readtimeout;
+	int iothreads;
+	int multicastport;
+	int maxwindowsize;
+	int pacing;
+	// What block numbers wrap around to after 65535, 0 or 1.
+	int blockrollover;
+	int uploadsync;
+	// How many events asynchronous module handlers can fall behind by.
+	int eventqueue;
+	int eventoverflow;
 	vec_t(listen_t*) listenblocks;
 	vec_t(conf_module_t*) moduleblocks;
+	vec_t(conf_template_t*) templateblocks;
+	vec_t(conf_archive_t*) archiveblocks;
+	vec_t(conf_upstream_t*) upstreamblocks;
+	vec_t(conf_peers_t*) peerblocks;
+	vec_t(conf_http_t*) httpblocks;
+	vec_t(conf_preload_t*) preloadblocks;
 } config_t;
 
 // Defined in parser.y
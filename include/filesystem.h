@@ -18,4 +18,9 @@
 extern int FileExists(const char *file);
 extern int IsDirectory(const char *file);
 extern void FixPath(char *str);
-extern int SetFilePermissions(const char *file, const char *user, const char *group, mode_t permissions);
\ No newline at end of file
+extern int SetFilePermissions(const char *file, const char *user, const char *group, mode_t permissions);
+extern int OpenServeRoot(const char *dir);
+extern void CloseServeRoot(void);
+extern int OpenBeneathRoot(const char *path, int flags, mode_t mode);
+extern int CreateBeneathRoot(const char *path, mode_t mode, int *dirfd, char **tmpname);
+extern int RenameBeneathRoot(int dirfd, const char *tmpname, const char *path);
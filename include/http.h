@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+// Largest request header we'll take.
+#define HTTP_REQUEST 8192
+// How much of a file we read at a time for files that aren't in memory.
+#define HTTP_BUFFER (64 * 1024)
+// Seconds a connection can sit there doing nothing.
+#define HTTP_IDLE 30
+
+extern int InitializeHTTP(void);
+extern void ShutdownHTTP(void);
+extern void PrintHTTPStatistics(void);
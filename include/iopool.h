@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Disk I/O operations the pool knows how to do.
+enum
+{
+	IO_READ,
+	IO_WRITE,
+	// fsync() the descriptor, buf and len are unused.
+	IO_SYNC
+};
+
+typedef struct iorequest_s iorequest_t;
+
+// A single disk operation. The caller owns the request and the buffer
+// and must keep both alive until the completion function is called.
+struct iorequest_s
+{
+	int op;
+	int fd;
+	void *buf;
+	size_t len;
+	uint64_t offset;
+	// Writes can gather from iovcnt buffers instead of buf, len is then
+	// the total. The pool may change the iovecs as it goes.
+	struct iovec *iov;
+	int iovcnt;
+
+	// Filled in once the operation finishes, result is the number
+	// of bytes transferred or -1 with error set to the errno.
+	ssize_t result;
+	int error;
+
+	// Called on the event loop (never on a worker thread) once the
+	// operation is done, data is for the caller to use.
+	void (*complete)(iorequest_t *req);
+	void *data;
+
+	// Queue linkage, owned by the pool.
+	_Atomic(iorequest_t *) next;
+};
+
+extern int InitializeIOPool(int threads);
+extern void ShutdownIOPool(void);
+extern void SubmitIO(iorequest_t *req);
+extern void CompleteIO(iorequest_t *req);
+extern void PrintIOStatistics(void);
@@ -19,6 +19,7 @@
 #include "reallocarray.h"
 
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 
 #ifndef NDEBUG
 # define bprintf(...) printf(__VA_ARGS__)
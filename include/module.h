@@ -14,6 +14,8 @@
  */
 #pragma once
 #include "vec.h"
+#include "socket.h"
+#include "vfs.h"
 
 enum
 {
@@ -35,12 +37,95 @@ enum
 	EV_END
 };
 
+// What each event's data points to. Events not listed here pass
+// the socket_t (EV_SOCKETACTIVITY), the module_t (EV_MODLOAD and
+// EV_MODUNLOAD), the signal number (EV_SIGNAL) or nothing (EV_TICK).
+
+// EV_DATA_PACKET, EV_ACK_PACKET, EV_ERROR_PACKET and EV_UNKNOWN_PACKET.
+typedef struct evpacket_s
+{
+	const packet_t *p;
+	client_t *c;
+	size_t len;
+} evpacket_t;
+
+// EV_NEWREADREQUEST and EV_NEWWRITEREQUEST.
+typedef struct evrequest_s
+{
+	const packet_t *p;
+	client_t *c;
+	char *filename, *mode, *path;
+	size_t len;
+} evrequest_t;
+
+// EV_SENDING_PACKETS
+typedef struct evsending_s
+{
+	socket_t *s;
+	packet_t *p;
+	client_t *c;
+	size_t len;
+} evsending_t;
+
+// EV_RECEIVING_PACKETS
+typedef struct evreceiving_s
+{
+	socket_t *s;
+	client_t *c;
+	const void *buf;
+	size_t len;
+} evreceiving_t;
+
+// EV_RESEND
+typedef struct evresend_s
+{
+	client_t *c;
+	const packet_t *p;
+	size_t len;
+} evresend_t;
+
+// How much of a packet asynchronous handlers get to see.
+#define ASYNC_EVENT_DATA MAX_PACKET_SIZE
+
+// Asynchronous handlers run on the module thread after the fact, so
+// instead of the event's data they get a copy of what it was about.
+typedef struct asyncevent_s
+{
+	int type;
+	// MonotonicTime() when it happened.
+	uint64_t time;
+	// The client's address, the family is AF_UNSPEC if there wasn't one.
+	socketstructs_t addr;
+	// The signal for EV_SIGNAL.
+	int signal;
+	// How long the packet really was and as much of it as fits. The
+	// module's name for EV_MODLOAD and EV_MODUNLOAD.
+	size_t len;
+	uint8_t data[ASYNC_EVENT_DATA];
+} asyncevent_t;
+
+// Event flags
+enum
+{
+	// Run the handler on the module thread with an asyncevent_t
+	// instead of inline. Handlers which veto or change packets
+	// can't be asynchronous.
+	EVENT_ASYNC = 1
+};
+
 typedef struct event_s 
 {
 	int type;
 	void (*func)(void *data);
+	int flags;
 } event_t;
 
+typedef vec_t(event_t) event_vec_t;
+
+// Every module's handler for each event type, rebuilt whenever a module
+// is loaded or unloaded so calling an event only touches its own handlers.
+extern event_vec_t eventhandlers[EV_END];
+
 // Module functions and structs.
 
 // This struct is delcared in each module as _minfo
@@ -68,10 +153,21 @@ extern int LoadModule(module_t *m, const char *str);
 extern void UnloadModule(module_t m);
 extern int FindModule(module_t *mod, const char *name);
 extern void InitializeModules(void);
+extern int StartModuleThread(void);
+extern void StopModuleThread(void);
+extern void PrintModuleStatistics(void);
 
 // Event related functions
 extern void CallModuleEvent(module_t m, int type, void *data);
-extern void CallEvent(int type, void *data);
+extern void DispatchEvent(int type, void *data);
+
+// Globally call an event (such as receiving a packet). Most events have
+// nobody listening, those cost a single check.
+static inline void CallEvent(int type, void *data)
+{
+	if (eventhandlers[type].length)
+		DispatchEvent(type, data);
+}
 
 
 // Our declare module function which gives header info and such.
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "client.h"
+#include "vec.h"
+
+// An RFC 2090 multicast transfer. The group is a pseudo-client addressed
+// to the multicast address which sends the file, the first member is the
+// master client whose ACKs drive it.
+typedef struct mcsession_s
+{
+	client_t *group;
+	vec_t(client_t*) members;
+
+	// What's being sent, the file is the group's.
+	uint32_t blksize;
+	uint64_t lastblock;
+	// Set until a newly appointed master ACKs for the first time.
+	uint8_t newmaster;
+
+	// Where it's being sent
+	char address[INET_ADDRSTRLEN];
+	uint16_t port;
+} mcsession_t;
+
+static inline int IsMulticastGroup(client_t *c)
+{
+	return c->mcsession && c->mcsession->group == c;
+}
+
+extern int JoinMulticast(client_t *c, char *param, size_t len);
+extern void LeaveMulticast(client_t *c);
+extern void MulticastAcknowledge(client_t *c, uint16_t blockno);
+extern void PrintMulticastStatistics(void);
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// No byte left over from the last block.
+#define NETASCII_NOCARRY -1
+
+// Where a block of a netascii transfer starts in the file. carry is the
+// second half of a CR LF or CR NUL pair which didn't fit in the block
+// before it, last is set if the block before it was the end of the file.
+typedef struct asciipos_s
+{
+	uint64_t offset;
+	int16_t carry;
+	uint8_t last;
+} asciipos_t;
+
+extern size_t NetasciiEncode(const uint8_t *in, size_t inlen, uint8_t *out, size_t outlen, int16_t *carry, size_t *consumed);
+extern size_t NetasciiDecode(uint8_t *buf, size_t len, uint8_t *cr, uint8_t *prefixcr);
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include "timer.h"
+
+// Points each node gets on the ring, more spreads files out more evenly.
+#define PEER_POINTS 64
+// How long we wait for a peer to start answering before serving the
+// file ourselves. Short, since we aren't serving anyone while we wait.
+#define PEER_WAIT (250 * MILLISECONDS)
+// Seconds we leave a peer alone for after we couldn't reach it, or
+// after it was too slow this many times in a row.
+#define PEER_RETRY 10
+#define PEER_LATE 3
+
+extern void InitializePeers(void);
+extern void ShutdownPeers(void);
+extern void PrintPeerStatistics(void);
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include "packets.h"
+#include "timer.h"
+
+// How many of the files a client asks for after another one count as
+// following it, and how long after it they still count.
+#define PREFETCH_DEPTH 3
+#define PREFETCH_GAP (30 * SECONDS)
+// Files remembered as following each file, and how many times one has
+// to have followed it (by anyone) before we warm it for everyone.
+#define PREFETCH_FOLLOWERS 8
+#define PREFETCH_SEEN 2
+// What each client last asked for, so it gets its own boot again.
+#define PREFETCH_HISTORY 16
+// How many files and clients we learn about, the ones not heard of
+// for longest are forgotten first.
+#define PREFETCH_FILES 1024
+#define PREFETCH_CLIENTS 4096
+// A file warmed isn't warmed again for this long, and no more than
+// this much of it is.
+#define PREFETCH_REWARM (60 * SECONDS)
+#define PREFETCH_LIMIT (256 * 1024 * 1024)
+
+extern void InitializePrefetch(void);
+extern void ShutdownPrefetch(void);
+// A client got path, learn from it and warm what it's likely to ask for next.
+extern void LearnRequest(const char *path, const socketstructs_t *peer);
+extern void PrintPrefetchStatistics(void);
@@ -17,4 +17,25 @@
 #include <stddef.h>
 #include "client.h"
 
+// How far ahead of a transfer we ask the kernel to read large files.
+#define PREFETCH_WINDOW (1024 * 1024)
+
+// The congestion window transfers start with and how many times
+// we resend a window before giving up on the client.
+#define INITIAL_WINDOW 4
+#define WINDOW_RETRIES 5
+// How many blocks pacing lets go back to back.
+#define PACING_BURST 2
+// How long we wait on a client sending us a file before ACKing again,
+// and how much of the file we buffer while it's being written.
+#define RECEIVE_TIMEOUT SECONDS
+#define RECEIVE_BUFFER (4 * 1024 * 1024)
+// The most we hand to the disk in one write.
+#define WRITE_BATCH (1024 * 1024)
+
+extern uint16_t BlockNumber(uint64_t block);
+extern uint64_t FullBlockNumber(uint16_t blockno, uint64_t newest);
+extern void PrefetchBlock(client_t *c);
+extern void NextBlockReady(client_t *c);
+extern void SendBlockAfter(client_t *c, uint64_t blockno);
 extern void ProcessPacket(client_t *c, const packet_t * const buffer, size_t len, size_t alloclen);
@@ -20,7 +20,7 @@
 // Forward declare to prevent circular includes.
 typedef struct client_s client_t;
 
-extern int BindToSocket(const char *addr, short port);
+extern int BindToSocket(const char *addr, short port, int mtu);
 
 extern int InitializeSockets(void);
 extern void ProcessSockets(void);
@@ -42,18 +42,31 @@ typedef struct socket_s
 	packet_t *packet;
 	// The length of the above memory block
 	size_t pktlen;
+	// Largest packet clients of a listen socket can take, 0 if not set.
+	int mtu;
+	// Descriptors that aren't TFTP sockets (eg, the I/O pool's notifier)
+	// get their own handlers instead of Send/ReceivePackets.
+	int (*readhandler)(struct socket_s s);
+	int (*writehandler)(struct socket_s s);
+	// Told when the socket is destroyed, whoever did it.
+	void (*closehandler)(struct socket_s s);
+	// Whatever the handlers need to keep track of.
+	void *data;
 } socket_t;
 
 typedef vec_t(socket_t) socket_vec_t;
 extern socket_vec_t socketpool;
 
 extern short GetPort(socket_t s);
+extern int MaxDatagram(socket_t s);
 extern void DestroySocket(socket_t s, uint8_t close);
 
 extern int AddSocket(int fd, const char *addr, int type, socketstructs_t saddr, uint8_t binding, socket_t *s);
+extern int AddHandlerSocket(int fd, int (*readhandler)(socket_t s), int (*writehandler)(socket_t s), void (*closehandler)(socket_t s), void *data);
 extern int FindSocket(int fd, socket_t *s);
 
 extern void QueuePacket(client_t *c, packet_t *p, size_t len, uint8_t allocated);
 extern int SendPackets(socket_t s);
 extern int ReceivePackets(socket_t s);
+extern int ReceiveErrors(socket_t s);
 extern const char *GetAddress(socketstructs_t saddr);
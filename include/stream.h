@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include <stdint.h>
+#include "iopool.h"
+#include "vfs.h"
+#include "vec.h"
+
+// Forward declare to prevent recursive includes.
+typedef struct client_s client_t;
+typedef struct stream_s stream_t;
+
+// How many blocks a shared stream keeps around for clients
+// which have fallen behind the rest of the herd.
+#define STREAM_BLOCKS 64
+
+// Block states
+enum
+{
+	SB_EMPTY,
+	SB_READING,
+	SB_READY
+};
+
+typedef struct streamblock_s
+{
+	stream_t *stream;
+	// Which block of the file this is (from 0) and how much of it there is.
+	uint64_t index;
+	void *data;
+	ssize_t len;
+	uint8_t state;
+	// Clients holding this block as their next block to send.
+	int refs;
+	// Clients waiting for the read of this block to finish.
+	vec_t(client_t*) waiters;
+	iorequest_t req;
+} streamblock_t;
+
+// One read stream shared by every client fetching the same
+// file with the same block size at the same time.
+struct stream_s
+{
+	vfile_t *file;
+	uint32_t blksize;
+	// Attached clients and reads still in flight.
+	int clients, iopending;
+	streamblock_t blocks[STREAM_BLOCKS];
+};
+
+extern stream_t *AttachStream(client_t *c);
+extern void DetachStream(client_t *c);
+extern int StreamFetch(client_t *c);
+extern void StreamRelease(client_t *c);
+extern void PrintStreamStatistics(void);
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include <stdint.h>
+
+typedef struct timerevent_s timerevent_t;
+
+// Something to run at a later time, the owner keeps the structure
+// around and ArmTimer/CancelTimer it as needed.
+struct timerevent_s
+{
+	// When to run (see MonotonicTime) and whether we're waiting to.
+	uint64_t when;
+	uint8_t armed;
+
+	// Called from the event loop once the time has passed.
+	void (*callback)(timerevent_t *t);
+	void *data;
+};
+
+// Nanoseconds on the monotonic clock.
+#define MILLISECONDS (1000ULL * 1000ULL)
+#define SECONDS (1000ULL * MILLISECONDS)
+
+extern uint64_t MonotonicTime(void);
+extern void ArmTimer(timerevent_t *t, uint64_t delay);
+extern void CancelTimer(timerevent_t *t);
+extern void RunTimers(void);
+extern int InitializeTimers(void);
+extern void ShutdownTimers(void);
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include "timer.h"
+#include "vfs.h"
+
+// Largest response header we'll take from an origin.
+#define UPSTREAM_HEADERS 16384
+// How much of what's fetched into memory we hang on to once nobody has it open.
+#define UPSTREAM_MEMORY (256 * 1024 * 1024)
+// How many files we keep track of, and fetch at once.
+#define UPSTREAM_OBJECTS 4096
+#define UPSTREAM_FETCHES 32
+// How long opening a file without somewhere to park (see VFSOpenAsync)
+// waits on the event loop for the origin to answer.
+#define UPSTREAM_WAIT (250 * MILLISECONDS)
+// Seconds we leave an origin alone after it couldn't be reached.
+#define UPSTREAM_RETRY 10
+
+typedef struct origin_s origin_t;
+
+typedef struct originstats_s
+{
+	uint64_t fetches, fetched, coalesced, hits, notmodified, stale;
+} originstats_t;
+
+// Somewhere other than an upstream block to fetch files from, files are
+// kept in cache or in memory if it's NULL. Times are in nanoseconds, wait
+// is how long opening a file waits for the origin to start answering.
+extern origin_t *NewOrigin(const char *url, const char *cache, uint64_t revalidate, uint64_t timeout, uint64_t wait);
+// Open, read and close files from an origin for a backend of your own,
+// open fails with ENOENT if the origin doesn't have it and EINPROGRESS
+// if it kept vf->ready to wait for the origin with.
+extern int OriginOpen(origin_t *o, vfile_t *vf, const char *name);
+extern void OriginRead(vfile_t *vf, iorequest_t *req);
+extern void OriginClose(vfile_t *vf);
+extern void GetOriginStatistics(origin_t *o, originstats_t *stats);
+
+extern void InitializeUpstreams(void);
+extern void StopUpstreams(void);
+extern void ShutdownUpstreams(void);
+extern void PrintUpstreamStatistics(void);
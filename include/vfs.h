@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include "iopool.h"
+#include "packets.h"
+
+typedef struct vfile_s vfile_t;
+typedef struct backend_s backend_t;
+
+// What a backend can do besides reading files.
+enum
+{
+	// Opening the same file twice gives the same dev and ino, so clients
+	// fetching it at the same time can share reads and multicast groups.
+	VFS_SHARED   = 1 << 0,
+	// Files are in memory (map is set when they're opened), blocks are
+	// copied straight out instead of going through read.
+	VFS_MAPPED   = 1 << 1,
+	// Files can be created, which means create, write and commit are set.
+	VFS_WRITABLE = 1 << 2,
+	// Files come from other nbstftp nodes, who don't get them from here
+	// when they ask us (see VFSOpenLocal).
+	VFS_PEER     = 1 << 3,
+	// Opening a file can mean waiting on another server (an origin or a
+	// peer), see ready and nowait in vfile_t for how not to.
+	VFS_REMOTE   = 1 << 4
+};
+
+// An open file.
+struct vfile_s
+{
+	const backend_t *backend;
+	int refs;
+	// How big the file is. Open has to know, it's how we know which
+	// block is the last one and what to say when asked for the tsize.
+	uint64_t size;
+	// Who the file is for VFS_SHARED backends.
+	uint64_t dev, ino;
+	// Changes whenever the file does (its modification time, say), 0 if
+	// the backend can't tell. HTTP clients only get an ETag with one.
+	uint64_t version;
+	// A descriptor with the file in it, -1 if there isn't one. The kernel
+	// is given hints about it and HTTP clients are sent straight from it.
+	int fd;
+	// The whole file for VFS_MAPPED backends.
+	const uint8_t *map;
+	// Whatever the backend wants to keep with the file.
+	void *data;
+	// Set when opening with VFSOpenAsync: VFS_REMOTE backends that would
+	// have to wait for the file keep it, fail with EINPROGRESS and hand it
+	// back (CompleteIO) once opening the file again won't wait.
+	iorequest_t *ready;
+	// Set when opening with VFSOpenNoWait: VFS_REMOTE backends open what
+	// they have already and fail with EWOULDBLOCK for anything else they'd
+	// serve, rather than let another backend have it.
+	int nowait;
+};
+
+// Where files come from. The directory we serve is the backend of last
+// resort, modules can register backends in front of it to serve files out
+// of memory, archives, or whatever else they like.
+//
+// Paths are relative to the root of what we serve, without leading
+// slashes and never with ".." in them. I/O is asynchronous: read, write
+// and commit start the request and once it's done set req->result (bytes
+// transferred or -1) and req->error, then either call req->complete(req)
+// right there if it didn't have to wait, or CompleteIO(req) from whatever
+// thread finished it.
+struct backend_s
+{
+	const char *name;
+	int caps;
+	// Open path for peer to read and fill in vf. Returns 0, or -1 with errno
+	// set. ENOENT lets the next backend have a go at it, EINPROGRESS says
+	// it kept vf->ready (see above). If open or create fails close is
+	// still called to clean up what they did.
+	int (*open)(vfile_t *vf, const char *path, const socketstructs_t *peer);
+	// Create path for an upload, size is how big the client says it'll
+	// be (0 if it didn't say). Nobody sees it until it's committed.
+	int (*create)(vfile_t *vf, const char *path, uint64_t size);
+	// Read req->len bytes at req->offset into req->buf. Reading past the
+	// end of the file gives fewer bytes (or none), not an error.
+	void (*read)(vfile_t *vf, iorequest_t *req);
+	// Write req->len bytes at req->offset from req->iov (req->iovcnt of them).
+	void (*write)(vfile_t *vf, iorequest_t *req);
+	// The upload is finished and req->offset bytes long, make it the file.
+	void (*commit)(vfile_t *vf, iorequest_t *req);
+	// Let go of the file, throwing it away if it was created and never committed.
+	void (*close)(vfile_t *vf);
+};
+
+extern void RegisterBackend(const backend_t *b);
+extern void UnregisterBackend(const backend_t *b);
+
+extern vfile_t *VFSOpen(const char *path, const socketstructs_t *peer);
+extern vfile_t *VFSOpenAsync(const char *path, const socketstructs_t *peer, iorequest_t *ready);
+extern vfile_t *VFSOpenLocal(const char *path, const socketstructs_t *peer, iorequest_t *ready);
+extern vfile_t *VFSOpenNoWait(const char *path, const socketstructs_t *peer);
+extern vfile_t *VFSCreate(const char *path, uint64_t size);
+extern vfile_t *VFSRetain(vfile_t *vf);
+extern void VFSClose(vfile_t *vf);
+extern void VFSRead(vfile_t *vf, iorequest_t *req);
+extern void VFSWrite(vfile_t *vf, iorequest_t *req);
+extern void VFSCommit(vfile_t *vf, iorequest_t *req);
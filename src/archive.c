@@ -0,0 +1,866 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "archive.h"
+#include "config.h"
+#include "misc.h"
+#include "timer.h"
+#include "vec.h"
+#include "vfs.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Boot trees shipped as tar or cpio archives, served without unpacking
+// them. Both formats keep every file whole and uncompressed right after
+// its header, so once we know where each one starts a file is just a
+// piece of the mapped archive (this is a VFS_MAPPED backend).
+//
+// Reading through tens of thousands of headers takes a while on a cold
+// cache, so the index we build is written next to the archive and simply
+// mapped the next time we start, as long as the archive hasn't changed.
+
+#define INDEX_MAGIC "NBSIDX1"
+
+// How much of a file we ask the kernel to start reading when it's opened.
+#define ARCHIVE_READAHEAD (4 * 1024 * 1024)
+
+// The index file is this, the entries, then their names.
+typedef struct indexheader_s
+{
+	char magic[8];
+	// The archive it's for, it's rebuilt if any of these change.
+	uint64_t size, ino;
+	int64_t mtime, mtimensec;
+	uint32_t count, namesize;
+} indexheader_t;
+
+// Sorted by name, which is where in the names it starts.
+typedef struct indexentry_s
+{
+	uint64_t offset, size;
+	uint32_t name, namelen;
+} indexentry_t;
+
+typedef struct archive_s
+{
+	char *file, *path;
+	size_t pathlen;
+	const uint8_t *map;
+	uint64_t size;
+	// Mapped from the index file, or built in memory if it couldn't be written.
+	void *index;
+	size_t indexlen;
+	int indexmapped;
+	const indexentry_t *entries;
+	const char *names;
+	uint32_t count;
+	// Changes when the archive is rebuilt or replaced, even if the
+	// files end up in the same places in it.
+	uint64_t version;
+} archive_t;
+
+// A file found reading through the archive.
+typedef struct scanentry_s
+{
+	char *name;
+	// Hard links: the name of what it's a link to for tar, for cpio
+	// only the last link has the data and the others have the same ino.
+	char *link;
+	uint64_t offset, size, ino;
+	uint32_t nlink, order;
+} scanentry_t;
+
+typedef vec_t(scanentry_t) scanvec_t;
+
+static vec_t(archive_t*) archives;
+static uint64_t opens;
+
+// Archives have ./boot/x, /boot/x or boot/x, which are all boot/x to us.
+// Returns NULL for what can't be asked for anyway (see VFSOpen).
+static char *CleanName(const char *name, size_t len)
+{
+	while (len)
+	{
+		if (*name == '/')
+			name++, len--;
+		else if (len >= 2 && name[0] == '.' && name[1] == '/')
+			name += 2, len -= 2;
+		else
+			break;
+	}
+
+	while (len && name[len - 1] == '/')
+		len--;
+
+	if (!len || (len == 1 && *name == '.'))
+		return NULL;
+
+	char *s = strndup(name, len);
+	for (const char *p = s; (p = strstr(p, "..")); p += 2)
+	{
+		if ((p == s || p[-1] == '/') && (p[2] == '/' || !p[2]))
+		{
+			free(s);
+			return NULL;
+		}
+	}
+
+	return s;
+}
+
+static void AddEntry(scanvec_t *v, const char *name, size_t namelen, uint64_t offset, uint64_t size, const char *link, uint64_t ino, uint32_t nlink)
+{
+	scanentry_t e;
+
+	if (!(e.name = CleanName(name, namelen)))
+		return;
+
+	e.link   = link ? CleanName(link, strlen(link)) : NULL;
+	e.offset = offset;
+	e.size   = size;
+	e.ino    = ino;
+	e.nlink  = nlink;
+	e.order  = v->length;
+	vec_push(v, e);
+}
+
+static uint64_t TarNumber(const uint8_t *field, size_t len)
+{
+	uint64_t n = 0;
+	size_t i = 0;
+
+	// GNU tar's base 256, for files too big for the octal digits.
+	if (field[0] & 0x80)
+	{
+		for (i = 1; i < len; i++)
+			n = (n << 8) | field[i];
+		return n;
+	}
+
+	while (i < len && field[i] == ' ')
+		i++;
+
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		n = n * 8 + field[i] - '0';
+
+	return n;
+}
+
+static int TarChecksum(const uint8_t *h)
+{
+	uint64_t sum = 0;
+
+	// The checksum field counts as spaces.
+	for (int i = 0; i < 512; i++)
+		sum += i >= 148 && i < 156 ? ' ' : h[i];
+
+	return sum == TarNumber(h + 148, 8);
+}
+
+// pax extended headers are "<length> <key>=<value>\n" records
+// which override the name, link and size in the next header.
+static void ParsePax(const uint8_t *p, uint64_t len, char **name, char **link, uint64_t *size)
+{
+	const uint8_t *end = p + len;
+
+	while (p < end)
+	{
+		const uint8_t *q = p;
+		uint64_t reclen = 0;
+
+		while (q < end && isdigit(*q))
+			reclen = reclen * 10 + (*q++ - '0');
+
+		if (q == end || *q != ' ' || reclen <= (uint64_t)(q - p) + 1 || reclen > (uint64_t)(end - p) || p[reclen - 1] != '\n')
+			return;
+
+		const uint8_t *key = q + 1, *recend = p + reclen - 1;
+		const uint8_t *eq = memchr(key, '=', recend - key);
+		p += reclen;
+
+		if (!eq)
+			continue;
+
+		size_t keylen = eq - key, vallen = recend - eq - 1;
+		if (keylen == 4 && !memcmp(key, "path", 4))
+		{
+			free(*name);
+			*name = strndup((const char *)eq + 1, vallen);
+		}
+		else if (keylen == 8 && !memcmp(key, "linkpath", 8))
+		{
+			free(*link);
+			*link = strndup((const char *)eq + 1, vallen);
+		}
+		else if (keylen == 4 && !memcmp(key, "size", 4))
+		{
+			char *s = strndup((const char *)eq + 1, vallen);
+			*size = strtoull(s, NULL, 10);
+			free(s);
+		}
+	}
+}
+
+static int ScanTar(archive_t *a, scanvec_t *v)
+{
+	static const uint8_t zero[512];
+	char *longname = NULL, *longlink = NULL;
+	uint64_t pos = 0, paxsize = UINT64_MAX;
+	int ret = 0;
+
+	while (pos + 512 <= a->size)
+	{
+		const uint8_t *h = a->map + pos;
+
+		// Two empty blocks end the archive, one is enough for us.
+		if (!memcmp(h, zero, 512))
+			break;
+
+		if (!TarChecksum(h))
+		{
+			fprintf(stderr, "%s: bad tar header at offset %lu\n", a->file, (unsigned long)pos);
+			ret = -1;
+			break;
+		}
+
+		char type = h[156];
+		int meta = type == 'L' || type == 'K' || type == 'x' || type == 'g';
+		uint64_t data = pos + 512, size = TarNumber(h + 124, 12);
+
+		if (!meta && paxsize != UINT64_MAX)
+			size = paxsize;
+
+		if (size > a->size - data)
+		{
+			fprintf(stderr, "%s: truncated at offset %lu\n", a->file, (unsigned long)pos);
+			ret = -1;
+			break;
+		}
+
+		switch (type)
+		{
+			// GNU tar's long names and links are the data of a header of their own.
+			case 'L':
+				free(longname);
+				longname = strndup((const char *)a->map + data, size);
+				break;
+			case 'K':
+				free(longlink);
+				longlink = strndup((const char *)a->map + data, size);
+				break;
+			case 'x':
+				ParsePax(a->map + data, size, &longname, &longlink, &paxsize);
+				break;
+			case 'g':
+				break;
+			case '0':
+			case '\0':
+			case '7':
+			case '1':
+			{
+				char name[256 + 1], link[100 + 1];
+				const char *n = longname, *l = longlink;
+
+				if (!n)
+				{
+					// ustar splits long names in two.
+					size_t len = 0;
+					if (!memcmp(h + 257, "ustar", 6) && h[345])
+						len = snprintf(name, sizeof(name), "%.155s/", (const char *)h + 345);
+					snprintf(name + len, sizeof(name) - len, "%.100s", (const char *)h);
+					n = name;
+				}
+
+				if (type == '1' && !l)
+				{
+					snprintf(link, sizeof(link), "%.100s", (const char *)h + 157);
+					l = link;
+				}
+
+				if (type == '1')
+					AddEntry(v, n, strlen(n), 0, 0, l, 0, 0);
+				else
+					AddEntry(v, n, strlen(n), data, size, NULL, 0, 1);
+			}
+			// Fall through, whatever it was it's done with the long names.
+			default:
+				free(longname);
+				free(longlink);
+				longname = longlink = NULL;
+				paxsize = UINT64_MAX;
+		}
+
+		pos = data + ((size + 511) & ~511ULL);
+	}
+
+	free(longname);
+	free(longlink);
+	return ret;
+}
+
+static uint64_t CpioNumber(const uint8_t *p, int len, int base)
+{
+	uint64_t n = 0;
+
+	for (int i = 0; i < len; i++)
+	{
+		int d = isdigit(p[i]) ? p[i] - '0' : isxdigit(p[i]) ? (tolower(p[i]) - 'a' + 10) : base;
+		if (d >= base)
+			return UINT64_MAX;
+		n = n * base + d;
+	}
+
+	return n;
+}
+
+// Both the "new" (070701 and 070702) format, whose fields are hex and
+// which pads names and data to 4 bytes, and the old portable (070707)
+// format with its octal fields and no padding.
+static int ScanCpio(archive_t *a, scanvec_t *v)
+{
+	uint64_t pos = 0;
+
+	for (;;)
+	{
+		const uint8_t *h = a->map + pos;
+		uint64_t ino, mode, nlink, namesize, size, name, data, next;
+		int newc;
+
+		if (a->size - pos < 76 || memcmp(h, "07070", 5) || (h[5] != '1' && h[5] != '2' && h[5] != '7'))
+		{
+			fprintf(stderr, "%s: bad cpio header at offset %lu\n", a->file, (unsigned long)pos);
+			return -1;
+		}
+
+		newc = h[5] != '7';
+		if (newc && a->size - pos < 110)
+		{
+			fprintf(stderr, "%s: truncated at offset %lu\n", a->file, (unsigned long)pos);
+			return -1;
+		}
+
+		if (newc)
+		{
+			// Inode numbers are only unique within a device.
+			ino      = CpioNumber(h + 6, 8, 16) ^ (CpioNumber(h + 62, 8, 16) << 48) ^ (CpioNumber(h + 70, 8, 16) << 32);
+			mode     = CpioNumber(h + 14, 8, 16);
+			nlink    = CpioNumber(h + 38, 8, 16);
+			size     = CpioNumber(h + 54, 8, 16);
+			namesize = CpioNumber(h + 94, 8, 16);
+			name     = pos + 110;
+			data     = (name + namesize + 3) & ~3ULL;
+		}
+		else
+		{
+			ino      = CpioNumber(h + 12, 6, 8) ^ (CpioNumber(h + 6, 6, 8) << 32);
+			mode     = CpioNumber(h + 18, 6, 8);
+			nlink    = CpioNumber(h + 36, 6, 8);
+			namesize = CpioNumber(h + 59, 6, 8);
+			size     = CpioNumber(h + 65, 11, 8);
+			name     = pos + 76;
+			data     = name + namesize;
+		}
+
+		if (mode == UINT64_MAX || nlink == UINT64_MAX || namesize == UINT64_MAX || size == UINT64_MAX ||
+		    namesize > a->size - name || data > a->size || size > a->size - data)
+		{
+			fprintf(stderr, "%s: bad or truncated cpio header at offset %lu\n", a->file, (unsigned long)pos);
+			return -1;
+		}
+
+		const char *n = (const char *)a->map + name;
+		size_t nlen = strnlen(n, namesize);
+
+		if (nlen == 10 && !memcmp(n, "TRAILER!!!", 10))
+			break;
+
+		if (S_ISREG(mode))
+			AddEntry(v, n, nlen, data, size, NULL, ino, nlink);
+
+		next = newc ? (data + size + 3) & ~3ULL : data + size;
+		if (next >= a->size)
+			break;
+		pos = next;
+	}
+
+	return 0;
+}
+
+static int CompareScan(const void *a, const void *b)
+{
+	const scanentry_t *x = a, *y = b;
+	int r = strcmp(x->name, y->name);
+	return r ? r : (x->order > y->order) - (x->order < y->order);
+}
+
+static scanentry_t *FindScan(scanvec_t *v, const char *name)
+{
+	int lo = 0, hi = v->length - 1;
+
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2, r = strcmp(name, v->data[mid].name);
+		if (!r)
+			return &v->data[mid];
+		if (r < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+// Sort what we found, give hard links their data and lay it all out as an index.
+static void *BuildIndex(archive_t *a, scanvec_t *v, const struct stat *sb, size_t *len)
+{
+	scanentry_t *e, *f;
+	int i, j;
+
+	// cpio only stores the data with the last link to it.
+	for (i = 0; i < v->length; i++)
+	{
+		e = &v->data[i];
+		for (j = 0; e->nlink > 1 && !e->size && j < v->length; j++)
+		{
+			f = &v->data[j];
+			if (f->ino == e->ino && f->size)
+			{
+				e->offset = f->offset;
+				e->size = f->size;
+			}
+		}
+	}
+
+	// When an archive has the same name twice the last one wins, like unpacking it would.
+	vec_sort(v, CompareScan);
+	for (i = 0, j = 0; i < v->length; i++)
+	{
+		if (i + 1 < v->length && !strcmp(v->data[i].name, v->data[i + 1].name))
+		{
+			free(v->data[i].name);
+			free(v->data[i].link);
+			continue;
+		}
+		v->data[j++] = v->data[i];
+	}
+	vec_truncate(v, j);
+
+	// tar links are to a name, which can itself be a link.
+	vec_foreach_ptr(v, e, i)
+	{
+		f = e;
+		for (int hops = 0; f && f->link && hops < 8; hops++)
+			f = FindScan(v, f->link);
+
+		if (f && !f->link)
+		{
+			e->offset = f->offset;
+			e->size = f->size;
+			e->nlink = 1;
+		}
+	}
+
+	size_t namesize = 0;
+	uint32_t count = 0;
+	vec_foreach_ptr(v, e, i)
+	{
+		// Links to nothing we have.
+		if (e->link && e->nlink != 1)
+			continue;
+		namesize += strlen(e->name) + 1;
+		count++;
+	}
+
+	*len = sizeof(indexheader_t) + count * sizeof(indexentry_t) + namesize;
+	uint8_t *index = nmalloc(*len);
+	indexheader_t *hdr = (indexheader_t *)index;
+	indexentry_t *entries = (indexentry_t *)(hdr + 1);
+	char *names = (char *)(entries + count);
+
+	memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->size      = sb->st_size;
+	hdr->ino       = sb->st_ino;
+	hdr->mtime     = sb->st_mtim.tv_sec;
+	hdr->mtimensec = sb->st_mtim.tv_nsec;
+	hdr->count     = count;
+	hdr->namesize  = namesize;
+
+	size_t off = 0;
+	j = 0;
+	vec_foreach_ptr(v, e, i)
+	{
+		if (e->link && e->nlink != 1)
+			continue;
+
+		entries[j].offset  = e->offset;
+		entries[j].size    = e->size;
+		entries[j].name    = off;
+		entries[j].namelen = strlen(e->name);
+		memcpy(names + off, e->name, entries[j].namelen + 1);
+		off += entries[j++].namelen + 1;
+	}
+
+	return index;
+}
+
+// Write the index next to the archive for next time. Not being
+// able to (a read-only directory, say) only costs us a rescan.
+static void WriteIndex(archive_t *a, const void *index, size_t len)
+{
+	char *path = stringify("%s" ARCHIVE_INDEX_SUFFIX, a->file);
+	char *tmp = stringify("%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+
+	if (fd == -1)
+		goto fail;
+
+	for (size_t done = 0; done < len;)
+	{
+		ssize_t w = write(fd, (const uint8_t *)index + done, len - done);
+		if (w == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			unlink(tmp);
+			goto fail;
+		}
+		done += w;
+	}
+
+	fchmod(fd, 0644);
+	close(fd);
+
+	if (rename(tmp, path) == -1)
+	{
+		unlink(tmp);
+		goto fail;
+	}
+
+	free(tmp);
+	free(path);
+	return;
+
+fail:
+	fprintf(stderr, "WARNING: Failed to write the index for %s to %s: %s\n", a->file, path, strerror(errno));
+	free(tmp);
+	free(path);
+}
+
+// Use the index if it's there and still for this archive.
+static int LoadIndex(archive_t *a, const struct stat *sb)
+{
+	char *path = stringify("%s" ARCHIVE_INDEX_SUFFIX, a->file);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+
+	if (fd == -1)
+		return -1;
+
+	struct stat isb;
+	void *m = MAP_FAILED;
+	if (fstat(fd, &isb) == 0 && (size_t)isb.st_size >= sizeof(indexheader_t))
+		m = mmap(NULL, isb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (m == MAP_FAILED)
+		return -1;
+
+	const indexheader_t *hdr = m;
+	const indexentry_t *entries = (const indexentry_t *)(hdr + 1);
+	int ok = !memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) && hdr->size == (uint64_t)sb->st_size &&
+	         hdr->ino == (uint64_t)sb->st_ino && hdr->mtime == sb->st_mtim.tv_sec && hdr->mtimensec == sb->st_mtim.tv_nsec &&
+	         (uint64_t)isb.st_size == sizeof(indexheader_t) + (uint64_t)hdr->count * sizeof(indexentry_t) + hdr->namesize;
+
+	// Don't trust it to point inside the archive.
+	for (uint32_t i = 0; ok && i < hdr->count; i++)
+	{
+		ok = (uint64_t)entries[i].name + entries[i].namelen < hdr->namesize &&
+		     entries[i].offset <= a->size && entries[i].size <= a->size - entries[i].offset;
+	}
+
+	if (!ok)
+	{
+		munmap(m, isb.st_size);
+		return -1;
+	}
+
+	a->index       = m;
+	a->indexlen    = isb.st_size;
+	a->indexmapped = 1;
+	return 0;
+}
+
+static void CloseArchive(archive_t *a)
+{
+	if (a->map)
+		munmap((void *)a->map, a->size);
+
+	if (a->index && a->indexmapped)
+		munmap(a->index, a->indexlen);
+	else
+		free(a->index);
+
+	free(a->file);
+	free(a->path);
+	free(a);
+}
+
+static archive_t *OpenArchive(const char *file, const char *path)
+{
+	archive_t *a = nmalloc(sizeof(archive_t));
+	a->file = strdup(file);
+
+	// Where it goes in what we serve, no slashes either end.
+	while (path && *path == '/')
+		path++;
+	a->path = strdup(path ? path : "");
+	a->pathlen = strlen(a->path);
+	while (a->pathlen && a->path[a->pathlen - 1] == '/')
+		a->path[--a->pathlen] = 0;
+
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+
+	if (fd == -1 || fstat(fd, &sb) == -1)
+	{
+		fprintf(stderr, "Failed to open archive %s: %s\n", file, strerror(errno));
+		goto fail;
+	}
+
+	if (!S_ISREG(sb.st_mode) || sb.st_size < 512)
+	{
+		fprintf(stderr, "Failed to open archive %s: not a tar or cpio archive\n", file);
+		goto fail;
+	}
+
+	a->size = sb.st_size;
+	a->version = ((uint64_t)sb.st_mtim.tv_sec * SECONDS + sb.st_mtim.tv_nsec) ^ ((uint64_t)sb.st_ino * 1099511628211ULL);
+	void *map = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map archive %s: %s\n", file, strerror(errno));
+		goto fail;
+	}
+	a->map = map;
+	close(fd);
+	fd = -1;
+
+	uint64_t start = MonotonicTime();
+	int loaded = LoadIndex(a, &sb) == 0;
+
+	if (!loaded)
+	{
+		scanvec_t v;
+		int ret;
+		vec_init(&v);
+
+		// Headers are spread all over it, and we only look at each once.
+		madvise(map, a->size, MADV_SEQUENTIAL);
+
+		if (!memcmp(a->map, "07070", 5))
+			ret = ScanCpio(a, &v);
+		else if (!memcmp(a->map + 257, "ustar", 5) || TarChecksum(a->map))
+			ret = ScanTar(a, &v);
+		else
+		{
+			// squashfs and compressed archives don't keep files whole.
+			if (!memcmp(a->map, "hsqs", 4))
+				fprintf(stderr, "Failed to open archive %s: squashfs images are compressed, use a tar or cpio archive\n", file);
+			else
+				fprintf(stderr, "Failed to open archive %s: not a tar or cpio archive (a compressed one has to be decompressed first)\n", file);
+			ret = -1;
+		}
+
+		if (ret == 0)
+		{
+			a->index = BuildIndex(a, &v, &sb, &a->indexlen);
+			WriteIndex(a, a->index, a->indexlen);
+		}
+
+		scanentry_t e;
+		int i;
+		vec_foreach(&v, e, i)
+		{
+			free(e.name);
+			free(e.link);
+		}
+		vec_deinit(&v);
+
+		madvise(map, a->size, MADV_NORMAL);
+
+		if (ret == -1)
+			goto fail;
+	}
+
+	const indexheader_t *hdr = a->index;
+	a->count   = hdr->count;
+	a->entries = (const indexentry_t *)(hdr + 1);
+	a->names   = (const char *)(a->entries + a->count);
+
+	printf("Serving %u files from %s at /%s (index %s in %lu ms)\n", a->count, file, a->path,
+	       loaded ? "loaded" : "built", (unsigned long)((MonotonicTime() - start) / MILLISECONDS));
+	return a;
+
+fail:
+	if (fd != -1)
+		close(fd);
+	CloseArchive(a);
+	return NULL;
+}
+
+static const indexentry_t *FindEntry(const archive_t *a, const char *name)
+{
+	size_t len = strlen(name);
+	int64_t lo = 0, hi = (int64_t)a->count - 1;
+
+	while (lo <= hi)
+	{
+		int64_t mid = (lo + hi) / 2;
+		const indexentry_t *e = &a->entries[mid];
+		int r = strncmp(name, a->names + e->name, MIN(len, e->namelen));
+
+		if (!r)
+			r = (len > e->namelen) - (len < e->namelen);
+		if (!r)
+			return e;
+		if (r < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+static int ArchiveOpen(vfile_t *vf, const char *path, const socketstructs_t *peer)
+{
+	archive_t *a;
+	int i;
+
+	vec_foreach(&archives, a, i)
+	{
+		const char *name = path;
+
+		if (a->pathlen)
+		{
+			if (strncmp(path, a->path, a->pathlen) || path[a->pathlen] != '/')
+				continue;
+			name = path + a->pathlen + 1;
+		}
+
+		const indexentry_t *e = FindEntry(a, name);
+		if (!e)
+			continue;
+
+		// Which archive it is and where the file is in it is as good as an inode.
+		vf->size = e->size;
+		vf->map  = a->map + e->offset;
+		vf->dev  = i;
+		vf->ino  = e->offset;
+		vf->version = a->version;
+
+		// Blocks are copied out of the map on the main thread, have the
+		// kernel start reading the file now instead of on the first fault.
+		if (e->size)
+		{
+			uintptr_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+			uintptr_t begin = (uintptr_t)vf->map & ~pagemask;
+			uintptr_t end = (uintptr_t)vf->map + MIN(e->size, ARCHIVE_READAHEAD);
+			madvise((void *)begin, end - begin, MADV_WILLNEED);
+		}
+
+		opens++;
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+static void ArchiveRead(vfile_t *vf, iorequest_t *req)
+{
+	// Never called, VFSRead copies out of the map.
+	req->result = -1;
+	req->error = EIO;
+	req->complete(req);
+}
+
+static void ArchiveClose(vfile_t *vf)
+{
+}
+
+static const backend_t archivebackend = {
+	"archive", VFS_SHARED | VFS_MAPPED,
+	ArchiveOpen, NULL, ArchiveRead, NULL, NULL, ArchiveClose
+};
+
+void InitializeArchives(void)
+{
+	conf_archive_t *ca;
+	int i;
+
+	vec_init(&archives);
+
+	vec_foreach(&config->archiveblocks, ca, i)
+	{
+		archive_t *a = OpenArchive(ca->file, ca->path);
+		if (a)
+			vec_push(&archives, a);
+	}
+
+	if (archives.length)
+		RegisterBackend(&archivebackend);
+}
+
+// Only once no client has a file from them open.
+void ShutdownArchives(void)
+{
+	archive_t *a;
+	int i;
+
+	if (!archives.length)
+		return;
+
+	UnregisterBackend(&archivebackend);
+
+	vec_foreach(&archives, a, i)
+		CloseArchive(a);
+
+	vec_deinit(&archives);
+}
+
+void PrintArchiveStatistics(void)
+{
+	archive_t *a;
+	uint64_t files = 0;
+	int i;
+
+	if (!archives.length)
+		return;
+
+	vec_foreach(&archives, a, i)
+		files += a->count;
+
+	printf("Archives: %d archives with %lu files, %lu files opened\n",
+	       archives.length, (unsigned long)files, (unsigned long)opens);
+}
@@ -19,6 +19,7 @@ typedef struct client_s client_t;
 #include "vec.h"
 #include "misc.h"
 #include "module.h"
+#include "multicast.h"
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
@@ -42,6 +43,7 @@ void AddClient(client_t *c)
 	// The transfer ID is given as the port.
 	c->tid = -GetPort(c->s);
 	c->blksize = 512;
+	c->windowsize = c->cwnd = c->ssthresh = c->burstleft = 1;
 }
 
 client_t *FindOrAllocateClient(socket_t cs)
@@ -71,18 +73,12 @@ client_t *FindOrAllocateClient(socket_t cs)
 	return found;
 }
 
-void RemoveClient(client_t *c)
+// Free everything the client owns. Only safe once no I/O is in flight.
+static void FreeClient(client_t *c)
 {
-	assert(c);
 	packetqueue_t pq;
 	int idx;
 
-	// Remove the socket from the socket pool
-	DestroySocket(c->s, 0);
-
-	// Remove the client from the client pool
-	vec_remove(&clientpool, c);
-
 	// Free any remaining packets that are in the packet queue
 	vec_foreach(&c->packetqueue_vec, pq, idx)
 	{
@@ -97,17 +93,88 @@ void RemoveClient(client_t *c)
 	if (c->lastpacket.allocated)
 		free(c->lastpacket.p);
 
-	// Remove the client's block buffer.
+	// Remove the client's block buffers.
 	if (c->blk)
 		free(c->blk);
 
-	printf("Removing client\n");
+	if (c->nextblk)
+		free(c->nextblk);
+
+	if (c->recvbuf)
+		free(c->recvbuf);
+
+	if (c->recvlens)
+		free(c->recvlens);
+
+	if (c->writeiov)
+		free(c->writeiov);
+
+	if (c->asciibuf)
+		free(c->asciibuf);
+
+	if (c->asciistarts)
+		free(c->asciistarts);
+
+	if (c->sendtimes)
+		free(c->sendtimes);
+
+	if (c->request)
+		free(c->request);
+
+	// If we're reading or writing a file, close it. An upload
+	// that never finished gets thrown away.
+	VFSClose(c->file);
 
 	// Delete the client
 	free(c);
 }
 
+void RemoveClient(client_t *c)
+{
+	assert(c);
+
+	// Remove the socket from the socket pool
+	DestroySocket(c->s, 0);
+
+	// Remove the client from the client pool
+	vec_remove(&clientpool, c);
+
+	printf("Removing client\n");
+
+	CancelTimer(&c->windowtimer);
+	CancelTimer(&c->pacetimer);
+
+	// Let the other clients on our stream get on without us.
+	DetachStream(c);
+	LeaveMulticast(c);
+
+	// The I/O pool still has our buffers, FinishClientIO will
+	// free the client once it gives them back.
+	if (c->iopending)
+	{
+		c->removed = 1;
+		return;
+	}
+
+	FreeClient(c);
+}
+
+// Called from I/O completions, returns 1 if the client was removed while
+// the I/O was in flight (in which case it may now be freed).
+int FinishClientIO(client_t *c)
+{
+	assert(c && c->iopending > 0);
+
+	c->iopending--;
 
+	if (!c->removed)
+		return 0;
+
+	if (!c->iopending)
+		FreeClient(c);
+
+	return 1;
+}
 
 int CompareClients(client_t *c1, client_t *c2)
 {
@@ -124,6 +191,10 @@ client_t *FindClient(socket_t s)
 		if ((&clientpool)->data[idx]->s.fd == s.fd)
 		{
 			client_t *c = (&clientpool)->data[idx];
+			// Multicast groups never send us anything.
+			if (IsMulticastGroup(c))
+				continue;
+
 			if (c->tid == -GetPort(s))
 				return c;
 		}
@@ -142,6 +213,7 @@ void DeallocateClients(void)
 	vec_foreach(&clientpool, c, i)
 	{
 		vec_deinit(&c->packetqueue_vec);
+		free(c->request);
 		free(c);
 	}
 
@@ -166,7 +238,7 @@ void CheckClients(void)
 				continue;
 			}
 
-			struct { client_t *c; const packet_t *p; size_t len; } ev = { c, c->lastpacket.p, c->lastpacket.len };
+			evresend_t ev = { c, c->lastpacket.p, c->lastpacket.len };
 			CallEvent(EV_RESEND, &ev);
 
 			bprintf("Resending last packet, retry %d/3\n", c->waiting);
@@ -176,3 +248,22 @@ void CheckClients(void)
 		}
 	}
 }
+
+void PrintClientStatistics(void)
+{
+	client_t *c = NULL;
+	int i;
+
+	vec_foreach(&clientpool, c, i)
+	{
+		if (!c->sendingfile || !c->file)
+			continue;
+
+		// What the window works out to, which is what pacing sends at.
+		double rate = c->srtt ? (c->cwnd * c->blksize * 8.0 * SECONDS) / c->srtt / 1000000.0 : 0.0;
+
+		printf("Client %s: block %lu, window %u of %u, rtt %.2fms (%.1f Mbit/s), %lu losses, %.1f%% resent\n",
+		       GetAddress(c->s.addr), (unsigned long)c->actualblockno, c->cwnd, c->windowsize, c->srtt / 1000000.0, rate,
+		       (unsigned long)c->losses, c->blockssent ? (c->blocksresent * 100.0) / c->blockssent : 0.0);
+	}
+}
@@ -21,12 +21,68 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 extern FILE *yyin;
 extern int yyparse();
 extern void yylex_destroy();
 extern int lineno;
 
+static void FreeTemplateBlock(conf_template_t *t)
+{
+	free(t->match);
+	free(t->file);
+	free(t->data);
+	free(t);
+}
+
+static void FreeArchiveBlock(conf_archive_t *a)
+{
+	free(a->file);
+	free(a->path);
+	free(a);
+}
+
+static void FreeUpstreamBlock(conf_upstream_t *u)
+{
+	free(u->path);
+	free(u->url);
+	free(u->cache);
+	free(u);
+}
+
+static void FreeHTTPBlock(conf_http_t *h)
+{
+	free(h->bindaddr);
+	free(h);
+}
+
+static void FreePreloadBlock(conf_preload_t *p)
+{
+	char *match;
+	int i;
+
+	vec_foreach(&p->match, match, i)
+		free(match);
+	vec_deinit(&p->match);
+	free(p);
+}
+
+static void FreePeersBlock(conf_peers_t *p)
+{
+	char *peer;
+	int i;
+
+	vec_foreach(&p->peers, peer, i)
+		free(peer);
+	vec_deinit(&p->peers);
+
+	free(p->bindaddr);
+	free(p->self);
+	free(p);
+}
+
 int ParseConfig(const char *filename)
 {
 	FILE *fd = fopen(filename, "r");
@@ -47,15 +103,63 @@ int ParseConfig(const char *filename)
 	if (config)
 	{
 		printf(" Directory: %s\n User: %s\n Group: %s\n Daemonize: %d\n"
-			" Pidfile: %s\n Read Timeout: %d\n",
+			" Pidfile: %s\n Read Timeout: %d\n I/O Threads: %d\n Shared Streams: %d\n Prefetch: %d\n"
+			" Multicast: %s:%d\n Max Window Size: %d\n Pacing: %d\n Block Rollover: %d\n Upload Sync: %d\n"
+			" Event Queue: %d\n Event Overflow: %d\n",
 			config->directory, config->user, config->group, config->daemonize, config->pidfile,
-			config->readtimeout);
+			config->readtimeout, config->iothreads, config->sharedstreams, config->prefetch, config->multicastaddr,
+			config->multicastport, config->maxwindowsize, config->pacing,
+			config->blockrollover, config->uploadsync, config->eventqueue, config->eventoverflow);
 		
 		listen_t *block;
 		int i = 0;
 		vec_foreach(&config->listenblocks, block, i)
 		{
-			printf("Listening On:\n Bind: %s\n Port: %d\n", block->bindaddr, block->port);
+			printf("Listening On:\n Bind: %s\n Port: %d\n MTU: %d\n", block->bindaddr, block->port, block->mtu);
+		}
+
+		conf_template_t *t;
+		vec_foreach(&config->templateblocks, t, i)
+		{
+			printf("Template:\n Match: %s\n File: %s\n Data: %s\n", t->match, t->file, t->data);
+		}
+
+		conf_archive_t *a;
+		vec_foreach(&config->archiveblocks, a, i)
+		{
+			printf("Archive:\n File: %s\n Path: %s\n", a->file, a->path);
+		}
+
+		conf_upstream_t *u;
+		vec_foreach(&config->upstreamblocks, u, i)
+		{
+			printf("Upstream:\n Path: %s\n URL: %s\n Cache: %s\n Revalidate: %d\n Timeout: %d\n", u->path, u->url, u->cache, u->revalidate, u->timeout);
+		}
+
+		conf_peers_t *p;
+		vec_foreach(&config->peerblocks, p, i)
+		{
+			printf("Peers:\n Bind: %s\n Port: %d\n Self: %s\n Revalidate: %d\n Timeout: %d\n", p->bindaddr, p->port, p->self, p->revalidate, p->timeout);
+			char *peer;
+			int j;
+			vec_foreach(&p->peers, peer, j)
+				printf(" Peer: %s\n", peer);
+		}
+
+		conf_http_t *h;
+		vec_foreach(&config->httpblocks, h, i)
+		{
+			printf("HTTP:\n Bind: %s\n Port: %d\n", h->bindaddr, h->port);
+		}
+
+		conf_preload_t *pl;
+		vec_foreach(&config->preloadblocks, pl, i)
+		{
+			printf("Preload:\n Pin: %d\n Huge Pages: %d\n", pl->pin, pl->hugepages);
+			char *match;
+			int j;
+			vec_foreach(&pl->match, match, j)
+				printf(" Match: %s\n", match);
 		}
 		
 	}
@@ -84,6 +188,198 @@ int ParseConfig(const char *filename)
 		config->readtimeout = 5;
 	}
 	
+	if (config->iothreads < 0)
+	{
+		fprintf(stderr, "Error: I/O thread count cannot be negative! Setting to default of 4.\n");
+		config->iothreads = 4;
+	}
+
+	if (config->multicastaddr)
+	{
+		struct in_addr addr;
+		if (inet_pton(AF_INET, config->multicastaddr, &addr) != 1 || !IN_MULTICAST(ntohl(addr.s_addr)))
+		{
+			fprintf(stderr, "Error: %s is not an IPv4 multicast address! Multicast is disabled.\n", config->multicastaddr);
+			free(config->multicastaddr);
+			config->multicastaddr = NULL;
+		}
+	}
+
+	if (config->multicastport < 1 || config->multicastport > 65535)
+	{
+		fprintf(stderr, "Error: Multicast port must be between 1 and 65535! Setting to default of 1758.\n");
+		config->multicastport = 1758;
+	}
+
+	if (config->maxwindowsize < 1 || config->maxwindowsize > 65535)
+	{
+		fprintf(stderr, "Error: Max window size must be between 1 and 65535! Setting to default of 64.\n");
+		config->maxwindowsize = 64;
+	}
+
+	if (config->pacing == -1)
+	{
+		fprintf(stderr, "Error: Pacing must be one of \"off\", \"timer\" or \"txtime\"! Setting to default of \"timer\".\n");
+		config->pacing = PACING_TIMER;
+	}
+
+	if (config->blockrollover != 0 && config->blockrollover != 1)
+	{
+		fprintf(stderr, "Error: Block rollover must be 0 or 1! Setting to default of 0.\n");
+		config->blockrollover = 0;
+	}
+
+	if (config->uploadsync == -1)
+	{
+		fprintf(stderr, "Error: Upload sync must be one of \"off\", \"file\" or \"full\"! Setting to default of \"file\".\n");
+		config->uploadsync = SYNC_FILE;
+	}
+
+	if (config->eventqueue < 16 || config->eventqueue > 1048576)
+	{
+		fprintf(stderr, "Error: Event queue must be between 16 and 1048576! Setting to default of 4096.\n");
+		config->eventqueue = 4096;
+	}
+
+	if (config->eventoverflow == -1)
+	{
+		fprintf(stderr, "Error: Event overflow must be \"drop\" or \"block\"! Setting to default of \"drop\".\n");
+		config->eventoverflow = EVENTS_DROP;
+	}
+
+	listen_t *block;
+	int i = 0;
+	vec_foreach(&config->listenblocks, block, i)
+	{
+		// 68 is the smallest MTU IPv4 allows.
+		if (block->mtu != 0 && (block->mtu < 68 || block->mtu > 65535))
+		{
+			fprintf(stderr, "Error: MTU must be between 68 and 65535! Going by the route MTU only.\n");
+			block->mtu = 0;
+		}
+	}
+
+	conf_template_t *t;
+	for (i = 0; i < config->templateblocks.length; i++)
+	{
+		t = config->templateblocks.data[i];
+		if (!t->match || !t->file)
+		{
+			fprintf(stderr, "Error: Template blocks need both match and file! Ignoring the template block.\n");
+			FreeTemplateBlock(t);
+			vec_splice(&config->templateblocks, i--, 1);
+		}
+	}
+
+	conf_archive_t *a;
+	for (i = 0; i < config->archiveblocks.length; i++)
+	{
+		a = config->archiveblocks.data[i];
+		if (!a->file)
+		{
+			fprintf(stderr, "Error: Archive blocks need a file! Ignoring the archive block.\n");
+			FreeArchiveBlock(a);
+			vec_splice(&config->archiveblocks, i--, 1);
+		}
+	}
+
+	conf_upstream_t *u;
+	for (i = 0; i < config->upstreamblocks.length; i++)
+	{
+		u = config->upstreamblocks.data[i];
+		if (!u->path || !u->url || !u->cache)
+		{
+			fprintf(stderr, "Error: Upstream blocks need a path, url and cache! Ignoring the upstream block.\n");
+			FreeUpstreamBlock(u);
+			vec_splice(&config->upstreamblocks, i--, 1);
+			continue;
+		}
+
+		if (u->revalidate < 0)
+		{
+			fprintf(stderr, "Error: Upstream revalidate cannot be negative! Using 60.\n");
+			u->revalidate = 60;
+		}
+
+		if (u->timeout < 1)
+		{
+			fprintf(stderr, "Error: Upstream timeout must be at least a second! Using 5.\n");
+			u->timeout = 5;
+		}
+	}
+
+	// There's only the one ring.
+	conf_peers_t *p;
+	for (i = 0; i < config->peerblocks.length; i++)
+	{
+		p = config->peerblocks.data[i];
+		if (i > 0 || p->port <= 0 || p->port > 65535 || !p->self)
+		{
+			fprintf(stderr, i > 0 ? "Error: Only one peers block is allowed! Ignoring the extra one.\n"
+			                      : "Error: Peers blocks need a port and self! Ignoring the peers block.\n");
+			FreePeersBlock(p);
+			vec_splice(&config->peerblocks, i--, 1);
+			continue;
+		}
+
+		if (p->revalidate < 0)
+		{
+			fprintf(stderr, "Error: Peers revalidate cannot be negative! Using 10.\n");
+			p->revalidate = 10;
+		}
+
+		if (p->timeout < 1)
+		{
+			fprintf(stderr, "Error: Peers timeout must be at least a second! Using 2.\n");
+			p->timeout = 2;
+		}
+	}
+
+	conf_http_t *h;
+	for (i = 0; i < config->httpblocks.length; i++)
+	{
+		h = config->httpblocks.data[i];
+		if (h->port <= 0 || h->port > 65535)
+		{
+			fprintf(stderr, "Error: HTTP port %d is not a port! Ignoring the http block.\n", h->port);
+			FreeHTTPBlock(h);
+			vec_splice(&config->httpblocks, i--, 1);
+		}
+	}
+
+	conf_preload_t *pl;
+	for (i = 0; i < config->preloadblocks.length; i++)
+	{
+		pl = config->preloadblocks.data[i];
+
+		// Globs are matched in the directory and nowhere else.
+		for (int j = 0; j < pl->match.length; j++)
+		{
+			char *match = pl->match.data[j];
+			int climbs = 0;
+
+			for (const char *m = match; (m = strstr(m, "..")); m += 2)
+			{
+				if ((m == match || m[-1] == '/') && (m[2] == '/' || !m[2]))
+					climbs = 1;
+			}
+
+			if (*match == '/' || climbs)
+			{
+				fprintf(stderr, "Error: Preload match %s is outside the directory! Ignoring it.\n", match);
+				free(match);
+				vec_splice(&pl->match, j--, 1);
+			}
+		}
+
+		if (!pl->match.length)
+		{
+			fprintf(stderr, "Error: Preload blocks need something to match! Ignoring the preload block.\n");
+			FreePreloadBlock(pl);
+			vec_splice(&config->preloadblocks, i--, 1);
+		}
+	}
+
 	// It is stupid to do an access check here and should be done when
 	// we're about to switch users (or just after)
 	
@@ -92,13 +388,14 @@ int ParseConfig(const char *filename)
 
 void DeallocateConfig(config_t *conf)
 {
-	if (!config)
+	// This is the old config on rehash, not necessarily the one in use.
+	if (!conf)
 		return;
 
 	// Clear memory.
 	listen_t *block;
 	int i = 0;
-	vec_foreach(&config->listenblocks, block, i)
+	vec_foreach(&conf->listenblocks, block, i)
 	{
 		if (block->bindaddr)
 			free(block->bindaddr);
@@ -106,10 +403,10 @@ void DeallocateConfig(config_t *conf)
 		free(block);
 	}
 	
-	vec_deinit(&config->listenblocks);
+	vec_deinit(&conf->listenblocks);
 	
 	conf_module_t *m;
-	vec_foreach(&config->moduleblocks, m, i)
+	vec_foreach(&conf->moduleblocks, m, i)
 	{
 		if (m->name)
 			free(m->name);
@@ -118,7 +415,43 @@ void DeallocateConfig(config_t *conf)
 			free(m->path);
 	}
 	
-	vec_deinit(&config->moduleblocks);
+	vec_deinit(&conf->moduleblocks);
+
+	conf_template_t *t;
+	vec_foreach(&conf->templateblocks, t, i)
+		FreeTemplateBlock(t);
+
+	vec_deinit(&conf->templateblocks);
+
+	conf_archive_t *a;
+	vec_foreach(&conf->archiveblocks, a, i)
+		FreeArchiveBlock(a);
+
+	vec_deinit(&conf->archiveblocks);
+
+	conf_upstream_t *u;
+	vec_foreach(&conf->upstreamblocks, u, i)
+		FreeUpstreamBlock(u);
+
+	vec_deinit(&conf->upstreamblocks);
+
+	conf_peers_t *p;
+	vec_foreach(&conf->peerblocks, p, i)
+		FreePeersBlock(p);
+
+	vec_deinit(&conf->peerblocks);
+
+	conf_http_t *h;
+	vec_foreach(&conf->httpblocks, h, i)
+		FreeHTTPBlock(h);
+
+	vec_deinit(&conf->httpblocks);
+
+	conf_preload_t *pl;
+	vec_foreach(&conf->preloadblocks, pl, i)
+		FreePreloadBlock(pl);
+
+	vec_deinit(&conf->preloadblocks);
 
 	if (conf->user)
 		free(conf->user);
@@ -126,6 +459,9 @@ void DeallocateConfig(config_t *conf)
 	if (conf->group)
 		free(conf->group);
 
+	if (conf->multicastaddr)
+		free(conf->multicastaddr);
+
 	free(conf->directory);
 	free(conf);
 }
@@ -13,16 +13,37 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include "filesystem.h"
+#include "sysconf.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
 #include <pwd.h>    // For /etc/passwd related functions
 #include <grp.h>    // For /etc/group related functions
 
+#ifdef HAVE_LINUX_OPENAT2_H
+# include <linux/openat2.h>
+# include <sys/syscall.h>
+#endif
+
+// Not every platform has O_PATH, a plain read-only directory
+// descriptor works just as well as an anchor for openat().
+#ifdef O_PATH
+# define ROOT_OPEN_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+# define ROOT_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+// The directory we serve files from. Every request is resolved
+// relative to this descriptor so we never walk config->directory
+// again and can never leave it.
+static int rootfd = -1;
+
 int FileExists(const char *file)
 {
 	struct stat sb;
@@ -131,4 +152,239 @@ void FixPath(char *str)
 		if (str[len] == '\\')
 			str[len] = '/';
 	}
-}
\ No newline at end of file
+}
+// Open the directory we serve files from and keep it around
+// for OpenBeneathRoot. Calling this again (eg, on rehash)
+// replaces the old root.
+int OpenServeRoot(const char *dir)
+{
+	assert(dir);
+
+	int fd = open(dir, ROOT_OPEN_FLAGS);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Cannot open serve directory %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	if (rootfd != -1)
+		close(rootfd);
+
+	rootfd = fd;
+	return 0;
+}
+
+void CloseServeRoot(void)
+{
+	if (rootfd != -1)
+		close(rootfd);
+
+	rootfd = -1;
+}
+
+// Fallback for kernels without openat2(). Walk the path one component
+// at a time with openat(), refusing ".." and symlinks so the result is
+// guaranteed to be inside the root. This is stricter than RESOLVE_BENEATH
+// (which allows symlinks that stay inside the root) but it is safe.
+static int WalkBeneathRoot(const char *path, int flags, mode_t mode)
+{
+	char *copy = strdup(path);
+	if (!copy)
+		return -1;
+
+	int dirfd = rootfd, fd = -1;
+	char *save = NULL;
+	char *component = strtok_r(copy, "/", &save);
+
+	if (!component)
+		errno = EISDIR;
+
+	while (component)
+	{
+		char *next = strtok_r(NULL, "/", &save);
+
+		if (!strcmp(component, ".."))
+		{
+			errno = EXDEV;
+			break;
+		}
+
+		// Last component, this is the file they actually want.
+		if (!next)
+		{
+			fd = openat(dirfd, component, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+			break;
+		}
+
+		int nextfd = openat(dirfd, component, ROOT_OPEN_FLAGS | O_NOFOLLOW);
+		if (dirfd != rootfd)
+			close(dirfd);
+
+		dirfd = nextfd;
+		if (dirfd == -1)
+			break;
+
+		component = next;
+	}
+
+	if (dirfd != rootfd && dirfd != -1)
+	{
+		int saved = errno;
+		close(dirfd);
+		errno = saved;
+	}
+
+	free(copy);
+	return fd;
+}
+
+// Open a file relative to the serve root. Any attempt to escape the
+// root (eg, "../../etc/shadow") fails with EXDEV. Leading slashes are
+// ignored since lots of netboot clients ask for "/pxelinux.0".
+int OpenBeneathRoot(const char *path, int flags, mode_t mode)
+{
+	assert(path);
+
+	if (rootfd == -1)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	while (*path == '/')
+		path++;
+
+#ifdef HAVE_LINUX_OPENAT2_H
+	// Set once we find out the kernel has no idea what openat2 is.
+	static int noopenat2 = 0;
+
+	if (!noopenat2)
+	{
+		struct open_how how;
+		memset(&how, 0, sizeof(struct open_how));
+		how.flags   = flags | O_CLOEXEC;
+		how.mode    = (flags & O_CREAT) ? mode : 0;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+		int fd = syscall(SYS_openat2, rootfd, path, &how, sizeof(struct open_how));
+		if (fd != -1 || errno != ENOSYS)
+			return fd;
+
+		noopenat2 = 1;
+	}
+#endif
+
+	return WalkBeneathRoot(path, flags, mode);
+}
+
+// Split path (relative to the root) into the directory it's in and its name.
+static char *SplitPath(const char *path, const char **name)
+{
+	while (*path == '/')
+		path++;
+
+	char *dir = strdup(path);
+	if (!dir)
+		return NULL;
+
+	char *slash = strrchr(dir, '/');
+	if (slash)
+	{
+		*slash = 0;
+		*name = path + (slash - dir) + 1;
+	}
+	else
+	{
+		strcpy(dir, ".");
+		*name = path;
+	}
+
+	return dir;
+}
+
+// Make a new file to write path into without touching path itself, so
+// nobody reading it ever sees half a file. dirfd is set to the directory
+// it's in and tmpname to its name there (free it when done), once it's
+// all written RenameBeneathRoot puts it in place.
+int CreateBeneathRoot(const char *path, mode_t mode, int *dirfd, char **tmpname)
+{
+	assert(path && dirfd && tmpname);
+
+	static unsigned int counter = 0;
+	const char *name;
+	char *dir = SplitPath(path, &name);
+	int fd = -1;
+
+	if (!dir)
+		return -1;
+
+	if (!*name || !strcmp(name, ".") || !strcmp(name, ".."))
+	{
+		errno = EISDIR;
+		free(dir);
+		return -1;
+	}
+
+	*dirfd = OpenBeneathRoot(dir, O_RDONLY | O_DIRECTORY, 0);
+	free(dir);
+	if (*dirfd == -1)
+		return -1;
+
+	// Renaming over a directory would only fail once it's all uploaded.
+	struct stat sb;
+	if (fstatat(*dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode))
+	{
+		close(*dirfd);
+		*dirfd = -1;
+		errno = EISDIR;
+		return -1;
+	}
+
+	// Dot files so they stay out of the way, O_EXCL keeps us from
+	// clobbering anything that happens to have the same name.
+	for (int tries = 0; fd == -1 && tries < 100; tries++)
+	{
+		if (!counter)
+			counter = getpid();
+
+		if (asprintf(tmpname, ".%.200s.%06x", name, (++counter * 2654435761u) & 0xffffff) == -1)
+			break;
+
+		fd = openat(*dirfd, *tmpname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+		if (fd == -1)
+		{
+			free(*tmpname);
+			*tmpname = NULL;
+
+			if (errno != EEXIST)
+				break;
+		}
+	}
+
+	if (fd == -1)
+	{
+		int saved = errno;
+		close(*dirfd);
+		*dirfd = -1;
+		errno = saved;
+	}
+
+	return fd;
+}
+
+// Put a file made by CreateBeneathRoot in place of path.
+int RenameBeneathRoot(int dirfd, const char *tmpname, const char *path)
+{
+	assert(tmpname && path);
+
+	const char *name;
+	char *dir = SplitPath(path, &name);
+
+	if (!dir)
+		return -1;
+
+	int ret = renameat(dirfd, tmpname, dirfd, name);
+	free(dir);
+
+	return ret;
+}
@@ -0,0 +1,738 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "http.h"
+#include "config.h"
+#include "filesystem.h"
+#include "misc.h"
+#include "multiplexer.h"
+#include "prefetch.h"
+#include "process.h"
+#include "socket.h"
+#include "sysconf.h"
+#include "timer.h"
+#include "vec.h"
+#include "vfs.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
+// A small HTTP/1.1 server running on the multiplexer alongside TFTP, for
+// clients that can fetch their kernel and initrd over HTTP (iPXE) and for
+// peers (see peer.c). Clients get files the same way TFTP clients do, with
+// the same path fixing and from the same backends, which see who's asking.
+// Peers only get what we have here (VFSOpenLocal), never another peer's.
+//
+// Each connection is waiting on one thing at a time: the client for a
+// request, the client to take more of the response, or a read of the file.
+// Files in memory are sent straight out of it and files on disk with
+// sendfile (with the kernel reading ahead of us), anything else is read
+// HTTP_BUFFER at a time through the I/O pool.
+
+typedef struct listener_s
+{
+	int fd;
+	// For peers rather than clients.
+	int peers;
+} listener_t;
+
+typedef struct conn_s
+{
+	socket_t s;
+	socketstructs_t peer;
+	int peers;
+	// The request as it comes in, followed by the start of the next one
+	// if the client didn't wait for the response.
+	char req[HTTP_REQUEST + 1];
+	size_t reqlen;
+	int keepalive;
+	// The response header and how much of it has gone.
+	char *head;
+	size_t headlen, headsent;
+	// The file, what's left of it to send and how far
+	// ahead we've asked the kernel to read.
+	vfile_t *vf;
+	uint64_t offset, end, readahead;
+	// What we read of it when it isn't in memory.
+	uint8_t *buf;
+	size_t buflen, bufsent;
+	iorequest_t io;
+	// opening is set while the file is on its way from somewhere else
+	// (see VFSOpenAsync), the request is answered again once it's here.
+	int reading, writing, opening, failed, closed;
+	timerevent_t idle;
+} conn_t;
+
+static vec_t(conn_t*) conns;
+static vec_t(listener_t*) listeners;
+static uint64_t requests, ranges, notfound, failures, sent, sentfile;
+
+static void FreeConn(conn_t *c)
+{
+	CancelTimer(&c->idle);
+	VFSClose(c->vf);
+	free(c->head);
+	free(c->buf);
+	free(c);
+}
+
+static void Close(conn_t *c)
+{
+	socket_t s;
+
+	if (FindSocket(c->s.fd, &s) == 0)
+		DestroySocket(s, 1);
+}
+
+// The socket is gone, whoever got rid of it. A read of the file
+// still going has to finish before we can let go of it.
+static void ConnClosed(socket_t s)
+{
+	conn_t *c = s.data;
+
+	vec_remove(&conns, c);
+
+	if (c->reading || c->opening)
+	{
+		CancelTimer(&c->idle);
+		c->closed = 1;
+	}
+	else
+		FreeConn(c);
+}
+
+static void Idle(timerevent_t *t)
+{
+	conn_t *c = t->data;
+
+	if (c->reading || c->opening)
+		ArmTimer(&c->idle, HTTP_IDLE * SECONDS);
+	else
+		Close(c);
+}
+
+static void Reply(conn_t *c, int status, const char *reason, uint64_t length, const char *headers)
+{
+	free(c->head);
+	c->head = stringify("HTTP/1.1 %d %s\r\nServer: nbstftp\r\nContent-Length: %lu\r\n%sConnection: %s\r\n\r\n",
+	                    status, reason, (unsigned long)length, headers ? headers : "", c->keepalive ? "keep-alive" : "close");
+	c->headlen = strlen(c->head);
+	c->headsent = 0;
+}
+
+// Undo %XX in place, a %00 or a broken escape is an error.
+static int Decode(char *s)
+{
+	char *out = s;
+
+	for (; *s; s++)
+	{
+		if (*s != '%')
+		{
+			*out++ = *s;
+			continue;
+		}
+
+		if (!isxdigit((unsigned char)s[1]) || !isxdigit((unsigned char)s[2]))
+			return -1;
+
+		char hex[3] = { s[1], s[2], 0 };
+		if (!(*out++ = strtol(hex, NULL, 16)))
+			return -1;
+		s += 2;
+	}
+
+	*out = 0;
+	return 0;
+}
+
+// Who the file is, for clients that already have it.
+static char *MakeETag(vfile_t *vf)
+{
+	// Only files which are the same every time they're opened are anyone,
+	// and only if we'd know they changed.
+	if (!(vf->backend->caps & VFS_SHARED) || !vf->version)
+		return NULL;
+
+	return stringify("\"%lx-%lx-%lx-%lx\"", (unsigned long)vf->dev, (unsigned long)vf->ino,
+	                 (unsigned long)vf->size, (unsigned long)vf->version);
+}
+
+// The first and last byte a Range header asks for of a file size long.
+// Returns 1 if we can do that, -1 if it's all past the end, or 0 if it's
+// something we don't do (several ranges, other units) and the whole file
+// goes instead.
+static int ParseRange(const char *value, uint64_t size, uint64_t *first, uint64_t *last)
+{
+	char *end;
+
+	if (strncasecmp(value, "bytes=", 6))
+		return 0;
+	value += 6;
+	value += strspn(value, " ");
+
+	if (strchr(value, ','))
+		return 0;
+
+	// The last so many bytes.
+	if (*value == '-')
+	{
+		uint64_t suffix = strtoull(value + 1, &end, 10);
+		if (end == value + 1 || *end)
+			return 0;
+		if (!suffix || !size)
+			return -1;
+
+		*first = suffix < size ? size - suffix : 0;
+		*last = size - 1;
+		return 1;
+	}
+
+	if (!isdigit((unsigned char)*value))
+		return 0;
+
+	*first = strtoull(value, &end, 10);
+	if (*end++ != '-')
+		return 0;
+
+	*last = UINT64_MAX;
+	if (*end)
+	{
+		const char *l = end;
+		*last = strtoull(l, &end, 10);
+		if (*end || *last < *first)
+			return 0;
+	}
+
+	if (*first >= size)
+		return -1;
+
+	*last = MIN(*last, size - 1);
+	return 1;
+}
+
+static void Parse(conn_t *c);
+
+// The file a request was waiting on is here, answer it again.
+static void Opened(iorequest_t *req)
+{
+	conn_t *c = req->data;
+
+	c->opening = 0;
+
+	if (c->closed)
+		FreeConn(c);
+	else
+		Parse(c);
+}
+
+// Work out the response to the request at the start of c->req, which
+// ends at end.
+static void Handle(conn_t *c, char *end)
+{
+	char *method = c->req, *target, *version, *line, *next;
+	char *inm = NULL, *range = NULL, *ifrange = NULL, *etag = NULL, *headers = NULL;
+	size_t used = end + 4 - c->req;
+
+	// It's taken apart in place, we need it back if the file isn't here yet.
+	char orig[HTTP_REQUEST];
+	memcpy(orig, c->req, used);
+
+	requests++;
+	end[2] = 0;
+
+	// GET /path HTTP/1.1
+	next = strstr(method, "\r\n");
+	*next = 0;
+	next += 2;
+
+	if (!(target = strchr(method, ' ')) || !(version = strchr(target + 1, ' ')))
+	{
+		c->keepalive = 0;
+		Reply(c, 400, "Bad Request", 0, NULL);
+		goto done;
+	}
+	*target++ = 0;
+	*version++ = 0;
+
+	c->keepalive = !strcmp(version, "HTTP/1.1");
+
+	for (line = next; *line; line = next)
+	{
+		next = strstr(line, "\r\n");
+		*next = 0;
+		next += 2;
+
+		char *value = strchr(line, ':');
+		if (!value)
+			continue;
+		*value++ = 0;
+		value += strspn(value, " \t");
+
+		if (!strcasecmp(line, "connection"))
+			c->keepalive = strcasestr(value, "close") ? 0 : strcasestr(value, "keep-alive") ? 1 : c->keepalive;
+		else if (!strcasecmp(line, "if-none-match"))
+			inm = value;
+		else if (!strcasecmp(line, "range"))
+			range = value;
+		else if (!strcasecmp(line, "if-range"))
+			ifrange = value;
+	}
+
+	int head = !strcmp(method, "HEAD");
+	if (!head && strcmp(method, "GET"))
+	{
+		Reply(c, 501, "Not Implemented", 0, NULL);
+		goto done;
+	}
+
+	target[strcspn(target, "?#")] = 0;
+	if (*target != '/' || Decode(target) == -1)
+	{
+		Reply(c, 400, "Bad Request", 0, NULL);
+		goto done;
+	}
+
+	if (!c->peers && config->fixpath)
+		FixPath(target);
+
+	printf("Got HTTP %s request for \"%s\" from %s\n", method, target, GetAddress(c->peer));
+
+	c->io.complete = Opened;
+	c->io.data     = c;
+
+	vfile_t *vf = c->peers ? VFSOpenLocal(target, &c->peer, &c->io) : VFSOpenAsync(target, &c->peer, &c->io);
+	if (!vf && errno == EINPROGRESS)
+	{
+		memcpy(c->req, orig, used);
+		c->opening = 1;
+		requests--;
+		return;
+	}
+
+	if (!vf)
+	{
+		switch (errno)
+		{
+			case ENOENT:
+			case ENOTDIR:
+			case EISDIR:
+				notfound++;
+				Reply(c, 404, "Not Found", 0, NULL);
+				break;
+			case EACCES:
+			case EPERM:
+			case EXDEV:
+				failures++;
+				Reply(c, 403, "Forbidden", 0, NULL);
+				break;
+			default:
+				failures++;
+				fprintf(stderr, "Failed to open %s for %s: %s\n", target, GetAddress(c->peer), strerror(errno));
+				Reply(c, 500, "Internal Server Error", 0, NULL);
+				break;
+		}
+		goto done;
+	}
+
+	if (!c->peers)
+		LearnRequest(target, &c->peer);
+
+	etag = MakeETag(vf);
+
+	if (etag && inm && !strcmp(inm, etag))
+	{
+		headers = stringify("ETag: %s\r\n", etag);
+		VFSClose(vf);
+		Reply(c, 304, "Not Modified", 0, headers);
+		goto done;
+	}
+
+	// A range of a file that changed since the client got the rest of it is no good to them.
+	uint64_t first = 0, last = vf->size - 1;
+	int ranged = range && (!ifrange || (etag && !strcmp(ifrange, etag))) ? ParseRange(range, vf->size, &first, &last) : 0;
+
+	if (ranged == -1)
+	{
+		headers = stringify("Content-Range: bytes */%lu\r\n", (unsigned long)vf->size);
+		VFSClose(vf);
+		Reply(c, 416, "Range Not Satisfiable", 0, headers);
+		goto done;
+	}
+
+	char *contentrange = ranged ? stringify("Content-Range: bytes %lu-%lu/%lu\r\n", (unsigned long)first, (unsigned long)last, (unsigned long)vf->size) : NULL;
+	headers = stringify("Content-Type: application/octet-stream\r\nAccept-Ranges: bytes\r\n%s%s%s%s",
+	                    etag ? "ETag: " : "", etag ? etag : "", etag ? "\r\n" : "", contentrange ? contentrange : "");
+	free(contentrange);
+
+	if (ranged)
+	{
+		ranges++;
+		Reply(c, 206, "Partial Content", last + 1 - first, headers);
+	}
+	else
+		Reply(c, 200, "OK", vf->size, headers);
+
+	// Nothing but the header for HEAD.
+	if (head)
+	{
+		VFSClose(vf);
+		goto done;
+	}
+
+	c->vf = vf;
+	c->offset = c->readahead = ranged ? first : 0;
+	c->end = ranged ? last + 1 : vf->size;
+
+done:
+	free(etag);
+	free(headers);
+
+	// Keep whatever came after it for next time.
+	c->reqlen -= used;
+	memmove(c->req, c->req + used, c->reqlen);
+	c->req[c->reqlen] = 0;
+}
+
+// Answer the request in c->req if it's all here.
+static void Parse(conn_t *c)
+{
+	char *end = memmem(c->req, c->reqlen, "\r\n\r\n", 4);
+
+	if (!end && c->reqlen < HTTP_REQUEST)
+		return;
+
+	if (end && memchr(c->req, 0, end - c->req))
+		end = NULL;
+
+	if (end)
+		Handle(c, end);
+	else
+	{
+		requests++;
+		failures++;
+		c->keepalive = 0;
+		c->reqlen = 0;
+		Reply(c, 400, "Bad Request", 0, NULL);
+	}
+
+	// Nothing to send until the file's here.
+	SetSocketStatus(&c->s, c->opening ? 0 : SF_WRITABLE);
+}
+
+static int ConnRead(socket_t s)
+{
+	conn_t *c = s.data;
+
+	ssize_t n = recv(s.fd, c->req + c->reqlen, HTTP_REQUEST - c->reqlen, 0);
+	if (n == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	if (n == 0)
+		return -1;
+
+	c->reqlen += n;
+	c->req[c->reqlen] = 0;
+	ArmTimer(&c->idle, HTTP_IDLE * SECONDS);
+
+	Parse(c);
+	return 0;
+}
+
+static void BodyRead(iorequest_t *req)
+{
+	conn_t *c = req->data;
+
+	c->reading = 0;
+
+	if (c->closed)
+	{
+		FreeConn(c);
+		return;
+	}
+
+	// Shorter than it said it was is as bad as failing.
+	if (req->result <= 0)
+	{
+		if (req->result == -1)
+			fprintf(stderr, "Failed to read file for %s: %s\n", GetAddress(c->peer), strerror(req->error));
+		c->failed = 1;
+	}
+	else
+	{
+		c->buflen = req->result;
+		c->bufsent = 0;
+	}
+
+	// ConnWrite is still going if we didn't have to wait.
+	if (c->writing)
+		return;
+
+	if (c->failed)
+		Close(c);
+	else
+		SetSocketStatus(&c->s, SF_WRITABLE);
+}
+
+static int ConnWrite(socket_t s)
+{
+	conn_t *c = s.data;
+	ssize_t n;
+
+	ArmTimer(&c->idle, HTTP_IDLE * SECONDS);
+
+	for (; c->headsent < c->headlen; c->headsent += n)
+	{
+		if ((n = send(s.fd, c->head + c->headsent, c->headlen - c->headsent, MSG_NOSIGNAL)) == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+
+	while (c->vf && c->offset < c->end)
+	{
+		if (c->vf->map)
+			n = send(s.fd, c->vf->map + c->offset, MIN(c->end - c->offset, HTTP_BUFFER), MSG_NOSIGNAL);
+#ifdef HAVE_SYS_SENDFILE_H
+		else if (c->vf->fd != -1)
+		{
+			// Keep the kernel reading ahead of us so sendfile
+			// doesn't have to wait on the disk.
+			if (c->offset + PREFETCH_WINDOW / 2 >= c->readahead && c->readahead < c->end)
+			{
+				posix_fadvise(c->vf->fd, c->readahead, PREFETCH_WINDOW, POSIX_FADV_WILLNEED);
+				c->readahead += PREFETCH_WINDOW;
+			}
+
+			off_t off = c->offset;
+			n = sendfile(s.fd, c->vf->fd, &off, MIN(c->end - c->offset, HTTP_BUFFER));
+
+			// It got shorter since we opened it.
+			if (n == 0)
+				return -1;
+			if (n > 0)
+				sentfile += n;
+		}
+#endif
+		else
+		{
+			if (c->bufsent == c->buflen)
+			{
+				if (!c->buf)
+					c->buf = nmalloc(HTTP_BUFFER);
+
+				c->io.buf      = c->buf;
+				c->io.len      = MIN(c->end - c->offset, HTTP_BUFFER);
+				c->io.offset   = c->offset;
+				c->io.iov      = NULL;
+				c->io.complete = BodyRead;
+				c->io.data     = c;
+
+				c->reading = c->writing = 1;
+				VFSRead(c->vf, &c->io);
+				c->writing = 0;
+
+				// Nothing to do until it's read.
+				if (c->reading)
+				{
+					SetSocketStatus(&c->s, 0);
+					return 0;
+				}
+
+				if (c->failed)
+					return -1;
+			}
+
+			n = send(s.fd, c->buf + c->bufsent, c->buflen - c->bufsent, MSG_NOSIGNAL);
+			if (n > 0)
+				c->bufsent += n;
+		}
+
+		if (n == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+		c->offset += n;
+		sent += n;
+	}
+
+	// That's the response sent.
+	VFSClose(c->vf);
+	c->vf = NULL;
+	free(c->head);
+	c->head = NULL;
+	c->headlen = c->headsent = c->buflen = c->bufsent = 0;
+
+	if (!c->keepalive)
+		return -1;
+
+	SetSocketStatus(&c->s, SF_READABLE);
+	Parse(c);
+	return 0;
+}
+
+static int Accept(socket_t s)
+{
+	listener_t *l = s.data;
+
+	for (;;)
+	{
+		socketstructs_t addr;
+		socklen_t len = sizeof(addr);
+
+		int fd = accept4(s.fd, &addr.sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr, "Failed to accept HTTP connection: %s\n", strerror(errno));
+			return 0;
+		}
+
+		conn_t *c = nmalloc(sizeof(conn_t));
+		c->peer = addr;
+		c->peers = l->peers;
+		c->idle.callback = Idle;
+		c->idle.data = c;
+
+		if (AddHandlerSocket(fd, ConnRead, ConnWrite, ConnClosed, c) == -1 || FindSocket(fd, &c->s) == -1)
+		{
+			close(fd);
+			free(c);
+			continue;
+		}
+
+		vec_push(&conns, c);
+		ArmTimer(&c->idle, HTTP_IDLE * SECONDS);
+	}
+}
+
+static int Listen(const char *addr, int port, int peers)
+{
+	socketstructs_t saddr;
+	memset(&saddr, 0, sizeof(socketstructs_t));
+
+	saddr.sa.sa_family = strchr(addr, ':') ? AF_INET6 : AF_INET;
+	*(saddr.sa.sa_family == AF_INET ? &saddr.in.sin_port : &saddr.in6.sin6_port) = htons(port);
+
+	if (inet_pton(saddr.sa.sa_family, addr, saddr.sa.sa_family == AF_INET ? (void *)&saddr.in.sin_addr : (void *)&saddr.in6.sin6_addr) != 1)
+	{
+		fprintf(stderr, "Invalid HTTP bind address: %s\n", addr);
+		return -1;
+	}
+
+	int fd = socket(saddr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		perror("Cannot create HTTP socket");
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+
+	if (bind(fd, &saddr.sa, saddr.sa.sa_family == AF_INET ? sizeof(saddr.in) : sizeof(saddr.in6)) == -1 || listen(fd, SOMAXCONN) == -1)
+	{
+		fprintf(stderr, "Failed to listen for HTTP on [%s]:%d: %s\n", addr, port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	listener_t *l = nmalloc(sizeof(listener_t));
+	l->fd = fd;
+	l->peers = peers;
+
+	if (AddHandlerSocket(fd, Accept, NULL, NULL, l) == -1)
+	{
+		close(fd);
+		free(l);
+		return -1;
+	}
+
+	vec_push(&listeners, l);
+	printf("Serving %s over HTTP on [%s]:%d\n", peers ? "peers" : "files", addr, port);
+	return 0;
+}
+
+// After the sockets, so we can add ours to the multiplexer.
+int InitializeHTTP(void)
+{
+	conf_http_t *h;
+	int i;
+
+	vec_init(&conns);
+	vec_init(&listeners);
+
+	vec_foreach(&config->httpblocks, h, i)
+	{
+		if (Listen(h->bindaddr ? h->bindaddr : "::", h->port, 0) == -1)
+			return -1;
+	}
+
+	if (config->peerblocks.length)
+	{
+		conf_peers_t *p = config->peerblocks.data[0];
+		if (Listen(p->bindaddr ? p->bindaddr : "::", p->port, 1) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Before the sockets go, responses still going are cut off.
+void ShutdownHTTP(void)
+{
+	listener_t *l;
+	socket_t s;
+	int i;
+
+	while (conns.length)
+	{
+		conn_t *c = vec_last(&conns);
+		if (FindSocket(c->s.fd, &s) == 0)
+			DestroySocket(s, 1);
+		else
+		{
+			vec_pop(&conns);
+			FreeConn(c);
+		}
+	}
+	vec_deinit(&conns);
+
+	vec_foreach(&listeners, l, i)
+	{
+		if (FindSocket(l->fd, &s) == 0)
+			DestroySocket(s, 1);
+		free(l);
+	}
+	vec_deinit(&listeners);
+}
+
+void PrintHTTPStatistics(void)
+{
+	if (!listeners.length)
+		return;
+
+	printf("HTTP: %lu requests (%lu ranges), %lu not found, %lu failed, %s sent", (unsigned long)requests,
+	       (unsigned long)ranges, (unsigned long)notfound, (unsigned long)failures, SizeReduce(sent));
+	printf(" (%s with sendfile), %d connections\n", SizeReduce(sentfile), conns.length);
+}
@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "iopool.h"
+#include "socket.h"
+#include "misc.h"
+#include "sysconf.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
+
+// The disk I/O pool. The event loop hands requests to a small set of worker
+// threads so a slow disk only stalls the transfer waiting on it. Workers pass
+// finished requests back through a lock-free queue and poke a descriptor
+// sitting in the multiplexer, the loop then runs the completion functions.
+//
+// With zero threads everything just happens inline like it used to.
+
+static pthread_t *workers;
+static int nworkers;
+
+// Pending requests, the loop pushes and the workers pop. Workers need
+// to sleep when there's nothing to do anyway so this is a plain
+// mutex and condition variable.
+static pthread_mutex_t submitlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submitcond = PTHREAD_COND_INITIALIZER;
+static iorequest_t *submithead, *submittail;
+static int stopping;
+
+// Finished requests. This is an intrusive multi-producer single-consumer
+// queue (Dmitry Vyukov's design): any worker can push without locking and
+// only the event loop ever pops.
+static iorequest_t stub;
+static _Atomic(iorequest_t *) completehead = &stub;
+static iorequest_t *completetail = &stub;
+
+// How reads were serviced. Only the event loop touches these.
+static uint64_t inlinereads, offloadedreads, writes, writebuffers, syncs;
+
+// The descriptor workers write to when they finish something. With eventfd
+// both ends are the same descriptor, otherwise it's a pipe.
+static int notifyfds[2] = { -1, -1 };
+
+static void PushCompletion(iorequest_t *req)
+{
+	atomic_store_explicit(&req->next, NULL, memory_order_relaxed);
+	iorequest_t *prev = atomic_exchange_explicit(&completehead, req, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, req, memory_order_release);
+}
+
+static iorequest_t *PopCompletion(void)
+{
+	iorequest_t *tail = completetail;
+	iorequest_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	// Skip over the stub node.
+	if (tail == &stub)
+	{
+		if (!next)
+			return NULL;
+
+		completetail = tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+
+	if (next)
+	{
+		completetail = next;
+		return tail;
+	}
+
+	// A worker is halfway through pushing, we'll get it on the next wakeup.
+	if (tail != atomic_load_explicit(&completehead, memory_order_acquire))
+		return NULL;
+
+	// Put the stub back so the last real node can be taken.
+	PushCompletion(&stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next)
+	{
+		completetail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static void Notify(void)
+{
+#ifdef HAVE_EVENTFD
+	uint64_t one = 1;
+	write(notifyfds[1], &one, sizeof(uint64_t));
+#else
+	char one = 1;
+	write(notifyfds[1], &one, sizeof(char));
+#endif
+}
+
+// Write out a gathered request from wherever the last write stopped.
+static ssize_t GatherWrite(iorequest_t *req, size_t done)
+{
+#ifdef HAVE_PWRITEV
+	return pwritev(req->fd, req->iov, req->iovcnt, req->offset + done);
+#else
+	return pwrite(req->fd, req->iov->iov_base, req->iov->iov_len, req->offset + done);
+#endif
+}
+
+// Move the iovecs past what made it out.
+static void SkipWritten(iorequest_t *req, size_t len)
+{
+	while (len && req->iovcnt)
+	{
+		if (len < req->iov->iov_len)
+		{
+			req->iov->iov_base = ((uint8_t*)req->iov->iov_base) + len;
+			req->iov->iov_len -= len;
+			return;
+		}
+
+		len -= req->iov->iov_len;
+		req->iov++;
+		req->iovcnt--;
+	}
+}
+
+// Actually do the I/O. Regular files rarely give us short writes but
+// we loop anyway, short reads just mean we hit the end of the file.
+static void PerformIO(iorequest_t *req)
+{
+	size_t done = 0;
+
+	if (req->op == IO_SYNC)
+	{
+		while (fsync(req->fd) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			req->result = -1;
+			req->error = errno;
+			return;
+		}
+
+		req->result = 0;
+		req->error = 0;
+		return;
+	}
+
+	while (done < req->len)
+	{
+		ssize_t ret;
+		uint8_t *buf = ((uint8_t*)req->buf) + done;
+
+		if (req->op == IO_READ)
+			ret = pread(req->fd, buf, req->len - done, req->offset + done);
+		else if (req->iov)
+			ret = GatherWrite(req, done);
+		else
+			ret = pwrite(req->fd, buf, req->len - done, req->offset + done);
+
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			req->result = -1;
+			req->error = errno;
+			return;
+		}
+
+		// End of the file.
+		if (ret == 0)
+			break;
+
+		done += ret;
+
+		if (req->iov)
+			SkipWritten(req, ret);
+	}
+
+	req->result = done;
+	req->error = 0;
+}
+
+static void *IOWorker(void *unused)
+{
+	// Signals are for the event loop.
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;)
+	{
+		pthread_mutex_lock(&submitlock);
+
+		while (!submithead && !stopping)
+			pthread_cond_wait(&submitcond, &submitlock);
+
+		if (stopping)
+		{
+			pthread_mutex_unlock(&submitlock);
+			return NULL;
+		}
+
+		iorequest_t *req = submithead;
+		submithead = atomic_load_explicit(&req->next, memory_order_relaxed);
+		if (!submithead)
+			submittail = NULL;
+
+		pthread_mutex_unlock(&submitlock);
+
+		PerformIO(req);
+		PushCompletion(req);
+		Notify();
+	}
+}
+
+// Called from the multiplexer when a worker has finished something.
+static int RunCompletions(socket_t s)
+{
+#ifdef HAVE_EVENTFD
+	uint64_t count;
+	read(s.fd, &count, sizeof(uint64_t));
+#else
+	char buf[64];
+	while (read(s.fd, buf, sizeof(buf)) > 0)
+		;
+#endif
+
+	iorequest_t *req;
+	while ((req = PopCompletion()))
+		req->complete(req);
+
+	return 0;
+}
+
+#ifdef HAVE_PREADV2
+// Try to satisfy a read straight from the page cache without blocking.
+// Returns 1 if the whole read was done, 0 if it needs a worker thread.
+static int TryInlineRead(iorequest_t *req)
+{
+	// Set if the kernel or filesystem doesn't support RWF_NOWAIT.
+	static int nonowait = 0;
+	size_t done = 0;
+
+	if (nonowait)
+		return 0;
+
+	while (done < req->len)
+	{
+		struct iovec iov = { ((uint8_t*)req->buf) + done, req->len - done };
+		ssize_t ret = preadv2(req->fd, &iov, 1, req->offset + done, RWF_NOWAIT);
+
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)
+				nonowait = 1;
+
+			// EAGAIN means it isn't cached, anything else the
+			// worker can run into again and report properly.
+			return 0;
+		}
+
+		// End of the file, RWF_NOWAIT never returns 0 otherwise.
+		if (ret == 0)
+			break;
+
+		done += ret;
+	}
+
+	req->result = done;
+	req->error = 0;
+	return 1;
+}
+#endif
+
+void SubmitIO(iorequest_t *req)
+{
+	assert(req && req->complete);
+
+	if (req->op == IO_WRITE)
+	{
+		writes++;
+		writebuffers += req->iov ? req->iovcnt : 1;
+	}
+	else if (req->op == IO_SYNC)
+		syncs++;
+
+	// No pool, just do it now.
+	if (!nworkers)
+	{
+		if (req->op == IO_READ)
+			inlinereads++;
+
+		PerformIO(req);
+		req->complete(req);
+		return;
+	}
+
+#ifdef HAVE_PREADV2
+	// Boot files are almost always in the page cache already, don't pay
+	// for two context switches to copy memory we could copy right now.
+	if (req->op == IO_READ && TryInlineRead(req))
+	{
+		inlinereads++;
+		req->complete(req);
+		return;
+	}
+#endif
+
+	if (req->op == IO_READ)
+		offloadedreads++;
+
+	atomic_store_explicit(&req->next, NULL, memory_order_relaxed);
+
+	pthread_mutex_lock(&submitlock);
+	if (submittail)
+		atomic_store_explicit(&submittail->next, req, memory_order_relaxed);
+	else
+		submithead = req;
+	submittail = req;
+	pthread_cond_signal(&submitcond);
+	pthread_mutex_unlock(&submitlock);
+}
+
+// Start the worker threads. This must happen after we daemonize since
+// threads do not survive a fork().
+int InitializeIOPool(int threads)
+{
+	// Backends finishing I/O on threads of their own need
+	// the notifier even if we don't start any workers.
+#ifdef HAVE_EVENTFD
+	notifyfds[0] = notifyfds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notifyfds[0] == -1)
+#else
+	if (pipe(notifyfds) == -1 || fcntl(notifyfds[0], F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(notifyfds[1], F_SETFL, O_NONBLOCK) == -1)
+#endif
+	{
+		fprintf(stderr, "Failed to create I/O notification descriptor: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (AddHandlerSocket(notifyfds[0], RunCompletions, NULL, NULL, NULL) == -1)
+	{
+		fprintf(stderr, "Failed to add I/O notification descriptor to the multiplexer!\n");
+		return -1;
+	}
+
+	if (threads <= 0)
+		return 0;
+
+	workers = nmalloc(sizeof(pthread_t) * threads);
+	for (nworkers = 0; nworkers < threads; nworkers++)
+	{
+		int err = pthread_create(&workers[nworkers], NULL, IOWorker, NULL);
+		if (err)
+		{
+			fprintf(stderr, "Failed to start I/O worker thread: %s\n", strerror(err));
+			break;
+		}
+	}
+
+	bprintf("Started %d I/O worker threads\n", nworkers);
+
+	return nworkers ? 0 : -1;
+}
+
+void ShutdownIOPool(void)
+{
+	if (nworkers)
+	{
+		pthread_mutex_lock(&submitlock);
+		stopping = 1;
+		pthread_cond_broadcast(&submitcond);
+		pthread_mutex_unlock(&submitlock);
+
+		for (int i = 0; i < nworkers; i++)
+			pthread_join(workers[i], NULL);
+
+		free(workers);
+		workers = NULL;
+		nworkers = 0;
+	}
+
+	if (notifyfds[0] == -1)
+		return;
+
+	// Anything left over belongs to clients which are about to be
+	// deallocated, don't bother running their completions.
+	socket_t s;
+	if (FindSocket(notifyfds[0], &s) == 0)
+		DestroySocket(s, 1);
+
+	if (notifyfds[1] != notifyfds[0])
+		close(notifyfds[1]);
+
+	notifyfds[0] = notifyfds[1] = -1;
+}
+
+// Hand back a request something other than the pool finished (a backend
+// with threads of its own), this is safe to call from any thread.
+void CompleteIO(iorequest_t *req)
+{
+	assert(req && req->complete);
+
+	PushCompletion(req);
+	Notify();
+}
+
+void PrintIOStatistics(void)
+{
+	uint64_t reads = inlinereads + offloadedreads;
+
+	printf("Disk I/O: %d worker threads, %lu reads (%lu from page cache inline, %lu offloaded, %.1f%% inline), "
+	       "%lu writes (of %lu blocks), %lu syncs\n",
+	       nworkers, (unsigned long)reads, (unsigned long)inlinereads, (unsigned long)offloadedreads,
+	       reads ? (inlinereads * 100.0) / reads : 0.0, (unsigned long)writes, (unsigned long)writebuffers,
+	       (unsigned long)syncs);
+}
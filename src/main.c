@@ -24,9 +24,22 @@
 #include "socket.h"
 #include "sysconf.h"
 #include "module.h"
+#include "iopool.h"
+#include "stream.h"
+#include "multicast.h"
+#include "timer.h"
+#include "template.h"
+#include "archive.h"
+#include "upstream.h"
+#include "peer.h"
+#include "http.h"
+#include "prefetch.h"
+#include "preload.h"
 //#include "packets.h"
 
 int running = 1;
+// Set by SIGUSR1 to print our statistics.
+volatile sig_atomic_t dumpstats = 0;
 // Fork to background unless otherwise specified
 int nofork = -1;
 char *configfile = NULL;
@@ -80,6 +93,22 @@ write:
 		SetFilePermissions(config->pidfile, config->user, config->group, 0777);
 }
 
+static void PrintStatistics(void)
+{
+	PrintIOStatistics();
+	PrintStreamStatistics();
+	PrintMulticastStatistics();
+	PrintClientStatistics();
+	PrintModuleStatistics();
+	PrintTemplateStatistics();
+	PrintArchiveStatistics();
+	PrintUpstreamStatistics();
+	PrintPeerStatistics();
+	PrintHTTPStatistics();
+	PrintPrefetchStatistics();
+	PrintPreloadStatistics();
+}
+
 int main(int argc, char **argv)
 {
 	HandleArguments(argc, argv);
@@ -91,6 +120,10 @@ int main(int argc, char **argv)
 
 	if (ParseConfig(configfile) != 0)
 		die("Failed to parse the config file!");
+
+	// Hold the directory we serve open, all requests are resolved beneath it.
+	if (OpenServeRoot(config->directory) == -1)
+		die("Cannot open the directory to serve files from!");
 	
 	// Write the PID file -- Also check for any other
 	// running versions of us.
@@ -99,13 +132,37 @@ int main(int argc, char **argv)
 	// Initialize the client pool
 	vec_init(&clientpool);
 	
+	// Files from the directory we keep in memory, in front of it alone.
+	InitializePreload();
+
+	// Map the archives we serve from, writing their indexes if
+	// need be while we can still write next to them.
+	InitializeArchives();
+
+	// Files we fetch from elsewhere.
+	InitializeUpstreams();
+
+	// And from the other nodes, ahead of all of those.
+	InitializePeers();
+
+	// Rendered boot configs, before the modules so
+	// their backends get the first look at requests.
+	InitializeTemplates();
+
 	// Initialize our modules
 	InitializeModules();
+
+	// Learning what clients ask for next.
+	InitializePrefetch();
 	
 	// Initialize the socket system.
 	if (InitializeSockets() == -1)
 		die("Failed to initialize and bind to the interfaces!");
 
+	// Clients and peers fetch files from us over HTTP.
+	if (InitializeHTTP() == -1)
+		die("Failed to listen for HTTP!");
+
 	// Change the user and group id.
 	if (SwitchUserAndGroup(config->user, config->group) == 1)
 	{
@@ -118,6 +175,22 @@ int main(int argc, char **argv)
 	
 	// Go away.
 	Daemonize();
+
+	// Start the disk I/O threads, this has to happen after
+	// the fork since threads don't survive it.
+	if (InitializeIOPool(config->iothreads) == -1)
+		die("Failed to start the disk I/O threads!");
+
+	// Same goes for the thread running asynchronous module events.
+	if (StartModuleThread() == -1)
+		die("Failed to start the module thread!");
+
+	// And reading the preloaded files in, while we get on with serving.
+	if (StartPreload() == -1)
+		die("Failed to start preloading files!");
+
+	if (InitializeTimers() == -1)
+		die("Failed to set up timers!");
 	
 	// Enter idle loop.
 	while (running)
@@ -127,18 +200,55 @@ int main(int argc, char **argv)
 		
 		// Process packets or wait on the sockets.
 		ProcessSockets();
+
+		// Without timerfd this is the only place timers run.
+		RunTimers();
 		
 		// Tick modules
 		CallEvent(EV_TICK, NULL);
+
+		// Someone sent us SIGUSR1, tell them how we're doing.
+		if (dumpstats)
+		{
+			dumpstats = 0;
+			PrintStatistics();
+		}
 	}
 
 cleanup:
-	
+
+	PrintStatistics();
+
+	// Let modules finish with the events they were handed.
+	StopModuleThread();
+
+	// Stop reading in files there's no use for anymore.
+	StopPreload();
+
+	// Fetches hand their clients what they were waiting on as they go.
+	StopUpstreams();
+
+	// Stop the disk I/O threads.
+	ShutdownIOPool();
+
+	ShutdownTimers();
+
 	// Close the file descriptors.
+	ShutdownHTTP();
 	ShutdownSockets();
 	
 	// Deallocate client pool
 	DeallocateClients();
+	ShutdownPrefetch();
+
+	// Nobody has a file from them open anymore.
+	ShutdownPeers();
+	ShutdownUpstreams();
+	ShutdownArchives();
+	ShutdownPreload();
+
+	// Let go of the serve root.
+	CloseServeRoot();
 	
 	// Remove our PID
 	if (config)
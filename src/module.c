@@ -17,12 +17,100 @@
 #include <dlfcn.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 #include "module.h"
+#include "client.h"
 #include "config.h"
+#include "timer.h"
+#include "misc.h"
 #include "vec.h"
 
 vec_t(module_t) modules;
+event_vec_t eventhandlers[EV_END];
+
+// Asynchronous handlers. The event loop copies what an event was about into
+// a bounded ring and carries on, the module thread takes them out and runs
+// the handlers. The ring is Dmitry Vyukov's bounded queue: each slot has a
+// sequence number saying whose turn it is, so a signal handler (or another
+// thread) can queue events while the loop is halfway through queueing one.
+typedef struct eventslot_s
+{
+	_Atomic size_t seq;
+	asyncevent_t ev;
+} eventslot_t;
+
+static eventslot_t *ring;
+static size_t ringmask;
+static _Atomic size_t enqueuepos;
+static size_t dequeuepos;
+
+// One post per queued event. room is posted when the module thread
+// frees a slot and the loop is waiting for one (see eventoverflow).
+static sem_t ready, room;
+static atomic_int blocked, stopping;
+static pthread_t modulethread;
+static int threadrunning;
+
+// Handlers are only ever changed by the loop, this keeps the module
+// thread from running them while they are.
+static pthread_mutex_t handlerlock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic uint64_t queued, delivered, dropped, waits;
+
+static void AllocateRing(void)
+{
+	size_t size = 16;
+	while (size < (size_t)config->eventqueue)
+		size <<= 1;
+
+	ring = nmalloc(sizeof(eventslot_t) * size);
+	ringmask = size - 1;
+
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&ring[i].seq, i);
+
+	sem_init(&ready, 0, 0);
+	sem_init(&room, 0, 0);
+}
+
+// Sort every loaded module's events by type.
+static void BuildEventHandlers(void)
+{
+	module_t m;
+	event_t ev;
+	int idx, evidx, async = 0;
+
+	pthread_mutex_lock(&handlerlock);
+
+	for (int i = 0; i < EV_END; i++)
+		vec_clear(&eventhandlers[i]);
+
+	vec_foreach(&modules, m, idx)
+	{
+		vec_foreach(&m.minfo->events, ev, evidx)
+		{
+			if (ev.type > EV_BEGIN && ev.type < EV_END)
+			{
+				vec_push(&eventhandlers[ev.type], ev);
+				async |= ev.flags & EVENT_ASYNC;
+			}
+			else
+				fprintf(stderr, "Module \"%s\" has a handler for unknown event %d\n", m.minfo->name, ev.type);
+		}
+	}
+
+	pthread_mutex_unlock(&handlerlock);
+
+	// Nobody pays for the ring unless someone wants it.
+	if (async && !ring)
+		AllocateRing();
+}
 
 // Load a module from filesystem.
 int LoadModule(module_t *m, const char *str)
@@ -55,6 +143,7 @@ int LoadModule(module_t *m, const char *str)
 	}
 	
 	vec_push(&modules, *m);
+	BuildEventHandlers();
 	
 	// Call our load event.
 	CallEvent(EV_MODLOAD, m);
@@ -78,6 +167,9 @@ void UnloadModule(module_t m)
 			break;
 		}
 	}
+
+	// Before the module and its event vector are gone.
+	BuildEventHandlers();
 	
 	if (m.handle)
 		dlclose(m.handle);
@@ -124,28 +216,266 @@ void InitializeModules(void)
 	}
 }
 
-// Call a specific module's event.
-void CallModuleEvent(module_t m, int type, void *data)
+// Claim the next free slot, NULL if the ring is full.
+static eventslot_t *ClaimSlot(size_t *pos)
 {
+	size_t p = atomic_load_explicit(&enqueuepos, memory_order_relaxed);
+
+	for (;;)
+	{
+		eventslot_t *slot = &ring[p & ringmask];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)p;
+
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&enqueuepos, &p, p + 1, memory_order_relaxed, memory_order_relaxed))
+			{
+				*pos = p;
+				return slot;
+			}
+		}
+		else if (diff < 0)
+			return NULL;
+		else
+			p = atomic_load_explicit(&enqueuepos, memory_order_relaxed);
+	}
+}
+
+static void CopyPacket(asyncevent_t *ae, const void *p, size_t len)
+{
+	ae->len = len;
+	memcpy(ae->data, p, MIN(len, ASYNC_EVENT_DATA));
+}
+
+static void CopyClient(asyncevent_t *ae, const client_t *c)
+{
+	if (c)
+		memcpy(&ae->addr, &c->s.addr, sizeof(socketstructs_t));
+}
+
+// Copy what the asynchronous handlers need out of an event's data.
+static void Snapshot(asyncevent_t *ae, int type, void *data)
+{
+	ae->type = type;
+	ae->time = MonotonicTime();
+	ae->addr.sa.sa_family = AF_UNSPEC;
+	ae->signal = 0;
+	ae->len = 0;
+
+	switch (type)
+	{
+		case EV_MODLOAD:
+		case EV_MODUNLOAD:
+		{
+			const char *name = ((module_t*)data)->minfo->name;
+			CopyPacket(ae, name, strlen(name));
+			break;
+		}
+		case EV_SOCKETACTIVITY:
+			memcpy(&ae->addr, &((socket_t*)data)->addr, sizeof(socketstructs_t));
+			break;
+		case EV_NEWREADREQUEST:
+		case EV_NEWWRITEREQUEST:
+		{
+			evrequest_t *ev = data;
+			CopyClient(ae, ev->c);
+			CopyPacket(ae, ev->p, ev->len);
+			break;
+		}
+		case EV_DATA_PACKET:
+		case EV_ACK_PACKET:
+		case EV_ERROR_PACKET:
+		case EV_UNKNOWN_PACKET:
+		{
+			evpacket_t *ev = data;
+			CopyClient(ae, ev->c);
+			CopyPacket(ae, ev->p, ev->len);
+			break;
+		}
+		case EV_SENDING_PACKETS:
+		{
+			evsending_t *ev = data;
+			CopyClient(ae, ev->c);
+			CopyPacket(ae, ev->p, ev->len);
+			break;
+		}
+		case EV_RECEIVING_PACKETS:
+		{
+			evreceiving_t *ev = data;
+			CopyClient(ae, ev->c);
+			CopyPacket(ae, ev->buf, ev->len);
+			break;
+		}
+		case EV_RESEND:
+		{
+			evresend_t *ev = data;
+			CopyClient(ae, ev->c);
+			CopyPacket(ae, ev->p, ev->len);
+			break;
+		}
+		case EV_SIGNAL:
+			ae->signal = *(int*)data;
+			break;
+		default:
+			break;
+	}
+}
+
+static void QueueEvent(int type, void *data)
+{
+	eventslot_t *slot;
+	size_t pos;
+
+	while (!(slot = ClaimSlot(&pos)))
+	{
+		// Signal handlers can't wait, and nothing would make room
+		// before the thread is started.
+		if (config->eventoverflow != EVENTS_BLOCK || type == EV_SIGNAL || !threadrunning)
+		{
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		}
+
+		atomic_fetch_add_explicit(&waits, 1, memory_order_relaxed);
+		atomic_store(&blocked, 1);
+
+		// It may have emptied out before it knew we were waiting.
+		if ((slot = ClaimSlot(&pos)))
+			break;
+
+		while (sem_wait(&room) == -1 && errno == EINTR)
+			;
+	}
+
+	Snapshot(&slot->ev, type, data);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	atomic_fetch_add_explicit(&queued, 1, memory_order_relaxed);
+	sem_post(&ready);
+}
+
+static void *ModuleThread(void *unused)
+{
+	// Signals are for the event loop.
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;)
+	{
+		while (sem_wait(&ready) == -1 && errno == EINTR)
+			;
+
+		eventslot_t *slot = &ring[dequeuepos & ringmask];
+
+		// Whoever claimed it may still be copying into it.
+		while (atomic_load_explicit(&slot->seq, memory_order_acquire) != dequeuepos + 1)
+		{
+			if (atomic_load(&stopping) && atomic_load(&enqueuepos) == dequeuepos)
+				return NULL;
+			sched_yield();
+		}
+
+		event_t ev;
+		int idx;
+
+		pthread_mutex_lock(&handlerlock);
+		vec_foreach(&eventhandlers[slot->ev.type], ev, idx)
+		{
+			if (ev.flags & EVENT_ASYNC)
+				ev.func(&slot->ev);
+		}
+		pthread_mutex_unlock(&handlerlock);
+
+		atomic_store_explicit(&slot->seq, dequeuepos + ringmask + 1, memory_order_release);
+		dequeuepos++;
+		atomic_fetch_add_explicit(&delivered, 1, memory_order_relaxed);
+
+		if (atomic_exchange(&blocked, 0))
+			sem_post(&room);
+	}
+}
+
+// Start running asynchronous handlers, this has to happen after the
+// fork. Events queued before now (like EV_MODLOAD) are delivered then.
+int StartModuleThread(void)
+{
+	if (!ring)
+		return 0;
+
+	int err = pthread_create(&modulethread, NULL, ModuleThread, NULL);
+	if (err)
+	{
+		fprintf(stderr, "Failed to start the module thread: %s\n", strerror(err));
+		return -1;
+	}
+
+	threadrunning = 1;
+	return 0;
+}
+
+// Deliver whatever is still queued and stop the module thread.
+void StopModuleThread(void)
+{
+	if (!threadrunning)
+		return;
+
+	atomic_store(&stopping, 1);
+	sem_post(&ready);
+	pthread_join(modulethread, NULL);
+	threadrunning = 0;
+}
+
+void PrintModuleStatistics(void)
+{
+	if (!ring)
+		return;
+
+	printf("Module events: %lu queued, %lu delivered, %lu dropped, %lu waits for room (queue of %lu)\n",
+	       (unsigned long)atomic_load(&queued), (unsigned long)atomic_load(&delivered),
+	       (unsigned long)atomic_load(&dropped), (unsigned long)atomic_load(&waits),
+	       (unsigned long)(ringmask + 1));
+}
+
+// Call every handler for an event, see CallEvent. Synchronous handlers run
+// right here, asynchronous ones get a copy of the event queued for them.
+void DispatchEvent(int type, void *data)
+{
+	assert(type > EV_BEGIN && type < EV_END);
+
 	event_t ev;
-	int idx;
-	
-	vec_foreach(&m.minfo->events, ev, idx)
+	int idx, async = 0;
+
+	vec_foreach(&eventhandlers[type], ev, idx)
 	{
-		if (ev.type == type)
+		if (ev.flags & EVENT_ASYNC)
+			async = 1;
+		else
 			ev.func(data);
 	}
+
+	if (async && ring)
+		QueueEvent(type, data);
 }
 
-// Globally call an event (such as receiving a packet)
-void CallEvent(int type, void *data)
+// Call a specific module's event.
+void CallModuleEvent(module_t m, int type, void *data)
 {
-	module_t m;
+	event_t ev;
 	int idx;
 	
-	// Call each module's event for this particular evet.
-	vec_foreach(&modules, m, idx)
+	vec_foreach(&m.minfo->events, ev, idx)
 	{
-		CallModuleEvent(m, type, data);
+		if (ev.type != type)
+			continue;
+
+		if (ev.flags & EVENT_ASYNC)
+		{
+			asyncevent_t ae;
+			Snapshot(&ae, type, data);
+			ev.func(&ae);
+		}
+		else
+			ev.func(data);
 	}
 }
\ No newline at end of file
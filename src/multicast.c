@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "multicast.h"
+#include "process.h"
+#include "packets.h"
+#include "socket.h"
+#include "config.h"
+#include "misc.h"
+#include "multiplexer.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// RFC 2090 multicast TFTP. Every client asking for the same file with the
+// same block size (and the multicast option) joins one group and the file
+// is sent once to the group's multicast address. Only the master client
+// ACKs, when it has everything the next member becomes master and asks
+// for whatever blocks it missed before it joined.
+
+static vec_t(mcsession_t*) sessions;
+
+// How many sessions and members we've had.
+static uint64_t totalsessions, totalmembers, completed;
+
+// Multicast goes out whatever interface the routing table says unless we
+// say otherwise, use the one the listen socket is bound to (if it is).
+static void SetMulticastInterface(int fd)
+{
+	struct sockaddr_in local;
+	socklen_t len = sizeof(local);
+
+	if (getsockname(fd, (struct sockaddr*)&local, &len) == -1 || local.sin_family != AF_INET)
+		return;
+
+	if (local.sin_addr.s_addr == htonl(INADDR_ANY))
+		return;
+
+	if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &local.sin_addr, sizeof(struct in_addr)) == -1)
+		fprintf(stderr, "Failed to set multicast interface: %s\n", strerror(errno));
+}
+
+// Each session gets its own port so clients in different groups
+// don't get each other's blocks.
+static uint16_t FreePort(void)
+{
+	uint16_t port = config->multicastport;
+	mcsession_t *mc;
+	int idx;
+
+again:
+	vec_foreach(&sessions, mc, idx)
+	{
+		if (mc->port == port)
+		{
+			port++;
+			goto again;
+		}
+	}
+
+	return port;
+}
+
+static mcsession_t *NewSession(client_t *c)
+{
+	socketstructs_t addr;
+	memset(&addr, 0, sizeof(socketstructs_t));
+	addr.in.sin_family = AF_INET;
+	addr.in.sin_port = htons(FreePort());
+
+	if (inet_pton(AF_INET, config->multicastaddr, &addr.in.sin_addr) != 1)
+		return NULL;
+
+	client_t *group = nmalloc(sizeof(client_t));
+	if (AddSocket(c->s.fd, NULL, c->s.type, addr, 0, &group->s) == -1)
+	{
+		free(group);
+		return NULL;
+	}
+
+	AddClient(group);
+
+	// The group reads the file for itself since members come and go.
+	group->file = VFSRetain(c->file);
+	group->blksize     = c->blksize;
+	group->filesize    = c->filesize;
+	group->sendingfile = 1;
+	if (group->file->fd != -1)
+		posix_fadvise(group->file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	SetMulticastInterface(c->s.fd);
+
+	mcsession_t *mc = nmalloc(sizeof(mcsession_t));
+	mc->group     = group;
+	mc->blksize   = c->blksize;
+	mc->lastblock = c->filesize / c->blksize + 1;
+	mc->port      = ntohs(addr.in.sin_port);
+	inet_ntop(AF_INET, &addr.in.sin_addr, mc->address, sizeof(mc->address));
+	vec_init(&mc->members);
+
+	group->mcsession = mc;
+
+	// Unicast clients reading the same file can share the reads too.
+	if (config->sharedstreams)
+		AttachStream(group);
+
+	vec_push(&sessions, mc);
+	totalsessions++;
+
+	printf("Started multicast group %s:%d\n", mc->address, mc->port);
+
+	return mc;
+}
+
+static void EndSession(mcsession_t *mc)
+{
+	client_t *group = mc->group, *c;
+	int idx;
+
+	vec_remove(&sessions, mc);
+
+	// Anyone left can't get the rest of the file anymore.
+	vec_foreach(&mc->members, c, idx)
+	{
+		c->mcsession = NULL;
+		Error(c, ERROR_UNDEFINED, "Multicast transfer aborted");
+	}
+
+	printf("Ending multicast group %s:%d\n", mc->address, mc->port);
+
+	vec_deinit(&mc->members);
+	free(mc);
+
+	if (group->mcsession)
+	{
+		group->mcsession = NULL;
+		RemoveClient(group);
+	}
+}
+
+// Tell a member it is now the master client, it answers with an
+// ACK for the last block it has so we know where to start.
+static void NewMaster(mcsession_t *mc)
+{
+	client_t *master = mc->members.data[0];
+	char param[32];
+
+	snprintf(param, sizeof(param), "%s,%d,1", mc->address, mc->port);
+
+	const char *option = "multicast", *value = param;
+	OptionAcknowledge(master, &option, &value, 1);
+	mc->newmaster = 1;
+
+	printf("Client %s is now master of multicast group %s:%d\n", GetAddress(master->s.addr), mc->address, mc->port);
+}
+
+// Put the client in the multicast group for the file it opened and fill
+// in the value for the multicast option of the OACK. Returns -1 if the
+// client can't use multicast, in which case it gets the file as usual.
+int JoinMulticast(client_t *c, char *param, size_t len)
+{
+	assert(c && c->file && param);
+
+	// RFC 2090 only knows about IPv4 addresses.
+	if (!config->multicastaddr || c->s.addr.sa.sa_family != AF_INET)
+		return -1;
+
+	// Without knowing which file is which there's no telling who to group.
+	if (!(c->file->backend->caps & VFS_SHARED))
+		return -1;
+
+	mcsession_t *mc = NULL;
+	int idx;
+
+	vec_foreach(&sessions, mc, idx)
+	{
+		vfile_t *vf = mc->group->file;
+		if (vf->backend == c->file->backend && vf->dev == c->file->dev && vf->ino == c->file->ino
+		    && mc->blksize == c->blksize && mc->group->s.fd == c->s.fd)
+			goto found;
+	}
+
+	mc = NewSession(c);
+	if (!mc)
+		return -1;
+
+found:
+	vec_push(&mc->members, c);
+	c->mcsession = mc;
+	totalmembers++;
+
+	// The group sends the file, members don't read anything.
+	VFSClose(c->file);
+	c->file = NULL;
+
+	int master = mc->members.length == 1;
+	snprintf(param, len, "%s,%d,%d", mc->address, mc->port, master);
+
+	printf("Client %s joined multicast group %s:%d%s (%d members)\n", GetAddress(c->s.addr),
+	       mc->address, mc->port, master ? " as master" : "", mc->members.length);
+
+	return 0;
+}
+
+void LeaveMulticast(client_t *c)
+{
+	mcsession_t *mc = c->mcsession;
+
+	if (!mc)
+		return;
+
+	// The group went away before the members did.
+	if (mc->group == c)
+	{
+		c->mcsession = NULL;
+		EndSession(mc);
+		return;
+	}
+
+	int wasmaster = mc->members.data[0] == c;
+
+	vec_remove(&mc->members, c);
+	c->mcsession = NULL;
+
+	if (!mc->members.length)
+		EndSession(mc);
+	else if (wasmaster)
+		NewMaster(mc);
+}
+
+void MulticastAcknowledge(client_t *c, uint16_t blockno)
+{
+	mcsession_t *mc = c->mcsession;
+	assert(mc);
+
+	// RFC 2090 says only the master client ACKs, anyone else
+	// is a late joiner that hasn't been told it's master yet.
+	if (mc->members.data[0] != c)
+	{
+		bprintf("Ignoring ACK from multicast client which is not the master\n");
+		return;
+	}
+
+	// Block numbers roll over at 16 bits, it has to be one the group sent.
+	uint64_t block = FullBlockNumber(blockno, mc->group->highestblock);
+	if (block == UINT64_MAX)
+	{
+		bprintf("Ignoring ACK for block %d the group never sent\n", blockno);
+		return;
+	}
+
+	// The master repeating its last ACK, don't send the next block twice
+	// (the group's retransmit timer resends it if it got lost). A new
+	// master ACKing the same block is telling us where it is though.
+	if (block == mc->group->acked && block < mc->group->actualblockno && !mc->newmaster)
+	{
+		bprintf("Ignoring duplicate ACK for block %d from master client\n", blockno);
+		return;
+	}
+
+	mc->newmaster = 0;
+
+	if (block >= mc->lastblock)
+	{
+		printf("Master client %s has all of the file from multicast group %s:%d\n",
+		       GetAddress(c->s.addr), mc->address, mc->port);
+
+		completed++;
+
+		// Nobody is waiting on the group until the next master says so.
+		CancelTimer(&mc->group->windowtimer);
+		LeaveMulticast(c);
+
+		// Nothing is going to be sent to it, make sure the socket
+		// comes around as writable so the client gets cleaned up.
+		c->sendingfile = 0;
+		c->destroy = 1;
+		SetSocketStatus(&c->s, SF_READABLE | SF_WRITABLE);
+		return;
+	}
+
+	SendBlockAfter(mc->group, block);
+}
+
+void PrintMulticastStatistics(void)
+{
+	int members = 0;
+	mcsession_t *mc;
+	int idx;
+
+	vec_foreach(&sessions, mc, idx)
+		members += mc->members.length;
+
+	printf("Multicast: %d active groups with %d members, %lu groups and %lu members total, %lu completed\n",
+	       sessions.length, members, (unsigned long)totalsessions, (unsigned long)totalmembers, (unsigned long)completed);
+}
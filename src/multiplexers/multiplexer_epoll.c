@@ -159,6 +159,11 @@ void ProcessSockets(void)
 		// Call our event.
 		CallEvent(EV_SOCKETACTIVITY, &s);
 
+		// ICMP errors for packets we sent are queued on the socket, those
+		// are about a client rather than the socket itself.
+		if (ev->events & EPOLLERR && ReceiveErrors(s) == 0)
+			ev->events &= ~EPOLLERR;
+
 		if (ev->events & (EPOLLHUP | EPOLLERR))
 		{
 			bprintf("Epoll error reading socket %d, destroying.\n", s.fd);
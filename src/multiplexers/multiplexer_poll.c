@@ -143,6 +143,11 @@ void ProcessSockets(void)
 		// Call our event.
 		CallEvent(EV_SOCKETACTIVITY, &s);
 
+		// ICMP errors for packets we sent are queued on the socket, those
+		// are about a client rather than the socket itself.
+		if (ev->revents & POLLERR && ReceiveErrors(s) == 0)
+			ev->revents &= ~POLLERR;
+
 		if (ev->revents & (POLLERR | POLLRDHUP))
 		{
 			bprintf("Epoll error reading socket %d, destroying.\n", s.fd);
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "netascii.h"
+#include "misc.h"
+#include "sysconf.h"
+#include <string.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+# include <immintrin.h>
+#endif
+
+// netascii (RFC 764) is plain text with CR LF line endings, a CR on its own
+// is sent as CR NUL. Sending, every LF in the file becomes CR LF and every
+// CR becomes CR NUL. Receiving, the pairs go back to LF and CR.
+//
+// Most of a text file is runs of bytes which don't change, so the work is
+// finding the next CR or LF fast enough to copy the runs in between. That
+// is done 16 (SSE2) or 32 (AVX2) bytes at a time.
+
+// Find the first CR or other in buf, returns len if there isn't one.
+static size_t ScanGeneric(const uint8_t *buf, size_t len, uint8_t other)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (buf[i] == '\r' || buf[i] == other)
+			return i;
+	}
+
+	return len;
+}
+
+#ifdef __SSE2__
+static size_t ScanSSE2(const uint8_t *buf, size_t len, uint8_t other)
+{
+	const __m128i cr = _mm_set1_epi8('\r'), ot = _mm_set1_epi8(other);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, ot)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + ScanGeneric(buf + i, len - i, other);
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2")))
+static size_t ScanAVX2(const uint8_t *buf, size_t len, uint8_t other)
+{
+	const __m256i cr = _mm256_set1_epi8('\r'), ot = _mm256_set1_epi8(other);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, ot)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + ScanGeneric(buf + i, len - i, other);
+}
+#endif
+
+static size_t Scan(const uint8_t *buf, size_t len, uint8_t other)
+{
+	static size_t (*scan)(const uint8_t *, size_t, uint8_t) = NULL;
+
+	// Pick the widest one this CPU can run the first time around.
+	if (!scan)
+	{
+		scan = ScanGeneric;
+#ifdef __SSE2__
+		scan = ScanSSE2;
+#endif
+#ifdef HAVE_AVX2_TARGET
+		if (__builtin_cpu_supports("avx2"))
+			scan = ScanAVX2;
+#endif
+	}
+
+	return scan(buf, len, other);
+}
+
+// Encode as much of in as fits in out. carry is the half of a pair left
+// over from the last block (NETASCII_NOCARRY if none), it goes out first
+// and comes back set if the block ended in the middle of a pair. consumed
+// is how much of in made it. Returns the length of the block.
+size_t NetasciiEncode(const uint8_t *in, size_t inlen, uint8_t *out, size_t outlen, int16_t *carry, size_t *consumed)
+{
+	size_t i = 0, o = 0;
+
+	if (*carry != NETASCII_NOCARRY && outlen)
+	{
+		out[o++] = *carry;
+		*carry = NETASCII_NOCARRY;
+	}
+
+	while (i < inlen && o < outlen)
+	{
+		size_t run = Scan(in + i, MIN(inlen - i, outlen - o), '\n');
+		memcpy(out + o, in + i, run);
+		i += run;
+		o += run;
+
+		if (i == inlen || o == outlen)
+			break;
+
+		uint8_t second = in[i++] == '\n' ? '\n' : '\0';
+		out[o++] = '\r';
+
+		if (o < outlen)
+			out[o++] = second;
+		else
+			*carry = second;
+	}
+
+	*consumed = i;
+	return o;
+}
+
+// Decode a block in place. cr is set when the block ended with a CR, what
+// it means depends on the next block so pass it back in with that one.
+// If prefixcr comes back set that CR wasn't part of a pair and has to be
+// written before this block. Returns the decoded length.
+size_t NetasciiDecode(uint8_t *buf, size_t len, uint8_t *cr, uint8_t *prefixcr)
+{
+	size_t i = 0, o = 0;
+
+	*prefixcr = 0;
+
+	if (*cr && len)
+	{
+		*cr = 0;
+
+		if (buf[0] == '\n' || buf[0] == '\0')
+			buf[o++] = buf[i++] == '\n' ? '\n' : '\r';
+		else
+			*prefixcr = 1;
+	}
+
+	while (i < len)
+	{
+		size_t run = Scan(buf + i, len - i, '\r');
+		if (o != i)
+			memmove(buf + o, buf + i, run);
+		i += run;
+		o += run;
+
+		if (i == len)
+			break;
+
+		// Skip the CR, what comes after it says what it was.
+		if (++i == len)
+		{
+			*cr = 1;
+			break;
+		}
+
+		if (buf[i] == '\n' || buf[i] == '\0')
+			buf[o++] = buf[i++] == '\n' ? '\n' : '\r';
+		else
+			// A CR on its own, not valid netascii but keep it.
+			buf[o++] = '\r';
+	}
+
+	return o;
+}
@@ -125,7 +125,7 @@ void Error(client_t *c, const uint16_t errnum, const char *str, ...)
 	free(buf);
 }
 
-void OptionAcknowledge(client_t *c, const char *option, const char *param)
+void OptionAcknowledge(client_t *c, const char **options, const char **values, size_t count)
 {
 	//
 	//   2 bytes     string   1 byte    string   1 byte    string    1 byte     string   1 byte
@@ -134,16 +134,24 @@ void OptionAcknowledge(client_t *c, const char *option, const char *param)
 	//  +----------+---~~---+---------+---~~---+---------+---~~---+-----------+---~~---+---+
 	//
 
-	assert(c && option && param);
-	packet_t *p = nmalloc(sizeof(packet_t) + strlen(option) + strlen(param) + 2);
+	assert(c && options && values && count);
+
+	size_t len = sizeof(uint16_t);
+	for (size_t i = 0; i < count; i++)
+		len += strlen(options[i]) + strlen(values[i]) + 2;
+
+	packet_t *p = nmalloc(len);
 	p->opcode = htons(PACKET_OACK);
 
 	uint8_t *pptr = ((uint8_t*)p) + sizeof(uint16_t);
-	strcpy((char*)pptr, option);
-	pptr += strlen(option);
-	*pptr++ = '\0';
-	strcpy((char*)pptr, param);
-	*pptr = '\0';
+	for (size_t i = 0; i < count; i++)
+	{
+		// strcpy copies the null-terminator too, skip past it.
+		strcpy((char*)pptr, options[i]);
+		pptr += strlen(options[i]) + 1;
+		strcpy((char*)pptr, values[i]);
+		pptr += strlen(values[i]) + 1;
+	}
 
-	QueuePacket(c, p, sizeof(packet_t) + strlen(option) + strlen(param) + 2, 1);
+	QueuePacket(c, p, len, 1);
 }
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 extern int yylex();
@@ -13,6 +14,41 @@ extern void yyerror(const char *s);
 config_t *config;
 listen_t *curblock;
 conf_module_t *curmod;
+conf_template_t *curtemplate;
+conf_archive_t *curarchive;
+conf_upstream_t *curupstream;
+conf_peers_t *curpeers;
+conf_http_t *curhttp;
+conf_preload_t *curpreload;
+
+// A config with everything at its defaults, made by whichever block comes first.
+static config_t *NewConfig(void)
+{
+	config_t *c = nmalloc(sizeof(config_t));
+	// Only a server block says whether to daemonize.
+	c->daemonize = -1;
+	c->readtimeout = 5;
+	c->fixpath = 1;
+	c->iothreads = 4;
+	c->sharedstreams = 1;
+	c->prefetch = 1;
+	c->multicastport = 1758;
+	c->maxwindowsize = 64;
+	c->pacing = PACING_TIMER;
+	c->blockrollover = 0;
+	c->uploadsync = SYNC_FILE;
+	c->eventqueue = 4096;
+	c->eventoverflow = EVENTS_DROP;
+	vec_init(&c->listenblocks);
+	vec_init(&c->moduleblocks);
+	vec_init(&c->templateblocks);
+	vec_init(&c->archiveblocks);
+	vec_init(&c->upstreamblocks);
+	vec_init(&c->peerblocks);
+	vec_init(&c->httpblocks);
+	vec_init(&c->preloadblocks);
+	return c;
+}
 %}
 
 %error-verbose
@@ -43,12 +79,41 @@ conf_module_t *curmod;
 %token NAME
 %token PATH
 %token MODSEARCHPATH
+%token IOTHREADS
+%token SHAREDSTREAMS
+%token PREFETCH
+%token MULTICASTADDR
+%token MULTICASTPORT
+%token MAXWINDOWSIZE
+%token PACING
+%token UPLOADSYNC
+%token EVENTQUEUE
+%token EVENTOVERFLOW
+%token BLOCKROLLOVER
+%token MTU
+%token TEMPLATE
+%token MATCH
+%token FILENAME
+%token TEMPLATEDATA
+%token ARCHIVE
+%token UPSTREAM
+%token URL
+%token CACHE
+%token REVALIDATE
+%token TIMEOUT
+%token PEERS
+%token PEER
+%token SELF
+%token HTTP
+%token PRELOAD
+%token PIN
+%token HUGEPAGES
 
 %%
 
 conf: | conf conf_items;
 
-conf_items: server_entry | listen_entry | module_entry;
+conf_items: server_entry | listen_entry | module_entry | template_entry | archive_entry | upstream_entry | peers_entry | http_entry | preload_entry;
 
 module_entry: MODULE
 {
@@ -58,36 +123,103 @@ module_entry: MODULE
 	curmod = m;
 	
 	if (!config)
-	{
-		config = nmalloc(sizeof(config_t));
-		config->daemonize = -1;
-		config->readtimeout = 5;
-		config->fixpath = 1;
-		vec_init(&config->listenblocks);
-		vec_init(&config->moduleblocks);
-	}
+		config = NewConfig();
 	
 	vec_push(&config->moduleblocks, m);
 }
 '{' module_items '}';
 
+template_entry: TEMPLATE
+{
+	conf_template_t *t = nmalloc(sizeof(conf_template_t));
+	curtemplate = t;
+	
+	if (!config)
+		config = NewConfig();
+	
+	vec_push(&config->templateblocks, t);
+}
+'{' template_items '}';
+
+archive_entry: ARCHIVE
+{
+	conf_archive_t *a = nmalloc(sizeof(conf_archive_t));
+	curarchive = a;
+	
+	if (!config)
+		config = NewConfig();
+	
+	vec_push(&config->archiveblocks, a);
+}
+'{' archive_items '}';
+
+upstream_entry: UPSTREAM
+{
+	conf_upstream_t *u = nmalloc(sizeof(conf_upstream_t));
+	u->revalidate = 60;
+	u->timeout = 5;
+	curupstream = u;
+	
+	if (!config)
+		config = NewConfig();
+	
+	vec_push(&config->upstreamblocks, u);
+}
+'{' upstream_items '}';
+
+peers_entry: PEERS
+{
+	conf_peers_t *p = nmalloc(sizeof(conf_peers_t));
+	p->port = -1;
+	p->revalidate = 10;
+	p->timeout = 2;
+	vec_init(&p->peers);
+	curpeers = p;
+	
+	if (!config)
+		config = NewConfig();
+	
+	vec_push(&config->peerblocks, p);
+}
+'{' peers_items '}';
+
+http_entry: HTTP
+{
+	conf_http_t *h = nmalloc(sizeof(conf_http_t));
+	h->port = 80;
+	curhttp = h;
+	
+	if (!config)
+		config = NewConfig();
+	
+	vec_push(&config->httpblocks, h);
+}
+'{' http_items '}';
+
+preload_entry: PRELOAD
+{
+	conf_preload_t *p = nmalloc(sizeof(conf_preload_t));
+	vec_init(&p->match);
+	curpreload = p;
+	
+	if (!config)
+		config = NewConfig();
+	
+	vec_push(&config->preloadblocks, p);
+}
+'{' preload_items '}';
+
 listen_entry: LISTEN
 {
 	listen_t *block = nmalloc(sizeof(listen_t));
 	block->port = -1;
 	block->bindaddr = NULL;
+	block->mtu = 0;
 	
 	curblock = block;
 	
 	if (!config)
-	{
-		config = nmalloc(sizeof(config_t));
-		config->daemonize = -1;
-		config->readtimeout = 5;
-		config->fixpath = 1;
-		vec_init(&config->listenblocks);
-		vec_init(&config->moduleblocks);
-	}
+		config = NewConfig();
 	
 	vec_push(&config->listenblocks, block);
 }
@@ -95,22 +227,19 @@ listen_entry: LISTEN
 
 server_entry: SERVER
 {
-	config = nmalloc(sizeof(config_t));
-	// Defaults
+	config = NewConfig();
 	config->daemonize = 1;
-	config->readtimeout = 5;
-	config->fixpath = 1;
-	vec_init(&config->listenblocks);
-	vec_init(&config->moduleblocks);
 }
 '{' server_items '}';
 
 server_items: | server_item server_items;
 server_item: server_directory | server_user | server_group | server_daemonize | server_pidfile | server_readtimeout | server_fixpath
-| server_module_search_path;
+| server_module_search_path | server_iothreads | server_sharedstreams | server_prefetch
+| server_multicastaddr | server_multicastport | server_maxwindowsize | server_pacing
+| server_blockrollover | server_uploadsync | server_eventqueue | server_eventoverflow;
 
 listen_items: | listen_item listen_items;
-listen_item: listen_bind | listen_port;
+listen_item: listen_bind | listen_port | listen_mtu;
 
 module_items: | module_item module_items;
 module_item: module_path | module_name;
@@ -125,6 +254,129 @@ module_name: NAME '=' STR ';'
 	curmod->name = strdup(yylval.sval);
 };
 
+template_items: | template_item template_items;
+template_item: template_match | template_file | template_data;
+
+template_match: MATCH '=' STR ';'
+{
+	curtemplate->match = strdup(yylval.sval);
+};
+
+template_file: FILENAME '=' STR ';'
+{
+	curtemplate->file = strdup(yylval.sval);
+};
+
+template_data: TEMPLATEDATA '=' STR ';'
+{
+	curtemplate->data = strdup(yylval.sval);
+};
+
+archive_items: | archive_item archive_items;
+archive_item: archive_file | archive_path;
+
+archive_file: FILENAME '=' STR ';'
+{
+	curarchive->file = strdup(yylval.sval);
+};
+
+archive_path: PATH '=' STR ';'
+{
+	curarchive->path = strdup(yylval.sval);
+};
+
+upstream_items: | upstream_item upstream_items;
+upstream_item: upstream_path | upstream_url | upstream_cache | upstream_revalidate | upstream_timeout;
+
+upstream_path: PATH '=' STR ';'
+{
+	curupstream->path = strdup(yylval.sval);
+};
+
+upstream_url: URL '=' STR ';'
+{
+	curupstream->url = strdup(yylval.sval);
+};
+
+upstream_cache: CACHE '=' STR ';'
+{
+	curupstream->cache = strdup(yylval.sval);
+};
+
+upstream_revalidate: REVALIDATE '=' CINT ';'
+{
+	curupstream->revalidate = yylval.ival;
+};
+
+upstream_timeout: TIMEOUT '=' CINT ';'
+{
+	curupstream->timeout = yylval.ival;
+};
+
+peers_items: | peers_item peers_items;
+peers_item: peers_bind | peers_port | peers_self | peers_peer | peers_revalidate | peers_timeout;
+
+peers_bind: BIND '=' STR ';'
+{
+	curpeers->bindaddr = strdup(yylval.sval);
+};
+
+peers_port: PORT '=' CINT ';'
+{
+	curpeers->port = yylval.ival;
+};
+
+peers_self: SELF '=' STR ';'
+{
+	curpeers->self = strdup(yylval.sval);
+};
+
+peers_peer: PEER '=' STR ';'
+{
+	vec_push(&curpeers->peers, strdup(yylval.sval));
+};
+
+peers_revalidate: REVALIDATE '=' CINT ';'
+{
+	curpeers->revalidate = yylval.ival;
+};
+
+peers_timeout: TIMEOUT '=' CINT ';'
+{
+	curpeers->timeout = yylval.ival;
+};
+
+http_items: | http_item http_items;
+http_item: http_bind | http_port;
+
+http_bind: BIND '=' STR ';'
+{
+	curhttp->bindaddr = strdup(yylval.sval);
+};
+
+http_port: PORT '=' CINT ';'
+{
+	curhttp->port = yylval.ival;
+};
+
+preload_items: | preload_item preload_items;
+preload_item: preload_match | preload_pin | preload_hugepages;
+
+preload_match: MATCH '=' STR ';'
+{
+	vec_push(&curpreload->match, strdup(yylval.sval));
+};
+
+preload_pin: PIN '=' BOOL ';'
+{
+	curpreload->pin = yylval.bval;
+};
+
+preload_hugepages: HUGEPAGES '=' BOOL ';'
+{
+	curpreload->hugepages = yylval.bval;
+};
+
 listen_bind: BIND '=' STR ';'
 {
 	curblock->bindaddr = strdup(yylval.sval);
@@ -140,6 +392,11 @@ listen_port: PORT '=' CINT ';'
 	curblock->port = yylval.ival;
 };
 
+listen_mtu: MTU '=' CINT ';'
+{
+	curblock->mtu = yylval.ival;
+};
+
 server_directory: DIRECTORY '=' STR ';'
 {
 	config->directory = strdup(yylval.sval);
@@ -199,3 +456,82 @@ server_fixpath: FIXPATH '=' BOOL ';'
 {
 	config->fixpath = yylval.bval;
 };
+
+server_iothreads: IOTHREADS '=' CINT ';'
+{
+	config->iothreads = yylval.ival;
+};
+
+server_sharedstreams: SHAREDSTREAMS '=' BOOL ';'
+{
+	config->sharedstreams = yylval.bval;
+};
+
+server_prefetch: PREFETCH '=' BOOL ';'
+{
+	config->prefetch = yylval.bval;
+};
+
+server_multicastaddr: MULTICASTADDR '=' STR ';'
+{
+	config->multicastaddr = strdup(yylval.sval);
+	if (!config->multicastaddr)
+	{
+		fprintf(stderr, "Failed to parse config: %s\n", strerror(errno));
+		exit(1);
+	}
+};
+
+server_multicastport: MULTICASTPORT '=' CINT ';'
+{
+	config->multicastport = yylval.ival;
+};
+
+server_maxwindowsize: MAXWINDOWSIZE '=' CINT ';'
+{
+	config->maxwindowsize = yylval.ival;
+};
+
+server_pacing: PACING '=' STR ';'
+{
+	if (!strcasecmp(yylval.sval, "off"))
+		config->pacing = PACING_OFF;
+	else if (!strcasecmp(yylval.sval, "timer"))
+		config->pacing = PACING_TIMER;
+	else if (!strcasecmp(yylval.sval, "txtime"))
+		config->pacing = PACING_TXTIME;
+	else
+		config->pacing = -1;
+};
+
+server_blockrollover: BLOCKROLLOVER '=' CINT ';'
+{
+	config->blockrollover = yylval.ival;
+};
+
+server_uploadsync: UPLOADSYNC '=' STR ';'
+{
+	if (!strcasecmp(yylval.sval, "off"))
+		config->uploadsync = SYNC_OFF;
+	else if (!strcasecmp(yylval.sval, "file"))
+		config->uploadsync = SYNC_FILE;
+	else if (!strcasecmp(yylval.sval, "full"))
+		config->uploadsync = SYNC_FULL;
+	else
+		config->uploadsync = -1;
+};
+
+server_eventqueue: EVENTQUEUE '=' CINT ';'
+{
+	config->eventqueue = yylval.ival;
+};
+
+server_eventoverflow: EVENTOVERFLOW '=' STR ';'
+{
+	if (!strcasecmp(yylval.sval, "drop"))
+		config->eventoverflow = EVENTS_DROP;
+	else if (!strcasecmp(yylval.sval, "block"))
+		config->eventoverflow = EVENTS_BLOCK;
+	else
+		config->eventoverflow = -1;
+};
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "peer.h"
+#include "config.h"
+#include "misc.h"
+#include "upstream.h"
+#include "vec.h"
+#include "vfs.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Nodes sharing the work of reading files from wherever they come from.
+// Every node (us included) gets PEER_POINTS points on a hash ring and a
+// file belongs to the node with the first point after the file's hash,
+// so each node only has to read its share and the others get the rest
+// from it. Nodes coming and going only moves the files next to their
+// points around.
+//
+// Files another node owns are fetched from it over HTTP (http.c serves
+// the other end) using the upstream machinery, kept in memory and shared
+// by everyone asking for them here. When the owner doesn't have the file,
+// takes too long to answer or can't be reached we serve it ourselves.
+
+typedef struct node_s
+{
+	char *name;
+	// NULL for us.
+	origin_t *origin;
+	// Not asked again until then after we couldn't reach it.
+	uint64_t retry;
+	// Answers in a row that took too long.
+	int late;
+} node_t;
+
+typedef struct point_s
+{
+	uint64_t hash;
+	node_t *node;
+} point_t;
+
+static vec_t(node_t*) nodes;
+static point_t *ring;
+static size_t npoints;
+static uint64_t ours, missing, unreachable, slow;
+
+// FNV-1a with the bits mixed up some more, neighbouring names
+// should land nowhere near each other.
+static uint64_t Hash(const char *s)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int ComparePoints(const void *a, const void *b)
+{
+	const point_t *x = a, *y = b;
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static node_t *Owner(const char *path)
+{
+	uint64_t h = Hash(path);
+	size_t lo = 0, hi = npoints;
+
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return ring[lo == npoints ? 0 : lo].node;
+}
+
+static int PeerOpen(vfile_t *vf, const char *path, const socketstructs_t *peer)
+{
+	node_t *n = Owner(path);
+	uint64_t now = MonotonicTime();
+
+	if (!n->origin)
+	{
+		ours++;
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (now < n->retry)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (OriginOpen(n->origin, vf, path) == 0)
+	{
+		n->late = 0;
+		return 0;
+	}
+
+	// It's coming, whoever opened it gets told when. Or it would
+	// have to and they didn't want to wait.
+	if (errno == EINPROGRESS || errno == EWOULDBLOCK)
+		return -1;
+
+	if (errno == ENOENT)
+	{
+		n->late = 0;
+		missing++;
+	}
+	// It could be busy waiting on someone else, or it could be gone.
+	else if (errno == ETIMEDOUT && ++n->late < PEER_LATE)
+		slow++;
+	// Don't hold everyone up asking again.
+	else
+	{
+		n->late = 0;
+		fprintf(stderr, "Peer %s can't be reached for %s (%s), leaving it alone for %d seconds\n",
+		        n->name, path, strerror(errno), PEER_RETRY);
+		n->retry = now + PEER_RETRY * SECONDS;
+		unreachable++;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+static const backend_t peerbackend = {
+	"peer", VFS_SHARED | VFS_PEER | VFS_REMOTE,
+	PeerOpen, NULL, OriginRead, NULL, NULL, OriginClose
+};
+
+static void AddNode(const char *name, origin_t *origin)
+{
+	node_t *n = nmalloc(sizeof(node_t));
+	n->name = strdup(name);
+	n->origin = origin;
+	vec_push(&nodes, n);
+}
+
+// Before the templates and modules, whose files are theirs alone.
+void InitializePeers(void)
+{
+	node_t *n;
+	char *name;
+	int i;
+
+	vec_init(&nodes);
+
+	if (!config->peerblocks.length)
+		return;
+
+	conf_peers_t *p = config->peerblocks.data[0];
+
+	AddNode(p->self, NULL);
+
+	vec_foreach(&p->peers, name, i)
+	{
+		// Everyone can have the same list, us included.
+		if (!strcmp(name, p->self))
+			continue;
+
+		char *url = stringify("http://%s", name);
+		origin_t *o = NewOrigin(url, NULL, p->revalidate * SECONDS, p->timeout * SECONDS, PEER_WAIT);
+		free(url);
+
+		if (!o)
+		{
+			fprintf(stderr, "Error: peer %s is not a host:port, ignoring it.\n", name);
+			continue;
+		}
+
+		AddNode(name, o);
+	}
+
+	if (nodes.length < 2)
+	{
+		fprintf(stderr, "Warning: no peers to share files with.\n");
+		return;
+	}
+
+	ring = nmalloc(sizeof(point_t) * nodes.length * PEER_POINTS);
+	vec_foreach(&nodes, n, i)
+	{
+		for (int j = 0; j < PEER_POINTS; j++)
+		{
+			char *point = stringify("%s#%d", n->name, j);
+			ring[npoints].hash = Hash(point);
+			ring[npoints++].node = n;
+			free(point);
+		}
+	}
+	qsort(ring, npoints, sizeof(point_t), ComparePoints);
+
+	printf("Sharing files with %d peers as %s\n", nodes.length - 1, p->self);
+	RegisterBackend(&peerbackend);
+}
+
+// Before the upstreams, which have our origins.
+void ShutdownPeers(void)
+{
+	node_t *n;
+	int i;
+
+	if (ring)
+		UnregisterBackend(&peerbackend);
+
+	vec_foreach(&nodes, n, i)
+	{
+		free(n->name);
+		free(n);
+	}
+	vec_deinit(&nodes);
+
+	free(ring);
+	ring = NULL;
+	npoints = 0;
+}
+
+void PrintPeerStatistics(void)
+{
+	originstats_t total, stats;
+	node_t *n;
+	int i;
+
+	if (!ring)
+		return;
+
+	memset(&total, 0, sizeof(total));
+	vec_foreach(&nodes, n, i)
+	{
+		if (!n->origin)
+			continue;
+
+		GetOriginStatistics(n->origin, &stats);
+		total.fetches   += stats.fetches;
+		total.fetched   += stats.fetched;
+		total.coalesced += stats.coalesced;
+		total.hits      += stats.hits;
+	}
+
+	printf("Peers: %lu fetches (%s), %lu joined a fetch, %lu from memory, %lu ours, %lu they didn't have, %lu too slow, %lu unreachable\n",
+	       (unsigned long)total.fetches, SizeReduce(total.fetched), (unsigned long)total.coalesced, (unsigned long)total.hits,
+	       (unsigned long)ours, (unsigned long)missing, (unsigned long)slow, (unsigned long)unreachable);
+}
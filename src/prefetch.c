@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "prefetch.h"
+#include "config.h"
+#include "misc.h"
+#include "process.h"
+#include "vfs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Netboot clients ask for the same files in the same order every time:
+// pxelinux.0, ldlinux.c32, their pxelinux.cfg file, the kernel and the
+// initrd. The first of a rack of machines booting waits on a cold disk
+// for each of them in turn. We learn which files follow which from what
+// clients get, from each client's last boot and from everyone's, and
+// when a client gets a file warm the ones likely to come next: the page
+// cache for files on disk, memory for archives, templates by rendering.
+//
+// Files are only warmed if they can be opened right away, waiting on an
+// origin or a peer would hold up everyone else. Files another node or an
+// origin would serve aren't warmed from anywhere else either.
+
+// Files and clients are both found by hash and forgotten least
+// recently used first, each starts with one of these.
+typedef struct entry_s
+{
+	uint64_t hash;
+	// Its bucket and the next entry in it, and its neighbours in
+	// order of when they were last used.
+	struct entry_s *hnext, *prev, *next;
+} entry_t;
+
+typedef struct table_s
+{
+	entry_t **buckets;
+	int nbuckets, count;
+	entry_t *newest, *oldest;
+} table_t;
+
+typedef struct follower_s
+{
+	char *path;
+	uint32_t count;
+} follower_t;
+
+typedef struct learned_s
+{
+	entry_t entry;
+	char *path;
+	// What's been asked for after it and how often.
+	follower_t followers[PREFETCH_FOLLOWERS];
+	uint64_t warmed;
+} learned_t;
+
+typedef struct history_s
+{
+	entry_t entry;
+	socketstructs_t addr;
+	// What the client asked for, oldest first, and when.
+	char *paths[PREFETCH_HISTORY];
+	uint64_t when[PREFETCH_HISTORY];
+	int count;
+} history_t;
+
+static entry_t *filebuckets[PREFETCH_FILES], *clientbuckets[PREFETCH_CLIENTS];
+static table_t files = { filebuckets, PREFETCH_FILES }, clients = { clientbuckets, PREFETCH_CLIENTS };
+static uint64_t requests, following, hits, warmed, warmedbytes;
+
+// FNV-1a
+static uint64_t Hash(const void *buf, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ ((const uint8_t *)buf)[i]) * 1099511628211ULL;
+
+	return h;
+}
+
+static void Unlink(table_t *t, entry_t *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		t->newest = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		t->oldest = e->prev;
+
+	e->prev = e->next = NULL;
+}
+
+static void MakeNewest(table_t *t, entry_t *e)
+{
+	e->next = t->newest;
+	if (t->newest)
+		t->newest->prev = e;
+	else
+		t->oldest = e;
+	t->newest = e;
+}
+
+static void Add(table_t *t, entry_t *e, uint64_t hash)
+{
+	entry_t **bucket = &t->buckets[hash % t->nbuckets];
+
+	e->hash  = hash;
+	e->hnext = *bucket;
+	*bucket  = e;
+	MakeNewest(t, e);
+	t->count++;
+}
+
+static void Remove(table_t *t, entry_t *e)
+{
+	entry_t **p = &t->buckets[e->hash % t->nbuckets];
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+
+	Unlink(t, e);
+	t->count--;
+}
+
+// Which host a client is, clients fetch each file from a new port.
+static uint64_t HashHost(const socketstructs_t *a)
+{
+	if (a->sa.sa_family == AF_INET)
+		return Hash(&a->in.sin_addr, sizeof(struct in_addr));
+
+	return Hash(&a->in6.sin6_addr, sizeof(struct in6_addr));
+}
+
+static int SameHost(const socketstructs_t *a, const socketstructs_t *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family)
+		return 0;
+
+	if (a->sa.sa_family == AF_INET)
+		return a->in.sin_addr.s_addr == b->in.sin_addr.s_addr;
+
+	return !memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof(struct in6_addr));
+}
+
+static void FreeHistory(history_t *h)
+{
+	for (int i = 0; i < h->count; i++)
+		free(h->paths[i]);
+	free(h);
+}
+
+static void FreeLearned(learned_t *l)
+{
+	for (int i = 0; i < PREFETCH_FOLLOWERS; i++)
+		free(l->followers[i].path);
+	free(l->path);
+	free(l);
+}
+
+static history_t *FindHistory(const socketstructs_t *peer)
+{
+	uint64_t hash = HashHost(peer);
+	history_t *h;
+
+	for (entry_t *e = clients.buckets[hash % clients.nbuckets]; e; e = e->hnext)
+	{
+		h = (history_t *)e;
+		if (e->hash == hash && SameHost(&h->addr, peer))
+		{
+			Unlink(&clients, e);
+			MakeNewest(&clients, e);
+			return h;
+		}
+	}
+
+	if (clients.count >= PREFETCH_CLIENTS)
+	{
+		h = (history_t *)clients.oldest;
+		Remove(&clients, &h->entry);
+		FreeHistory(h);
+	}
+
+	h = nmalloc(sizeof(history_t));
+	h->addr = *peer;
+	Add(&clients, &h->entry, hash);
+	return h;
+}
+
+static learned_t *FindFile(const char *path, int create)
+{
+	uint64_t hash = Hash(path, strlen(path));
+	learned_t *l;
+
+	for (entry_t *e = files.buckets[hash % files.nbuckets]; e; e = e->hnext)
+	{
+		l = (learned_t *)e;
+		if (e->hash == hash && !strcmp(l->path, path))
+		{
+			Unlink(&files, e);
+			MakeNewest(&files, e);
+			return l;
+		}
+	}
+
+	if (!create)
+		return NULL;
+
+	if (files.count >= PREFETCH_FILES)
+	{
+		l = (learned_t *)files.oldest;
+		Remove(&files, &l->entry);
+		FreeLearned(l);
+	}
+
+	l = nmalloc(sizeof(learned_t));
+	l->path = strdup(path);
+	Add(&files, &l->entry, hash);
+	return l;
+}
+
+// Where the client last asked for path before the entry at before, -1 if it didn't.
+static int LastAsked(history_t *h, int before, const char *path)
+{
+	for (int i = before - 1; i >= 0; i--)
+	{
+		if (!strcmp(h->paths[i], path))
+			return i;
+	}
+
+	return -1;
+}
+
+// Whether we'd have warmed path when the client got its entry at i.
+static int Predicted(history_t *h, int i, learned_t *l, const char *path)
+{
+	int last = LastAsked(h, i, h->paths[i]);
+
+	for (int j = last + 1; last != -1 && j < i && j <= last + PREFETCH_DEPTH; j++)
+	{
+		if (!strcmp(h->paths[j], path))
+			return 1;
+	}
+
+	for (int j = 0; j < PREFETCH_FOLLOWERS; j++)
+	{
+		if (l->followers[j].path && l->followers[j].count >= PREFETCH_SEEN && !strcmp(l->followers[j].path, path))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void Follow(learned_t *l, const char *path)
+{
+	follower_t *f = NULL;
+
+	for (int i = 0; i < PREFETCH_FOLLOWERS; i++)
+	{
+		if (l->followers[i].path && !strcmp(l->followers[i].path, path))
+		{
+			f = &l->followers[i];
+			break;
+		}
+
+		// Otherwise it takes the place of the one seen least.
+		if (!f || l->followers[i].count < f->count)
+			f = &l->followers[i];
+	}
+
+	if (!f->path || strcmp(f->path, path))
+	{
+		free(f->path);
+		f->path = strdup(path);
+		f->count = 0;
+	}
+
+	// Old habits fade so new ones can take over.
+	if (++f->count == UINT16_MAX)
+	{
+		for (int i = 0; i < PREFETCH_FOLLOWERS; i++)
+			l->followers[i].count /= 2;
+	}
+}
+
+static void Warm(const char *path, const socketstructs_t *peer, uint64_t now)
+{
+	learned_t *l = FindFile(path, 1);
+
+	if (l->warmed && now - l->warmed < PREFETCH_REWARM)
+		return;
+	l->warmed = now;
+
+	vfile_t *vf = VFSOpenNoWait(path, peer);
+	if (!vf)
+		return;
+
+	uint64_t len = MIN(vf->size, PREFETCH_LIMIT);
+	uintptr_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+
+	// The kernel only reads so much ahead for each hint.
+	for (uint64_t off = 0; off < len; off += PREFETCH_WINDOW)
+	{
+		uint64_t chunk = MIN(len - off, PREFETCH_WINDOW);
+
+		if (vf->map)
+		{
+			uintptr_t begin = (uintptr_t)(vf->map + off) & ~pagemask;
+			madvise((void *)begin, (uintptr_t)(vf->map + off) + chunk - begin, MADV_WILLNEED);
+		}
+		else if (vf->fd != -1)
+			posix_fadvise(vf->fd, off, chunk, POSIX_FADV_WILLNEED);
+	}
+
+	warmed++;
+	warmedbytes += len;
+	VFSClose(vf);
+}
+
+void LearnRequest(const char *path, const socketstructs_t *peer)
+{
+	if (!config->prefetch)
+		return;
+
+	while (*path == '/')
+		path++;
+
+	uint64_t now = MonotonicTime();
+	history_t *h = FindHistory(peer);
+	int followed = 0, hit = 0;
+
+	requests++;
+
+	// It follows the last few files the client got, if it got them lately.
+	for (int i = h->count - 1; i >= 0 && i >= h->count - PREFETCH_DEPTH; i--)
+	{
+		if (now - h->when[i] > PREFETCH_GAP)
+			break;
+
+		// Asking again isn't following.
+		if (!strcmp(h->paths[i], path))
+			continue;
+
+		learned_t *l = FindFile(h->paths[i], 1);
+		followed = 1;
+		hit |= Predicted(h, i, l, path);
+		Follow(l, path);
+	}
+
+	following += followed;
+	hits += hit;
+
+	// What came after it for this client last time, then for everyone.
+	int last = LastAsked(h, h->count, path);
+	for (int j = last + 1; last != -1 && j < h->count && j <= last + PREFETCH_DEPTH; j++)
+	{
+		if (strcmp(h->paths[j], path))
+			Warm(h->paths[j], peer, now);
+	}
+
+	learned_t *l = FindFile(path, 0);
+	for (int j = 0; l && j < PREFETCH_FOLLOWERS; j++)
+	{
+		if (l->followers[j].path && l->followers[j].count >= PREFETCH_SEEN)
+			Warm(l->followers[j].path, peer, now);
+	}
+
+	if (h->count == PREFETCH_HISTORY)
+	{
+		free(h->paths[0]);
+		memmove(h->paths, h->paths + 1, sizeof(char *) * (PREFETCH_HISTORY - 1));
+		memmove(h->when, h->when + 1, sizeof(uint64_t) * (PREFETCH_HISTORY - 1));
+		h->count--;
+	}
+
+	h->paths[h->count] = strdup(path);
+	h->when[h->count++] = now;
+}
+
+void InitializePrefetch(void)
+{
+}
+
+void ShutdownPrefetch(void)
+{
+	while (files.newest)
+	{
+		learned_t *l = (learned_t *)files.newest;
+		Remove(&files, &l->entry);
+		FreeLearned(l);
+	}
+
+	while (clients.newest)
+	{
+		history_t *h = (history_t *)clients.newest;
+		Remove(&clients, &h->entry);
+		FreeHistory(h);
+	}
+}
+
+void PrintPrefetchStatistics(void)
+{
+	if (!config->prefetch)
+		return;
+
+	printf("Prefetch: %lu requests, %lu predicted of %lu following another (%.1f%%), %lu files warmed (%s), %d files and %d clients known\n",
+	       (unsigned long)requests, (unsigned long)hits, (unsigned long)following,
+	       following ? 100.0 * hits / following : 0.0, (unsigned long)warmed, SizeReduce(warmedbytes), files.count, clients.count);
+}
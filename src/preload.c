@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "preload.h"
+#include "config.h"
+#include "filesystem.h"
+#include "misc.h"
+#include "timer.h"
+#include "vec.h"
+#include "vfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Files from the directory read into memory at startup, so the first
+// machines to boot after a restart don't wait on a cold disk. Reading them
+// happens on a thread of its own while we get on with serving, files are
+// served from the directory as usual until they're in.
+//
+// The copy in memory is only served while the file on disk is still the
+// one we read, anything changed goes back to coming from the disk.
+
+typedef struct preloaded_s
+{
+	char *path;
+	char pin, hugepages;
+	// Whether mlock took.
+	char pinned;
+	// Set by the thread under lock once the file is in.
+	uint8_t *map;
+	uint64_t size, dev, ino;
+	struct timespec mtime;
+	// Open files using map, and whether it's out of date.
+	int refs, stale;
+} preloaded_t;
+
+static vec_t(preloaded_t*) files;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t thread;
+static int started;
+static atomic_int stopping;
+static uint64_t loaded, loadedbytes, pinnedbytes, served, changed;
+
+static int Ready(preloaded_t *p)
+{
+	pthread_mutex_lock(&lock);
+	int ready = p->map != NULL;
+	pthread_mutex_unlock(&lock);
+	return ready;
+}
+
+static void Unload(preloaded_t *p)
+{
+	if (!p->map)
+		return;
+
+	munmap(p->map, p->size);
+
+	pthread_mutex_lock(&lock);
+	p->map = NULL;
+	loaded--;
+	loadedbytes -= p->size;
+	pinnedbytes -= p->pinned ? p->size : 0;
+	p->pinned = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+// Read the file into memory of its own. Returns its size, or -1 if it couldn't.
+static int64_t Load(preloaded_t *p)
+{
+	static int warned = 0;
+	struct stat sb;
+
+	int fd = OpenBeneathRoot(p->path, O_RDONLY, 0);
+	if (fd == -1 || fstat(fd, &sb) == -1)
+	{
+		fprintf(stderr, "Failed to preload %s: %s\n", p->path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	// Nothing to read for empty files and anything that isn't a file.
+	if (!S_ISREG(sb.st_mode) || !sb.st_size)
+	{
+		close(fd);
+		return -1;
+	}
+
+	uint8_t *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to preload %s: %s\n", p->path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+#ifdef MADV_HUGEPAGE
+	// Transparent huge pages, reserving hugetlbfs pages is up to the admin.
+	if (p->hugepages)
+		madvise(map, sb.st_size, MADV_HUGEPAGE);
+#endif
+
+	uint64_t off = 0;
+	while (off < (uint64_t)sb.st_size && !stopping)
+	{
+		ssize_t n = pread(fd, map + off, MIN(sb.st_size - off, PRELOAD_CHUNK), off);
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		// Shorter than it was a moment ago, it's being changed.
+		if (n <= 0)
+		{
+			fprintf(stderr, "Failed to preload %s: %s\n", p->path, n ? strerror(errno) : "file got shorter");
+			break;
+		}
+
+		off += n;
+	}
+
+	// We have our own copy, the page cache can have its memory back.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	if (off < (uint64_t)sb.st_size)
+	{
+		munmap(map, sb.st_size);
+		return -1;
+	}
+
+	int pinned = p->pin && mlock(map, sb.st_size) == 0;
+	if (p->pin && !pinned && !warned)
+	{
+		warned = 1;
+		fprintf(stderr, "Warning: failed to pin preloaded files in memory: %s (is RLIMIT_MEMLOCK big enough?)\n", strerror(errno));
+	}
+
+	mprotect(map, sb.st_size, PROT_READ);
+
+	pthread_mutex_lock(&lock);
+	p->size  = sb.st_size;
+	p->dev   = sb.st_dev;
+	p->ino   = sb.st_ino;
+	p->mtime = sb.st_mtim;
+	p->map   = map;
+	p->pinned = pinned;
+	loaded++;
+	loadedbytes += sb.st_size;
+	pinnedbytes += pinned ? sb.st_size : 0;
+	pthread_mutex_unlock(&lock);
+
+	return sb.st_size;
+}
+
+static void *PreloadThread(void *arg)
+{
+	// Signals are for the event loop.
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	uint64_t start = MonotonicTime(), total = 0, done = 0;
+	preloaded_t *p;
+	struct stat sb;
+	int i, step = 0;
+
+	// How much there is to read, to say how far along we are.
+	vec_foreach(&files, p, i)
+	{
+		int fd = OpenBeneathRoot(p->path, O_RDONLY, 0);
+		if (fd != -1 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode))
+			total += sb.st_size;
+		if (fd != -1)
+			close(fd);
+	}
+
+	printf("Preloading %d files (%lu MB)\n", files.length, (unsigned long)(total >> 20));
+
+	vec_foreach(&files, p, i)
+	{
+		if (stopping)
+			break;
+
+		int64_t size = Load(p);
+		if (size > 0)
+			done += size;
+
+		// Every tenth of the way.
+		int now = total ? MIN(done * 10 / total, 9) : 0;
+		if (now > step)
+		{
+			step = now;
+			printf("Preloading: %d0%%, %d of %d files (%lu of %lu MB)\n", step, i + 1, files.length,
+			       (unsigned long)(done >> 20), (unsigned long)(total >> 20));
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	printf("Preloaded %lu files (%lu MB) in %.1f seconds%s\n", (unsigned long)loaded, (unsigned long)(loadedbytes >> 20),
+	       (double)(MonotonicTime() - start) / SECONDS, stopping ? ", stopped early" : "");
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static preloaded_t *Find(const char *path)
+{
+	preloaded_t *p;
+	int i;
+
+	vec_foreach(&files, p, i)
+	{
+		if (!strcmp(p->path, path))
+			return p;
+	}
+
+	return NULL;
+}
+
+static int PreloadOpen(vfile_t *vf, const char *path, const socketstructs_t *peer)
+{
+	preloaded_t *p = Find(path);
+	struct stat sb;
+
+	if (!p || p->stale || !Ready(p))
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	// Still the file we read? Otherwise the disk has the real one.
+	int fd = OpenBeneathRoot(path, O_RDONLY, 0);
+	int same = fd != -1 && fstat(fd, &sb) == 0 && (uint64_t)sb.st_size == p->size && sb.st_dev == p->dev && sb.st_ino == p->ino
+	           && sb.st_mtim.tv_sec == p->mtime.tv_sec && sb.st_mtim.tv_nsec == p->mtime.tv_nsec;
+	if (fd != -1)
+		close(fd);
+
+	if (!same)
+	{
+		fprintf(stderr, "Preloaded %s changed on disk, serving it from there\n", path);
+		changed++;
+		p->stale = 1;
+		if (!p->refs)
+			Unload(p);
+		errno = ENOENT;
+		return -1;
+	}
+
+	p->refs++;
+	served++;
+
+	vf->data = p;
+	vf->size = p->size;
+	vf->map  = p->map;
+	vf->dev  = p->dev;
+	vf->ino  = p->ino;
+	vf->version = (uint64_t)p->mtime.tv_sec * SECONDS + p->mtime.tv_nsec;
+	return 0;
+}
+
+static void PreloadRead(vfile_t *vf, iorequest_t *req)
+{
+	// Never called, VFSRead copies out of the map.
+	req->result = -1;
+	req->error = EIO;
+	req->complete(req);
+}
+
+static void PreloadClose(vfile_t *vf)
+{
+	preloaded_t *p = vf->data;
+	if (!p)
+		return;
+
+	if (!--p->refs && p->stale)
+		Unload(p);
+}
+
+static const backend_t preloadbackend = {
+	"preload", VFS_SHARED | VFS_MAPPED,
+	PreloadOpen, NULL, PreloadRead, NULL, NULL, PreloadClose
+};
+
+static void Add(const char *path, conf_preload_t *block)
+{
+	preloaded_t *p = Find(path);
+
+	// Matched by more than one, it gets the most any of them asked for.
+	if (!p)
+	{
+		p = nmalloc(sizeof(preloaded_t));
+		p->path = strdup(path);
+		vec_push(&files, p);
+	}
+
+	p->pin |= block->pin;
+	p->hugepages |= block->hugepages;
+}
+
+void InitializePreload(void)
+{
+	conf_preload_t *block;
+	char *match;
+	int i, j;
+
+	vec_init(&files);
+
+	vec_foreach(&config->preloadblocks, block, i)
+	{
+		vec_foreach(&block->match, match, j)
+		{
+			char *pattern = stringify("%s/%s", config->directory, match);
+			size_t prefix = strlen(config->directory) + 1;
+			glob_t g;
+
+			int ret = glob(pattern, 0, NULL, &g);
+			if (ret == GLOB_NOMATCH)
+				fprintf(stderr, "Warning: preload match %s matches nothing.\n", match);
+			else if (ret)
+				fprintf(stderr, "Error: failed to find files to preload for %s.\n", match);
+			else
+			{
+				for (size_t k = 0; k < g.gl_pathc; k++)
+					Add(g.gl_pathv[k] + prefix, block);
+			}
+
+			globfree(&g);
+			free(pattern);
+		}
+	}
+
+	if (files.length)
+		RegisterBackend(&preloadbackend);
+}
+
+int StartPreload(void)
+{
+	if (!files.length)
+		return 0;
+
+	int err = pthread_create(&thread, NULL, PreloadThread, NULL);
+	if (err)
+	{
+		errno = err;
+		return -1;
+	}
+
+	started = 1;
+	return 0;
+}
+
+void StopPreload(void)
+{
+	if (!started)
+		return;
+
+	stopping = 1;
+	pthread_join(thread, NULL);
+	started = 0;
+}
+
+// After StopPreload and once nobody has a file open.
+void ShutdownPreload(void)
+{
+	preloaded_t *p;
+	int i;
+
+	if (files.length)
+		UnregisterBackend(&preloadbackend);
+
+	vec_foreach(&files, p, i)
+	{
+		Unload(p);
+		free(p->path);
+		free(p);
+	}
+	vec_deinit(&files);
+}
+
+void PrintPreloadStatistics(void)
+{
+	if (!files.length)
+		return;
+
+	pthread_mutex_lock(&lock);
+	printf("Preload: %lu of %d files in memory (%s, ", (unsigned long)loaded, files.length, SizeReduce(loadedbytes));
+	printf("%s pinned), %lu opens served, %lu changed on disk\n", SizeReduce(pinnedbytes), (unsigned long)served, (unsigned long)changed);
+	pthread_mutex_unlock(&lock);
+}
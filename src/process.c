@@ -18,11 +18,20 @@
 #include "socket.h"
 #include "filesystem.h"
 #include "module.h"
+#include "iopool.h"
+#include "stream.h"
+#include "multicast.h"
+#include "prefetch.h"
+#include "multiplexer.h"
+#include "netascii.h"
 #include <assert.h>
 #include <errno.h>
 #include "sysconf.h"
 #include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 // NOTE:
 // This file is a bit of a mess but it works for now.
@@ -57,11 +66,1019 @@
 		} while(0)
 #endif
 
+// Translate an errno from opening a file into the closest TFTP error code.
+static uint16_t FileErrorCode(int err)
+{
+	switch (err)
+	{
+		case ENOENT:
+		case ENOTDIR:
+		case EISDIR:
+			return ERROR_NOFILE;
+		case EACCES:
+		case EPERM:
+		case EXDEV:  // Tried to escape the serve root.
+		case ELOOP:
+			return ERROR_ACCESS;
+		case ENOSPC:
+		case EDQUOT:
+			return ERROR_DISKFULL;
+		case EEXIST:
+			return ERROR_FILEEXISTS;
+		default:
+			return ERROR_UNDEFINED;
+	}
+}
+
+// strerror() but with a less confusing message for path escapes.
+static const char *FileErrorString(int err)
+{
+	if (err == EXDEV)
+		return "Path is outside of the served directory";
+
+	return strerror(err);
+}
+
+static void FillWindow(client_t *c);
+static void WindowTimeout(timerevent_t *t);
+static void PaceTimeout(timerevent_t *t);
+
+// The client's next block is ready, either in its own buffer
+// or in the shared stream it's attached to.
+void NextBlockReady(client_t *c)
+{
+	c->nextready = 1;
+
+	// The window has room, we were only waiting on the disk.
+	if (c->ackwaiting)
+	{
+		c->ackwaiting = 0;
+		FillWindow(c);
+	}
+}
+
+// The I/O pool finished reading the next block for us.
+static void PrefetchComplete(iorequest_t *req)
+{
+	client_t *c = req->data;
+
+	c->nextpending = 0;
+	if (FinishClientIO(c))
+		return;
+
+	if (req->result == -1)
+	{
+		Error(c, ERROR_UNDEFINED, "Cannot read file: %s", strerror(req->error));
+		return;
+	}
+
+	// What we read is the file, the block is what that encodes to.
+	if (c->netascii)
+	{
+		c->nextcarry = c->nextcarryin;
+		c->nextlen = NetasciiEncode(c->asciibuf, req->result, c->nextblk, c->blksize, &c->nextcarry, &c->nextconsumed);
+	}
+	else
+		c->nextlen = req->result;
+
+	NextBlockReady(c);
+}
+
+// Read the next block of the file into the client's spare buffer. This is
+// called once the current block has actually gone out on the wire so the
+// disk read overlaps with the client's round trip instead of adding to it.
+void PrefetchBlock(client_t *c)
+{
+	assert(c);
+
+	c->prefetch = 0;
+
+	if (!c->file || c->nextready || c->nextpending || c->destroy)
+		return;
+
+	// Keep the kernel's readahead ahead of us on big files so a
+	// cold-cache transfer does not stall on every single block.
+	if (c->file->fd != -1 && c->filesize > PREFETCH_WINDOW && c->offset + (PREFETCH_WINDOW / 2) >= c->readahead
+	    && c->readahead < c->filesize)
+	{
+		posix_fadvise(c->file->fd, c->readahead, PREFETCH_WINDOW, POSIX_FADV_WILLNEED);
+		c->readahead += PREFETCH_WINDOW;
+	}
+
+	c->nextoffset = c->offset;
+	c->nextcarryin = c->carry;
+
+	// Other clients may have read this block already. If the stream
+	// can't hold it right now we just read it ourselves.
+	if (c->stream && StreamFetch(c) == 0)
+		return;
+
+	if (!c->nextblk)
+		c->nextblk = nmalloc(c->blksize);
+
+	// A block never takes more of the file than its own size.
+	if (c->netascii && !c->asciibuf)
+		c->asciibuf = nmalloc(c->blksize);
+
+	iorequest_t *req = &c->readreq;
+	req->buf      = c->netascii ? c->asciibuf : c->nextblk;
+	req->len      = c->blksize;
+	req->offset   = c->offset;
+	req->complete = PrefetchComplete;
+	req->data     = c;
+
+	c->nextpending = 1;
+	c->iopending++;
+	VFSRead(c->file, req);
+}
+
+// Windowed sending (RFC 7440). The client agrees to a windowsize and ACKs
+// once per window, or early with the last block it got in order if some
+// went missing, in which case we go back and send everything after that
+// block again. On top of that we keep a congestion window: how many blocks
+// we put on the wire per round trip. It grows while windows make it across
+// cleanly and halves when they don't (AIMD, like TCP). When it's smaller
+// than the client's window, the window is sent a piece per round trip.
+
+// How long to wait for an ACK before sending the window again.
+static uint64_t RetransmitTimeout(client_t *c)
+{
+	if (!c->srtt)
+		return SECONDS;
+
+	uint64_t rto = c->srtt * 4;
+	if (rto < 100 * MILLISECONDS)
+		rto = 100 * MILLISECONDS;
+	if (rto > 3 * SECONDS)
+		rto = 3 * SECONDS;
+
+	return rto;
+}
+
+// Block numbers on the wire are only 16 bits. Files of more than 65535
+// blocks roll over, after block 65535 comes either block 0 or block 1
+// depending on what the clients expect (blockrollover in the config).
+// With rollover to 1 block 0 is never used again, so past the first
+// wrap the numbers go around every 65535 blocks instead of 65536.
+uint16_t BlockNumber(uint64_t block)
+{
+	if (block <= 0xFFFF || config->blockrollover == 0)
+		return block & 0xFFFF;
+
+	return 1 + (block - 0x10000) % 0xFFFF;
+}
+
+// Work out which full block number a 16 bit one is, going back from
+// newest (the highest block sent). Returns UINT64_MAX if it can't be one
+// we sent.
+uint64_t FullBlockNumber(uint16_t blockno, uint64_t newest)
+{
+	uint64_t behind;
+
+	if (newest <= 0xFFFF || config->blockrollover == 0)
+		behind = (uint16_t)(BlockNumber(newest) - blockno);
+	else if (blockno == 0)
+		// Only the first time around has a block 0.
+		behind = newest;
+	else
+		behind = (BlockNumber(newest) + 0xFFFF - blockno) % 0xFFFF;
+
+	if (behind > newest)
+		return UINT64_MAX;
+
+	return newest - behind;
+}
+
+// Work out which block a 16 bit ACK is for, it has to be one we sent.
+// If we went back it can be ahead of actualblockno (the client got the
+// blocks the first time around). Returns UINT64_MAX if it can't be.
+static uint64_t AckedBlock(client_t *c, uint16_t blockno)
+{
+	return FullBlockNumber(blockno, c->highestblock);
+}
+
+// Something got lost, back off.
+static void WindowLoss(client_t *c)
+{
+	c->losses++;
+	c->ssthresh = c->cwnd > 1 ? c->cwnd / 2 : 1;
+	c->cwnd = c->ssthresh;
+	c->cwndcount = 0;
+	// Until the client has everything we've sent so far, more
+	// missing blocks are part of this loss.
+	c->recover = c->highestblock;
+}
+
+// Blocks made it across, open up. Until the first loss every block
+// delivered opens the window by one (at most doubling it per ACK) so
+// large windows get going quickly, after that it takes a congestion
+// window's worth of blocks to open it by one.
+static void WindowGrow(client_t *c, uint64_t delivered)
+{
+	if (c->cwnd < c->ssthresh)
+		c->cwnd += MIN(delivered, c->cwnd);
+	else
+	{
+		c->cwndcount += delivered;
+		while (c->cwndcount >= c->cwnd)
+		{
+			c->cwndcount -= c->cwnd;
+			c->cwnd++;
+		}
+	}
+
+	c->cwnd = MIN(c->cwnd, c->windowsize);
+}
+
+// Put the transfer back to just after blockno, the blocks after it get
+// sent again. The client can also tell us it's further along than we
+// thought, in which case this moves the transfer forward.
+static void GoBack(client_t *c, uint64_t blockno)
+{
+	c->currentblockno = BlockNumber(blockno);
+	c->actualblockno  = blockno;
+
+	if (c->netascii)
+	{
+		asciipos_t *pos = &c->asciistarts[blockno % (c->windowsize + 1)];
+		c->offset   = pos->offset;
+		c->carry    = pos->carry;
+		c->lastsent = pos->last;
+		return;
+	}
+
+	c->offset         = blockno * c->blksize;
+	// The last block is the first one short of blksize.
+	c->lastsent       = blockno > c->filesize / c->blksize;
+}
+
+// Pacing. Instead of putting the whole congestion window on the wire at
+// once (cheap switches with shallow buffers drop the end of the burst) the
+// blocks are spread over the round trip, cwnd blocks every srtt. Up to
+// PACING_BURST blocks may still go back to back after we've been idle so
+// we are not woken up for every single block.
+static inline int Paced(client_t *c)
+{
+	return config->pacing != PACING_OFF && c->srtt && c->windowsize > 1;
+}
+
+// Work out when the next block leaves. Returns 0 if it can be sent now
+// (with txtime pacing the kernel waits for us), otherwise how long to
+// wait before sending it.
+static uint64_t Pace(client_t *c)
+{
+	uint64_t now = MonotonicTime();
+	uint64_t interval = c->srtt / c->cwnd;
+
+	// Time we didn't use only saves up a small burst.
+	uint64_t earliest = now - MIN(now, interval * (PACING_BURST - 1));
+	if (c->nexttx < earliest)
+		c->nexttx = earliest;
+
+	if (config->pacing == PACING_TXTIME)
+		c->txtime = c->nexttx > now ? c->nexttx : 0;
+	else if (c->nexttx > now)
+		return c->nexttx - now;
+
+	c->lasttx  = MAX(c->nexttx, now);
+	c->nexttx += interval;
+
+	return 0;
+}
+
+// Send the block we have ready.
+static void SendBlock(client_t *c)
+{
+	ssize_t readlen   = c->nextlen;
+	c->nextready      = 0;
+
+	bprintf("Read %zd bytes from file\n", readlen);
+
+	c->offset += c->netascii ? c->nextconsumed : readlen;
+	c->actualblockno++;
+	c->currentblockno = BlockNumber(c->actualblockno);
+
+	if (c->netascii)
+	{
+		asciipos_t *pos = &c->asciistarts[c->actualblockno % (c->windowsize + 1)];
+		c->carry    = c->nextcarry;
+		pos->offset = c->offset;
+		pos->carry  = c->carry;
+		pos->last   = readlen < c->blksize;
+	}
+
+	c->blockssent++;
+	c->resent = c->actualblockno <= c->highestblock;
+	if (c->resent)
+		c->blocksresent++;
+	else
+	{
+		c->highestblock = c->actualblockno;
+
+		if (c->actualblockno > 0xFFFF && c->currentblockno == config->blockrollover)
+			bprintf("Block numbers rolled over to %d at block %lu\n", config->blockrollover, (unsigned long)c->actualblockno);
+	}
+
+	// With txtime pacing it leaves when the kernel says so.
+	c->senttime = MAX(MonotonicTime(), c->lasttx);
+	if (c->sendtimes)
+		c->sendtimes[c->actualblockno % c->windowsize] = c->resent ? 0 : c->senttime;
+
+	if (c->nextslot)
+	{
+		// SendData copies the block so the stream can have it back right away.
+		SendData(c, c->nextslot->data, readlen);
+		StreamRelease(c);
+	}
+	else
+	{
+		if (!c->blk)
+			c->blk = nmalloc(c->blksize);
+
+		// Swap the buffers, the old block becomes the next prefetch target.
+		void *blk  = c->blk;
+		c->blk     = c->nextblk;
+		c->nextblk = blk;
+
+		// Sending a file
+		SendData(c, c->blk, readlen);
+	}
+
+	if (c->burstleft)
+		c->burstleft--;
+
+	// We're at the end of the file.
+	if (MIN(c->blksize, readlen) != c->blksize)
+		c->lastsent = 1;
+}
+
+// Send as much of the window as we're allowed to. Blocks still coming
+// off the disk are sent by NextBlockReady once they're read.
+static void FillWindow(client_t *c)
+{
+	c->windowtimer.callback = WindowTimeout;
+	c->windowtimer.data = c;
+	c->pacetimer.callback = PaceTimeout;
+	c->pacetimer.data = c;
+
+	while (!c->lastsent && !c->destroy && c->actualblockno < c->acked + c->windowsize)
+	{
+		// That's all the congestion window allows for now, the rest of
+		// the window goes a round trip later. Pacing already keeps us
+		// to cwnd blocks a round trip.
+		if (!c->burstleft && !Paced(c))
+		{
+			ArmTimer(&c->windowtimer, c->srtt ? c->srtt : MILLISECONDS);
+			return;
+		}
+
+		// The transfer moved since we read ahead, that block is no good.
+		if (c->nextready && (c->nextoffset != c->offset || c->nextcarryin != c->carry))
+		{
+			c->nextready = 0;
+			StreamRelease(c);
+		}
+
+		if (!c->nextready)
+		{
+			PrefetchBlock(c);
+			if (!c->nextready)
+			{
+				c->ackwaiting = 1;
+				return;
+			}
+		}
+
+		if (Paced(c))
+		{
+			uint64_t wait = Pace(c);
+			if (wait)
+			{
+				ArmTimer(&c->pacetimer, wait);
+				return;
+			}
+		}
+
+		SendBlock(c);
+		c->txtime = 0;
+	}
+
+	if (c->destroy)
+		return;
+
+	// The window is on its way (or will be once the kernel sends the
+	// last of it), now wait for the ACK.
+	uint64_t now = MonotonicTime();
+	ArmTimer(&c->windowtimer, (c->senttime > now ? c->senttime - now : 0) + RetransmitTimeout(c));
+
+	// Read the next block while the client gets through this window.
+	if (!c->lastsent)
+		c->prefetch = 1;
+}
+
+static void WindowTimeout(timerevent_t *t)
+{
+	client_t *c = t->data;
+
+	// We were spacing the window out, send the next piece of it.
+	if (!c->burstleft && !c->lastsent && c->actualblockno < c->acked + c->windowsize)
+	{
+		c->burstleft = c->cwnd;
+		FillWindow(c);
+		return;
+	}
+
+	if (++c->retries > WINDOW_RETRIES)
+	{
+		printf("Client %s stopped acknowledging blocks, giving up on transfer\n", GetAddress(c->s.addr));
+		c->destroy = 1;
+		// Nothing may be queued, make sure the socket comes around to clean it up.
+		SetSocketStatus(&c->s, SF_READABLE | SF_WRITABLE);
+		return;
+	}
+
+	bprintf("Timed out waiting on ACK for block %lu, resending from block %lu (retry %d/%d)\n",
+	        (unsigned long)c->actualblockno, (unsigned long)c->acked + 1, c->retries, WINDOW_RETRIES);
+
+	WindowLoss(c);
+	c->staleacks = c->actualblockno - c->acked;
+	GoBack(c, c->acked);
+	c->burstleft = c->cwnd;
+	FillWindow(c);
+}
+
+// The next block of the window may go now.
+static void PaceTimeout(timerevent_t *t)
+{
+	FillWindow(t->data);
+}
+
+// Start sending a file with the given window size.
+static void StartWindow(client_t *c, uint16_t windowsize)
+{
+	c->windowsize = windowsize;
+	c->cwnd       = MIN(windowsize, INITIAL_WINDOW);
+	c->ssthresh   = windowsize;
+	c->burstleft  = c->cwnd;
+	c->acked      = 0;
+
+	// When each block of the window went out, for measuring round trips.
+	// Slot 0 starts out as the OACK if there is one.
+	free(c->sendtimes);
+	c->sendtimes = nmalloc(sizeof(uint64_t) * windowsize);
+	c->sendtimes[0] = c->senttime = MonotonicTime();
+
+	// Block 1 starts at the start of the file.
+	if (c->netascii)
+	{
+		free(c->asciistarts);
+		c->asciistarts = nmalloc(sizeof(asciipos_t) * (windowsize + 1));
+		c->asciistarts[0].carry = c->carry = NETASCII_NOCARRY;
+	}
+}
+
+static void WindowAcknowledge(client_t *c, uint16_t blockno)
+{
+	uint64_t block = AckedBlock(c, blockno);
+	uint64_t now = MonotonicTime();
+
+	// Either older than one we already have or for a block we never sent.
+	if (block < c->acked || block == UINT64_MAX)
+	{
+		bprintf("Ignoring ACK for block %d\n", blockno);
+		return;
+	}
+
+	// We went back (a timeout, probably the ACK was on its way) but the
+	// client already had these blocks, carry on from where it is.
+	if (block > c->actualblockno)
+		GoBack(c, block);
+
+	// A client which missed a block ACKs the one before it again for every
+	// block after it that was already on its way, that's the same loss
+	// again. Once we've had that many, the block we resent got lost too.
+	if (block == c->acked && block < c->actualblockno && c->staleacks)
+	{
+		c->staleacks--;
+		bprintf("Ignoring repeated ACK for block %d\n", blockno);
+		return;
+	}
+
+	// In lock-step a repeated ACK is the network (or the client timing
+	// out) duplicating the last one. Sending the next block again for it
+	// would double every block from here on (the Sorcerer's Apprentice
+	// bug), if the block really got lost the retransmit timer resends it.
+	if (block == c->acked && block < c->actualblockno && c->windowsize == 1)
+	{
+		bprintf("Ignoring duplicate ACK for block %d\n", blockno);
+		return;
+	}
+
+	CancelTimer(&c->windowtimer);
+	c->retries = 0;
+
+	// Take a round trip from whichever block made the client send this
+	// ACK: that block itself for the end of a window, the end of the file
+	// or the OACK (block 0). An early ACK because the next block went
+	// missing was most likely set off by the one after it getting there.
+	// ACKs for resent blocks are ambiguous (Karn's algorithm, those slots
+	// are 0).
+	uint64_t sample = UINT64_MAX;
+	if (block == c->acked + c->windowsize || (block == c->actualblockno && c->lastsent)
+	    || (block == 0 && c->actualblockno == 0))
+		sample = block;
+	else if (block + 2 <= c->actualblockno)
+		sample = block + 2;
+
+	if (c->sendtimes && sample != UINT64_MAX)
+	{
+		uint64_t sent = c->sendtimes[sample % c->windowsize];
+
+		// With txtime pacing the ACK can beat the time we said the block
+		// would leave if the kernel sent it early. Anything slower than
+		// our retransmit timeout is the client timing out, not a trip.
+		if (sent && now > sent && now - sent < RetransmitTimeout(c))
+		{
+			uint64_t rtt = now - sent;
+			c->srtt = c->srtt ? (c->srtt * 7 + rtt) / 8 : rtt;
+		}
+	}
+
+	if (block == c->actualblockno)
+	{
+
+		if (c->lastsent)
+		{
+			printf("Finished sending file, %s transferred in %lu %d-sized blocks (window %u of %u, %lu losses, %.1f%% resent)\n",
+			       SizeReduce(c->bytestransferred), (unsigned long)c->actualblockno, c->blksize, c->cwnd, c->windowsize,
+			       (unsigned long)c->losses, c->blockssent ? (c->blocksresent * 100.0) / c->blockssent : 0.0);
+			c->sendingfile = 0;
+			c->destroy = 1;
+			// Nothing is queued for the client, make sure it gets cleaned up.
+			SetSocketStatus(&c->s, SF_READABLE | SF_WRITABLE);
+			return;
+		}
+
+		// Everything we sent made it. That may be short of a full window
+		// if the client got tired of waiting for the rest, that's us being
+		// slow rather than a loss.
+		WindowGrow(c, block - c->acked);
+	}
+	else
+	{
+		// The client ACKed short of what we sent, everything after that
+		// block got lost on the way. Only back off once per loss, while
+		// we're still resending the last one this is part of it (unless
+		// what we resent got lost as well).
+		bprintf("Client is missing blocks after %d, resending\n", blockno);
+		if (block >= c->recover || block == c->acked)
+			WindowLoss(c);
+		c->staleacks = c->actualblockno - block - 1;
+		GoBack(c, block);
+	}
+
+	c->acked = block;
+	c->burstleft = c->cwnd;
+	FillWindow(c);
+}
+
+static void ReceiveTimeout(timerevent_t *t);
+static void WriteComplete(iorequest_t *req);
+static void RepeatedRequest(client_t *c);
+
+// Start receiving a file with the given window size.
+static void StartReceive(client_t *c, uint16_t windowsize)
+{
+	c->windowsize = windowsize;
+	c->acked      = 0;
+	c->received   = 0;
+	c->finalblock = 0;
+	c->gapacked   = UINT64_MAX;
+
+	c->recvbuf  = nmalloc((size_t)windowsize * c->blksize);
+	c->recvlens = nmalloc(sizeof(ssize_t) * windowsize);
+	// netascii can need a CR written before a block and one after the last.
+	c->writeiov = nmalloc(sizeof(struct iovec) * MIN(2 * windowsize + 1, IOV_MAX));
+	for (int i = 0; i < windowsize; i++)
+		c->recvlens[i] = -1;
+
+	c->windowtimer.callback = ReceiveTimeout;
+	c->windowtimer.data = c;
+	ArmTimer(&c->windowtimer, RECEIVE_TIMEOUT);
+}
+
+// Tell the client we have everything up to and including block.
+static void ReceiveAcknowledge(client_t *c, uint64_t block)
+{
+	c->acked = block;
+	Acknowledge(c, BlockNumber(block));
+}
+
+// A CR which turned out not to be part of a pair in a netascii upload.
+static uint8_t lonecr = '\r';
+
+static void AddWrite(client_t *c, int *iovcnt, void *buf, size_t len)
+{
+	// Nothing to write, and a short write loop can't tell it from the end.
+	if (!len)
+		return;
+
+	c->writeiov[*iovcnt].iov_base = buf;
+	c->writeiov[*iovcnt].iov_len  = len;
+	(*iovcnt)++;
+}
+
+// Write whatever we have in order. Blocks are written in order, those that
+// arrive while a write is in flight pile up in their slots and go out
+// together in the next one.
+static void WriteNext(client_t *c)
+{
+	if (c->writepending || c->destroy)
+		return;
+
+	int maxiov = MIN(2 * c->windowsize + 1, IOV_MAX), iovcnt = 0;
+	size_t total = 0;
+
+	c->writeblocks = 0;
+	c->lastblock = 0;
+
+	while (iovcnt + 3 <= maxiov && total < WRITE_BATCH)
+	{
+		uint64_t block = c->actualblockno + c->writeblocks;
+		ssize_t len = c->recvlens[block % c->windowsize];
+		uint8_t *data = c->recvbuf + (block % c->windowsize) * c->blksize;
+
+		if (len == -1)
+			break;
+
+		c->writeblocks++;
+
+		if (c->netascii)
+		{
+			uint8_t prefixcr;
+			len = NetasciiDecode(data, len, &c->asciicr, &prefixcr);
+			if (prefixcr)
+			{
+				AddWrite(c, &iovcnt, &lonecr, 1);
+				total++;
+			}
+		}
+
+		AddWrite(c, &iovcnt, data, len);
+		total += len;
+
+		if (block == c->finalblock)
+		{
+			// The file ended on a CR.
+			if (c->netascii && c->asciicr)
+			{
+				AddWrite(c, &iovcnt, &lonecr, 1);
+				total++;
+			}
+
+			c->lastblock = 1;
+			break;
+		}
+	}
+
+	if (!c->writeblocks)
+		return;
+
+	iorequest_t *req = &c->writereq;
+	req->buf      = NULL;
+	req->iov      = c->writeiov;
+	req->iovcnt   = iovcnt;
+	req->len      = total;
+	req->offset   = c->offset;
+	req->complete = WriteComplete;
+	req->data     = c;
+
+	c->writepending = 1;
+	c->iopending++;
+	VFSWrite(c->file, req);
+}
+
+// We only ever ACK blocks that are written, that way whatever the client
+// sends after the ACK always has a free slot to go in.
+static void CheckReceived(client_t *c)
+{
+	uint64_t written = c->actualblockno - 1;
+
+	// The whole window is written or the client skipped a block and
+	// everything before it is written.
+	if (written >= c->acked + c->windowsize || (c->gapack && written >= c->received))
+	{
+		c->gapack = 0;
+		ReceiveAcknowledge(c, written);
+	}
+}
+
+// A DATA block came in.
+static void ReceiveBlock(client_t *c, uint16_t blockno, const void *data, size_t len)
+{
+	// It can't be further along than the window we ACKed last.
+	uint64_t block = FullBlockNumber(blockno, c->acked + c->windowsize);
+
+	// Already written. The client didn't get our ACK (or went back after a
+	// gap), tell it again where we are once it's at the newest block.
+	if (block < c->actualblockno)
+	{
+		bprintf("Got block %d again, already written\n", blockno);
+		// Not until the file is in place if it's the last one.
+		if (block == c->actualblockno - 1 && !(c->lastblock && c->writepending))
+			ReceiveAcknowledge(c, block);
+		return;
+	}
+
+	// Its slot still has a block that isn't written yet, or it's past the end of the file.
+	if (block >= c->actualblockno + c->windowsize || block == UINT64_MAX
+	    || (c->finalblock && block > c->finalblock))
+	{
+		bprintf("Ignoring block %d, outside of the window\n", blockno);
+		return;
+	}
+
+	ssize_t *slot = &c->recvlens[block % c->windowsize];
+	if (*slot != -1)
+	{
+		bprintf("Got block %d again, waiting to be written\n", blockno);
+		return;
+	}
+
+	*slot = len;
+	memcpy(c->recvbuf + (block % c->windowsize) * c->blksize, data, len);
+
+	// Something is still coming.
+	CancelTimer(&c->windowtimer);
+	ArmTimer(&c->windowtimer, RECEIVE_TIMEOUT);
+	c->retries = 0;
+
+	// The short block is the end of the file.
+	if (len < c->blksize)
+		c->finalblock = block;
+
+	// Something got lost or reordered on the way, once we've written what
+	// we have up to it tell the client to go back there (once per gap).
+	if (block > c->received + 1 && c->gapacked != c->received)
+	{
+		bprintf("Client skipped to block %d, missing block %lu\n", blockno, (unsigned long)c->received + 1);
+		c->gapack = 1;
+		c->gapacked = c->received;
+	}
+
+	while (c->received < block && c->recvlens[(c->received + 1) % c->windowsize] != -1)
+		c->received++;
+
+	WriteNext(c);
+	CheckReceived(c);
+}
+
+// The client went quiet, ACK what we have again in case it's waiting on
+// an ACK that got lost.
+static void ReceiveTimeout(timerevent_t *t)
+{
+	client_t *c = t->data;
+
+	if (c->destroy)
+		return;
+
+	if (++c->retries > WINDOW_RETRIES)
+	{
+		printf("Client %s stopped sending blocks, giving up on transfer\n", GetAddress(c->s.addr));
+		c->destroy = 1;
+		SetSocketStatus(&c->s, SF_READABLE | SF_WRITABLE);
+		return;
+	}
+
+	bprintf("Timed out waiting on block %lu, ACKing again (retry %d/%d)\n",
+	        (unsigned long)c->actualblockno, c->retries, WINDOW_RETRIES);
+
+	// Nothing came in yet, the OACK (or ACK 0) may be what got lost.
+	if (!c->received && c->gapacked == UINT64_MAX)
+		RepeatedRequest(c);
+	else
+		ReceiveAcknowledge(c, c->actualblockno - 1);
+
+	ArmTimer(&c->windowtimer, RECEIVE_TIMEOUT);
+}
+
+// It's all on disk and where it belongs, now we can tell the client.
+static void UploadDone(iorequest_t *req)
+{
+	client_t *c = req->data;
+
+	c->writepending = 0;
+	if (FinishClientIO(c))
+		return;
+
+	if (req->result == -1)
+	{
+		Error(c, FileErrorCode(req->error), "Cannot write file: %s", strerror(req->error));
+		return;
+	}
+
+	ReceiveAcknowledge(c, c->finalblock);
+	printf("Got end of data packet, %s transferred in %lu blocks\n",
+	       SizeReduce(c->bytestransferred), (unsigned long)c->finalblock);
+	// Notify on the sending of a packet that this needs to be removed.
+	c->destroy = 1;
+}
+
+// Every block is written, get the file on disk and in place before we ACK
+// the last one so an upload the client thinks is done really is.
+static void FinishUpload(client_t *c)
+{
+	CancelTimer(&c->windowtimer);
+
+	iorequest_t *req = &c->writereq;
+	req->iov      = NULL;
+	req->offset   = c->offset;
+	req->complete = UploadDone;
+	req->data     = c;
+
+	c->writepending = 1;
+	c->iopending++;
+	VFSCommit(c->file, req);
+}
+
+// The I/O pool finished writing blocks the client sent us.
+static void WriteComplete(iorequest_t *req)
+{
+	client_t *c = req->data;
+
+	c->writepending = 0;
+	if (FinishClientIO(c))
+		return;
+
+	if (req->result == -1)
+	{
+		Error(c, FileErrorCode(req->error), "Cannot write file: %s", strerror(req->error));
+		return;
+	}
+
+	for (int i = 0; i < c->writeblocks; i++)
+		c->recvlens[(c->actualblockno + i) % c->windowsize] = -1;
+
+	c->offset += req->result;
+	c->actualblockno += c->writeblocks;
+	c->currentblockno = BlockNumber(c->actualblockno);
+
+	bprintf("Wrote %d blocks up to block %lu, %zd bytes (%s transferred)\n", c->writeblocks,
+	        (unsigned long)c->actualblockno - 1, req->result, SizeReduce(c->bytestransferred));
+
+	if (c->lastblock)
+	{
+		FinishUpload(c);
+		return;
+	}
+
+	CheckReceived(c);
+	WriteNext(c);
+}
+
+// The client sent its request again, either it didn't hear back from us
+// yet or the network duplicated it. Starting the transfer over would send
+// everything twice, answer again instead if all we sent was the reply to
+// the request (the OACK or ACK 0). Lost blocks are the retransmit timer's.
+static void RepeatedRequest(client_t *c)
+{
+	packetqueue_t *last = &c->lastpacket;
+	uint16_t opcode = last->p ? ntohs(last->p->opcode) : 0;
+
+	if (opcode != PACKET_OACK && !(opcode == PACKET_ACK && ntohs(last->p->blockno) == 0))
+	{
+		bprintf("Ignoring repeated request from %s\n", GetAddress(c->s.addr));
+		return;
+	}
+
+	bprintf("Answering repeated request from %s again\n", GetAddress(c->s.addr));
+
+	packet_t *p = nmalloc(last->len);
+	memcpy(p, last->p, last->len);
+	QueuePacket(c, p, last->len, 1);
+}
+
+// Move the transfer to wherever the client says it is and send the
+// block after blockno, even if that means going backwards.
+void SendBlockAfter(client_t *c, uint64_t blockno)
+{
+	CancelTimer(&c->windowtimer);
+	c->retries = 0;
+
+	GoBack(c, blockno);
+	c->acked = blockno;
+	c->burstleft = c->cwnd;
+	FillWindow(c);
+}
+
+// Options a client asked for in its request.
+typedef struct
+{
+	long blksize, windowsize;
+	uint64_t tsize;
+	uint8_t hastsize, multicast;
+} reqoptions_t;
+
+// As per RFC2347 the client can follow the mode with any number of
+// options, each one a name and a value. Anything we don't know about is
+// left out of the OACK which tells the client we ignored it. Returns -1
+// (after sending the client an error) if one of them is invalid.
+static int ParseOptions(client_t *c, const char *data, const char *end, reqoptions_t *o)
+{
+	int invalid = 0;
+
+	memset(o, 0, sizeof(reqoptions_t));
+
+	while (data < end && *data && !invalid)
+	{
+		char *opt, *optparam;
+		GetNext(opt, data, end - data);
+		GetNext(optparam, data, data < end ? end - data : 0);
+
+		printf("Request option \"%s\" param \"%s\"\n", opt, optparam);
+
+		// Get the blocksize
+		if (!strcasecmp(opt, "blksize"))
+		{
+			errno = 0;
+			o->blksize = strtol(optparam, NULL, 10);
+			// Make sure the block size is acceptable
+			if (errno == ERANGE || o->blksize < 8 || o->blksize > 65464)
+			{
+				Error(c, ERROR_OPTION, "Invalid block size %s", optparam);
+				invalid = 1;
+			}
+		}
+		else if (!strcasecmp(opt, "windowsize"))
+		{
+			errno = 0;
+			o->windowsize = strtol(optparam, NULL, 10);
+			// RFC 7440 allows anywhere from 1 to 65535 blocks.
+			if (errno == ERANGE || o->windowsize < 1 || o->windowsize > 65535)
+			{
+				Error(c, ERROR_OPTION, "Invalid window size %s", optparam);
+				invalid = 1;
+			}
+		}
+		else if (!strcasecmp(opt, "tsize"))
+		{
+			// 0 in a read request, the size of the file in a write request.
+			errno = 0;
+			o->tsize = strtoull(optparam, NULL, 10);
+			o->hastsize = 1;
+		}
+		else if (!strcasecmp(opt, "multicast"))
+			o->multicast = 1;
+		else if (!strcasecmp(opt, "timeout"))
+		{
+			// TODO. do nothing for now.
+		}
+
+#ifndef HAVE_STRNDUPA
+		free(opt);
+		free(optparam);
+#endif
+	}
+
+	return invalid ? -1 : 0;
+}
+
+// Blocks which don't fit in one packet get fragmented, firewalls drop the
+// fragments or reassembly eats the throughput. Counter with the largest
+// block that fits (RFC 2348 lets us offer a smaller one).
+static long FitBlockSize(client_t *c, long blksize)
+{
+	int maxdatagram = MaxDatagram(c->s);
+
+	if (maxdatagram > 0 && blksize > maxdatagram - (long)sizeof(packet_t))
+	{
+		long fits = MAX(maxdatagram - (long)sizeof(packet_t), 8);
+		printf("Block size %ld is too large for the path to %s, offering %ld\n", blksize, GetAddress(c->s.addr), fits);
+		return fits;
+	}
+
+	return blksize;
+}
+
+// The file an RRQ was waiting on is here, go through the RRQ again.
+static void OpenReady(iorequest_t *req)
+{
+	client_t *c = req->data;
+	packet_t *p = c->request;
+	size_t len = c->requestlen;
+
+	c->request = NULL;
+	if (!FinishClientIO(c))
+		ProcessPacket(c, p, len, len + 1);
+
+	free(p);
+}
+
 // Process the incoming packet.
 void ProcessPacket(client_t *c, const packet_t * const p, size_t len, size_t alloclen)
 {
-	// Sanity check
-	if (len > MAX_PACKET_SIZE)
+	// Sanity check, DATA can be as large as the largest block size.
+	if (len < sizeof(uint16_t) || len > alloclen)
 	{
 		printf("Received an invalidly sized packet.\n");
 		return;
@@ -82,33 +1099,22 @@ void ProcessPacket(client_t *c, const packet_t * const p, size_t len, size_t all
 
 			bprintf("Got a data packet\n");
 
-			struct { const packet_t * const p; client_t *c; } ev = { p, c };
+			evpacket_t ev = { p, c, len };
 			CallEvent(EV_DATA_PACKET, &ev);
 
-			// If we're sending a file then write the next block
+			// If we're receiving a file then write the block
 			// otherwise, just ignore it because it's not ours.
-			if (c->sendingfile)
+			if (c->sendingfile && c->recvbuf)
 			{
-				c->currentblockno++;
-				c->actualblockno++;
-
-				size_t flen = fwrite(((uint8_t*)p) + sizeof(packet_t), 1, len - sizeof(packet_t), c->f);
-
-				char *tmp2 = stringify(" (Actually %zu)", c->actualblockno);
-				printf("Wrote block %d%s of length %zu (%s transferred)\r",
-				       ntohs(p->blockno), ntohs(p->blockno) == c->actualblockno ? "" : tmp2,
-					   flen, SizeReduce(c->bytestransferred));
-				free(tmp2);
+				size_t datalen = len - sizeof(packet_t);
 
-				Acknowledge(c, ntohs(p->blockno));
-
-				if ((len - sizeof(packet_t)) < 512)
+				if (datalen > c->blksize)
 				{
-					printf("Got end of data packet, %s transferred in %zu blocks\n",
-						   SizeReduce(c->bytestransferred), c->actualblockno);
-					// Notify on the sending of a packet that this needs to be removed.
-					c->destroy = 1;
+					Error(c, ERROR_ILLEGAL, "Block is larger than the block size of %u", c->blksize);
+					break;
 				}
+
+				ReceiveBlock(c, ntohs(p->blockno), ((uint8_t*)p) + sizeof(packet_t), datalen);
 			}
 			break;
 		}
@@ -128,7 +1134,7 @@ void ProcessPacket(client_t *c, const packet_t * const p, size_t len, size_t all
 			char *error = strndup(((const char*)p) + sizeof(packet_t), 512);
 #endif
 
-			struct { const packet_t *p; client_t *c; } ev = { p, c };
+			evpacket_t ev = { p, c, len };
 			CallEvent(EV_ERROR_PACKET, &ev);
 
 			printf("Error: %s (%d)\n", error, ntohs(p->blockno));
@@ -155,39 +1161,20 @@ void ProcessPacket(client_t *c, const packet_t * const p, size_t len, size_t all
 				c->lastpacket.allocated = c->lastpacket.len = 0;
 			}
 
-			char *tmp2 = stringify(" (Actually %zu)", c->actualblockno);
+			char *tmp2 = stringify(" (Actually %lu)", (unsigned long)c->actualblockno);
 			printf("Got Acknowledgement packet for block %d%s from %s (%s transferred)\n",
 			       ntohs(p->blockno), ntohs(p->blockno) == c->actualblockno ? "" : tmp2,
 				   GetAddress(c->s.addr), SizeReduce(c->bytestransferred));
 			free(tmp2);
 
-			struct { const packet_t * const p; client_t *c; } ev = { p, c };
+			evpacket_t ev = { p, c, len };
 			CallEvent(EV_ACK_PACKET, &ev);
 
-			if (c->sendingfile)
-			{
-				if (!c->blk)
-					c->blk = nmalloc(c->blksize);
-				memset(c->blk, 0, c->blksize);
-				size_t readlen = fread(c->blk, 1, c->blksize, c->f);
-
-				printf("Read %zu bytes from file\n", readlen);
-
-				c->currentblockno++;
-				c->actualblockno++;
-
-				// Sending a file
-				SendData(c, c->blk, readlen);
-
-				// We're at the end of the file.
-				if (MIN(c->blksize, readlen) != c->blksize)
-				{
-					printf("Finished sending file, %s transferred in %zu %d-sized blocks\n",
-						   SizeReduce(c->bytestransferred), c->actualblockno, c->blksize);
-					c->destroy = 1;
-					break;
-				}
-			}
+			// Members of a multicast group only matter if they're the master client.
+			if (c->mcsession)
+				MulticastAcknowledge(c, ntohs(p->blockno));
+			else if (c->sendingfile)
+				WindowAcknowledge(c, ntohs(p->blockno));
 
 			break;
 		}
@@ -199,93 +1186,128 @@ void ProcessPacket(client_t *c, const packet_t * const p, size_t len, size_t all
 				free(c->lastpacket.p);
 				c->lastpacket.allocated = c->lastpacket.len = 0;
 			}
+
+			// We already have a transfer going with this client.
+			if (c->sendingfile)
+			{
+				RepeatedRequest(c);
+				break;
+			}
+
 			// Get the filename and modes
 			//
 			// Since we dig only past the first value in the struct, we only
 			// get the size of that first value (eg, the uint16_t)
-			// Use strndupa to use the stack frame for temporary allocation with a
-			// max length of 512 bytes. This will prevent buffer-overflow exploits (or so I hope)
-			size_t maxlen = alloclen - sizeof(uint16_t);
+			// Use strndupa to use the stack frame for temporary allocation, never
+			// reading past the end of the packet (a parked RRQ is replayed from
+			// a copy just big enough for it) even if the client left off the nulls.
 			// Offset the packet pointer by the size of the TFTP header.
 			const char *data = ((const char *)p) + sizeof(uint16_t);
+			const char *end = ((const char *)p) + len;
 			// Define all the things we must check for in this packet.
-			char *filename, *mode, *opt, *optparam;
+			char *filename, *mode, *tmp = NULL;
 			// Get the filename
-			GetNext(filename, data, maxlen);
+			GetNext(filename, data, data < end ? end - data : 0);
 			// Get the mode of the file transfer (eg, netascii, octet, or mail)
-			GetNext(mode, data, maxlen);
-			// As per RFC2347, RFC2348, and RFC2349 we have an option parameter given
-			// We must copy it to see what the option is, there is an additional option
-			// parameter below.
-			GetNext(opt, data, maxlen);
-			if (strnlen(opt, maxlen) != 0)
-				GetNext(optparam, data, maxlen);
-
+			GetNext(mode, data, data < end ? end - data : 0);
 
-			printf("Got write request packet for file \"%s\" in mode %s with option \"%s\" param \"%s\"\n", filename, mode, opt, optparam);
+			printf("Got write request packet for file \"%s\" in mode %s\n", filename, mode);
 
 			// We don't support mail-mode
 			if (!strcasecmp(mode, "mail"))
 			{
 				Error(c, ERROR_ILLEGAL, "Mail mode not supported by NBSTFTP");
-				break;
+				goto end;
 			}
 
 			int imode = strcasecmp(mode, "netascii");
+			reqoptions_t o;
+
+			if (ParseOptions(c, data, end, &o) == -1)
+				goto end;
 
 			if (config->fixpath)
 				FixPath(filename);
 
-			char *tmp = NULL;
 			asprintf(&tmp, "%s/%s", config->directory, filename);
 
 			// Something's fucked. We're out of memory, try and abort peacefully.
 			if (!tmp)
 			{
 				Error(c, ERROR_UNDEFINED, "Out of Memory");
-				break;
+				goto end;
 			}
 
-			bprintf("Checking we can open file \"%s\"\n", tmp);
+			bprintf("Opening file \"%s\" for write (%s)\n", tmp, imode == 0 ? "netascii" : "octet");
 
-			// Check that we have access to that file
-			if (access(tmp, W_OK) == -1 || access(config->directory, W_OK) == -1)
+			// Nobody gets to see the upload until it's all there.
+			c->file = VFSCreate(filename, o.hastsize ? o.tsize : 0);
+			if (!c->file)
 			{
-				if (errno == EACCES)
-				{
-					Error(c, ERROR_NOUSER, "Cannot access file: %s", strerror(errno));
-					goto end;
-				}
-			}
-
-			bprintf("Opening file %s as %s\n", tmp, imode == 0 ? "wt" : "wb");
-			FILE *f = fopen(tmp, imode == 0 ? "wt" : "wb");
-			if (!f)
-			{
-				Error(c, ERROR_NOFILE, "Cannot write file: %s", strerror(errno));
+				fprintf(stderr, "Failed to open file %s for writing: %s\n", tmp, strerror(errno));
+				Error(c, FileErrorCode(errno), "Cannot write file: %s", FileErrorString(errno));
 				goto end;
 			}
 
 			bprintf("File %s is available for write, writing first packet...\n", tmp);
 
-			c->f = f;
+			c->netascii = imode == 0;
+			c->offset = 0;
+			c->filesize = o.hastsize ? o.tsize : 0;
+
 			c->currentblockno = 1;
 			c->actualblockno = 1;
 			c->sendingfile = 1;
 
-			struct { const packet_t * const p; client_t *c; char *filename, *mode, *path; }
-				ev = { p, c, filename, mode, tmp };
+			// The options we're agreeing to, these all go out in one OACK.
+			const char *options[3], *values[3];
+			char blksizestr[8], tsizestr[24], windowsizestr[24];
+			size_t noptions = 0;
+
+			if (o.blksize)
+			{
+				o.blksize = FitBlockSize(c, o.blksize);
+				printf("Servicing block size request of %ld\n", o.blksize);
+				c->blksize = o.blksize;
+				snprintf(blksizestr, sizeof(blksizestr), "%ld", o.blksize);
+				options[noptions] = "blksize";
+				values[noptions++] = blksizestr;
+			}
+
+			// RFC 2349 has us echo the size the client is about to send.
+			if (o.hastsize)
+			{
+				snprintf(tsizestr, sizeof(tsizestr), "%lu", (unsigned long)o.tsize);
+				options[noptions] = "tsize";
+				values[noptions++] = tsizestr;
+			}
+
+			// Every block of the window is held in memory until the ones
+			// before it arrive, keep that from getting out of hand.
+			if (o.windowsize)
+			{
+				o.windowsize = MIN(o.windowsize, MIN(config->maxwindowsize, MAX(1, RECEIVE_BUFFER / (long)c->blksize)));
+				snprintf(windowsizestr, sizeof(windowsizestr), "%ld", o.windowsize);
+				options[noptions] = "windowsize";
+				values[noptions++] = windowsizestr;
+			}
+
+			StartReceive(c, o.windowsize ? o.windowsize : 1);
+
+			evrequest_t ev = { p, c, filename, mode, tmp, len };
 			CallEvent(EV_NEWWRITEREQUEST, &ev);
 
-			// Acknowledge our transfer request
-			Acknowledge(c, 0);
+			// Acknowledge our transfer request, the OACK stands in
+			// for the ACK of block 0 when there are options.
+			if (noptions)
+				OptionAcknowledge(c, options, values, noptions);
+			else
+				Acknowledge(c, 0);
 
 end:
 #ifndef HAVE_STRNDUPA
 			free(filename);
 			free(mode);
-			free(opt);
-			free(optparam);
 #endif
 			free(tmp);
 			break;
@@ -298,143 +1320,169 @@ end:
 				free(c->lastpacket.p);
 				c->lastpacket.allocated = c->lastpacket.len = 0;
 			}
+
+			// We already have a transfer going with this client.
+			if (c->sendingfile)
+			{
+				RepeatedRequest(c);
+				break;
+			}
+
+			// Still waiting on the file for the first one.
+			if (c->request)
+				break;
+
 			// Get the filename and modes
 			//
 			// Since we dig only past the first value in the struct, we only
 			// get the size of that first value (eg, the uint16_t)
-			// Use strndupa to use the stack frame for temporary allocation with a
-			// max length of 512 bytes. This will prevent buffer-overflow exploits (or so I hope)
-			size_t maxlen = alloclen - sizeof(uint16_t);
+			// Use strndupa to use the stack frame for temporary allocation, never
+			// reading past the end of the packet (a parked RRQ is replayed from
+			// a copy just big enough for it) even if the client left off the nulls.
 			// Offset the packet pointer by the size of the TFTP header.
 			const char *data = ((const char *)p) + sizeof(uint16_t);
+			const char *end = ((const char *)p) + len;
 			// Define all the things we must check for in this packet.
-			char *filename, *mode, *opt, *optparam;
+			char *filename, *mode, *tmp = NULL;
 			// Get the filename
-			GetNext(filename, data, maxlen);
+			GetNext(filename, data, data < end ? end - data : 0);
 			// Get the mode of the file transfer (eg, netascii, octet, or mail)
-			GetNext(mode, data, maxlen);
-			// As per RFC2347, RFC2348, and RFC2349 we have an option parameter given
-			// We must copy it to see what the option is, there is an additional option
-			// parameter below.
-			GetNext(opt, data, maxlen);
-			if (strnlen(opt, maxlen) != 0)
-				GetNext(optparam, data, maxlen);
+			GetNext(mode, data, data < end ? end - data : 0);
 
 			// mode can be "netascii", "octet", or "mail" case insensitive.
-			printf("Got read request packet: \"%s\" -> \"%s\" with option \"%s\" param \"%s\"\n", filename, mode, opt, optparam);
+			printf("Got read request packet: \"%s\" -> \"%s\"\n", filename, mode);
 
 			// We don't support mail-mode
 			if (!strcasecmp(mode, "mail"))
 			{
 				Error(c, ERROR_ILLEGAL, "Mail mode not supported by NBSTFTP");
-				break;
+				goto rrqend;
 			}
 
-			int imode = strcasecmp(mode, "netascii"), tsize = 0;
+			int imode = strcasecmp(mode, "netascii");
+			reqoptions_t o;
 
-			// Get the blocksize
-			if (!strcasecmp(opt, "blksize"))
-			{
-				errno = 0;
-				long blksize = strtol(optparam, NULL, 10);
-				// the block size is not in range.
-				if (errno == ERANGE)
-				{
-					Error(c, ERROR_OPTION, "Invalid block size %s: %s (%d)", optparam, strerror(errno), errno);
-					break;
-				}
-
-				// Make sure the block size is acceptable
-				if (blksize < 8 || blksize > 65464)
-				{
-					Error(c, ERROR_OPTION, "Invalid block size %ld", blksize);
-					break;
-				}
-				// Okay. it's a valid block size, reply with an OptionAcknowledgement
-				// then start servicing the request after the next ack packet
-				printf("Servicing block size request of %ld\n", blksize);
-				OptionAcknowledge(c, opt, optparam);
-				// Mark that we're already sending the file, this will be used in the
-				// logic below, making the ACK reply the first packet sent.
-				c->sendingfile = 1;
-				c->currentblockno = 0;
-				c->actualblockno = 0;
-				// Set the block size to send.
-				c->blksize = blksize;
-			}
-			else if (!strcasecmp(opt, "tsize"))
-				tsize = 1;
-			else if (!strcasecmp(opt, "timeout"))
-			{
-				// TODO. do nothing for now.
-			}
+			if (ParseOptions(c, data, end, &o) == -1)
+				goto rrqend;
 
 			if (config->fixpath)
 				FixPath(filename);
 
-			char *tmp = NULL;
 			asprintf(&tmp, "%s/%s", config->directory, filename);
 
-			if (!FileExists(tmp))
-				Error(c, ERROR_NOFILE, "File %s does not exist on the filesystem.", tmp);
+			// Whoever has the file, the served directory if no module does.
+			c->openreq.complete = OpenReady;
+			c->openreq.data     = c;
+			c->file = VFSOpenAsync(filename, &c->s.addr, &c->openreq);
+
+			// Nothing to say to the client until it's here.
+			if (!c->file && errno == EINPROGRESS)
+			{
+				c->request = nmalloc(len + 1);
+				memcpy(c->request, p, len);
+				c->requestlen = len;
+				c->iopending++;
+				goto rrqend;
+			}
 
-			FILE *f = fopen(tmp, (imode == 0 ? "rt" : "rb"));
-			if (!f)
+			if (!c->file)
 			{
 				fprintf(stderr, "Failed to open file %s for sending: %s\n", tmp, strerror(errno));
-				Error(c, ERROR_NOFILE, "Cannot open file: %s", strerror(errno));
-				break;
+				Error(c, FileErrorCode(errno), "Cannot open file: %s", FileErrorString(errno));
+				goto rrqend;
 			}
 
-			fseek(f, 0, SEEK_END);
-			size_t len = ftell(f);
-			rewind(f);
+			// Get whatever it asks for next ready while this goes.
+			LearnRequest(filename, &c->s.addr);
+
+			size_t filelen = c->file->size;
 
-			// This is up her because we declare a variable inside
-			// a critical section between the goto jump and the compiler will whine
-			// even though it is only used within that critical section.
-			struct { const packet_t * const p; client_t *c; char *filename, *mode, *path; }
-			ev = { p, c, filename, mode, tmp };
-			uint8_t buf[512];
+			bprintf("File \"%s\" is %s long\n", tmp, SizeReduce(filelen));
+
+			// file buffer
+			c->filesize = filelen;
+			c->offset = 0;
+			c->readahead = 0;
+			c->netascii = imode == 0;
 
-			if (tsize)
+			// Set the block size to send.
+			if (o.blksize)
 			{
-				bprintf("Client wants to know size of file \"%s\" (which is %s), responding...\n", tmp, SizeReduce(len));
-				free(tmp);
-				tmp = NULL;
-				asprintf(&tmp, "%zu", len);
-				OptionAcknowledge(c, opt, tmp);
-				fclose(f);
-				goto skipfilesend;
+				o.blksize = FitBlockSize(c, o.blksize);
+				printf("Servicing block size request of %ld\n", o.blksize);
+				c->blksize = o.blksize;
 			}
 
-			bprintf("File \"%s\" is %s long, sending first packet\n", tmp, SizeReduce(len));
+			// We read front to back, let the kernel know so it can read ahead harder.
+			if (c->file->fd != -1)
+				posix_fadvise(c->file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-			// file buffer
-			c->f = f;
+			// The options we're agreeing to, these all go out in one OACK.
+			const char *options[4], *values[4];
+			char blksizestr[8], tsizestr[24], multicaststr[32], windowsizestr[24];
+			size_t noptions = 0;
+
+			if (o.blksize)
+			{
+				snprintf(blksizestr, sizeof(blksizestr), "%ld", o.blksize);
+				options[noptions] = "blksize";
+				values[noptions++] = blksizestr;
+			}
 
+			// How big a netascii transfer is depends on what's in the file,
+			// we'd have to read all of it to know. Like tftp-hpa we don't say.
+			if (o.hastsize && !c->netascii)
+			{
+				bprintf("Client wants to know size of file \"%s\" (which is %s), responding...\n", tmp, SizeReduce(filelen));
+				snprintf(tsizestr, sizeof(tsizestr), "%zu", filelen);
+				options[noptions] = "tsize";
+				values[noptions++] = tsizestr;
+			}
 
-			if (c->sendingfile)
-				goto skipfilesend;
-			else
+			// If we can't put the client in a group it just gets the file
+			// the normal way, leaving the option out tells it as much.
+			if (o.multicast && !c->netascii && JoinMulticast(c, multicaststr, sizeof(multicaststr)) == 0)
+			{
+				options[noptions] = "multicast";
+				values[noptions++] = multicaststr;
+			}
+			// Multicast is lock-step, windows only apply to normal transfers.
+			else if (o.windowsize)
 			{
-				c->sendingfile = 1;
-				c->currentblockno = 1;
-				c->actualblockno = 1;
+				// Counter with our limit if the client wants more.
+				o.windowsize = MIN(o.windowsize, config->maxwindowsize);
+				snprintf(windowsizestr, sizeof(windowsizestr), "%ld", o.windowsize);
+				options[noptions] = "windowsize";
+				values[noptions++] = windowsizestr;
 			}
 
-			memset(buf, 0, sizeof(buf));
-			size_t readlen = fread(buf, 1, sizeof(buf), f);
+			// Share the reads with anyone else fetching this file right now.
+			if (!c->mcsession && !c->netascii && config->sharedstreams)
+				AttachStream(c);
 
-			CallEvent(EV_NEWWRITEREQUEST, &ev);
-			SendData(c, buf, readlen);
-skipfilesend:
+			c->sendingfile = 1;
+			c->currentblockno = 0;
+			c->actualblockno = 0;
+			StartWindow(c, c->mcsession || !o.windowsize ? 1 : o.windowsize);
+
+			// The client asked for options, the OACK is out and the first
+			// block goes out with their ACK. Get it ready in the meantime.
+			if (noptions)
+			{
+				OptionAcknowledge(c, options, values, noptions);
+				c->prefetch = !c->mcsession;
+				goto rrqend;
+			}
+
+			evrequest_t ev = { p, c, filename, mode, tmp, len };
+			CallEvent(EV_NEWREADREQUEST, &ev);
+
+			FillWindow(c);
+rrqend:
 
 #ifndef HAVE_STRNDUPA
 			free(filename);
 			free(mode);
-			free(opt);
-			free(optparam);
 #endif
 			free(tmp);
 
@@ -443,7 +1491,7 @@ skipfilesend:
 		default:
 			bprintf("Got unknown packet: %d\n", ntohs(p->opcode));
 
-			struct { const packet_t * const p; client_t *c; } ev = { p, c };
+			evpacket_t ev = { p, c, len };
 			CallEvent(EV_UNKNOWN_PACKET, &ev);
 
 			break;
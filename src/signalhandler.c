@@ -16,12 +16,14 @@
 #include "signalhandler.h"
 #include "config.h"
 #include "module.h"
+#include "filesystem.h"
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
 
 extern char *configfile;
 extern int running;
+extern volatile sig_atomic_t dumpstats;
 
 static void SignalHandler(int sig)
 {
@@ -38,6 +40,8 @@ static void SignalHandler(int sig)
 			{
 				printf("Rehash successful.\n");
 				DeallocateConfig(oldconf);
+				// The directory may have changed, re-anchor our root.
+				OpenServeRoot(config->directory);
 			}
 			break;
 		}
@@ -57,6 +61,10 @@ static void SignalHandler(int sig)
 			printf("Received quit signal, quitting...\n");
 			running = 0;
 			break;
+		case SIGUSR1:
+			// The main loop prints them, printf isn't safe in here.
+			dumpstats = 1;
+			break;
 		case SIGPIPE:
 			printf("Received SIGPIPE, ignoring...\n");
 			break;
@@ -76,4 +84,5 @@ void RegisterSignalHandlers(void)
 	signal(SIGTERM, SignalHandler);
 	signal(SIGHUP, SignalHandler);
 	signal(SIGPIPE, SignalHandler);
+	signal(SIGUSR1, SignalHandler);
 }
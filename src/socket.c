@@ -29,17 +29,34 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <string.h>
+
+#include "sysconf.h"
 
 #include "vec.h"
 #include "multiplexer.h"
 
+#ifdef HAVE_SO_TXTIME
+# include <linux/net_tstamp.h>
+#endif
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+# include <time.h>
+# include <linux/errqueue.h>
+#endif
+
 socket_vec_t socketpool;
 extern int port;
 
+static inline socklen_t AddressLength(const socketstructs_t *addr)
+{
+	return addr->sa.sa_family == AF_INET ? sizeof(addr->in) : sizeof(addr->in6);
+}
+
 // This function will create and bind to a port and address. It will create and add
 // the socket to the epoll loop. This should be called for each socket created by
 // the config.
-int BindToSocket(const char *addr, short port)
+int BindToSocket(const char *addr, short port, int mtu)
 {
 	assert(addr);
 
@@ -83,6 +100,35 @@ int BindToSocket(const char *addr, short port)
 		return -1;
 	}
 
+#ifdef HAVE_SO_TXTIME
+	// Let packets say when they should leave, fq will hold them until then.
+	if (config->pacing == PACING_TXTIME)
+	{
+		struct sock_txtime st = { CLOCK_MONOTONIC, 0 };
+		if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &st, sizeof(struct sock_txtime)) == -1)
+		{
+			perror("setsockopt SO_TXTIME, pacing with timers instead");
+			config->pacing = PACING_TIMER;
+		}
+	}
+#else
+	if (config->pacing == PACING_TXTIME)
+	{
+		fprintf(stderr, "SO_TXTIME is not supported on this system, pacing with timers instead\n");
+		config->pacing = PACING_TIMER;
+	}
+#endif
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+	// Have the kernel queue ICMP errors for what we send (see ReceiveErrors).
+	// IPv6 sockets get the IPv4 option too for v4-mapped clients.
+	int on = 1;
+	if (saddr.sa.sa_family == AF_INET6 && setsockopt(fd, SOL_IPV6, IPV6_RECVERR, &on, sizeof(int)) == -1)
+		perror("setsockopt IPV6_RECVERR");
+	if (setsockopt(fd, SOL_IP, IP_RECVERR, &on, sizeof(int)) == -1 && saddr.sa.sa_family == AF_INET)
+		perror("setsockopt IP_RECVERR");
+#endif
+
 	// Bind to the socket
 	if (bind(fd, &saddr.sa, saddr.sa.sa_family == AF_INET ? sizeof(saddr.in) : sizeof(saddr.in6)) < 0)
 	{
@@ -97,6 +143,9 @@ int BindToSocket(const char *addr, short port)
 		return -1;
 	}
 
+	// Clients find the listen socket by its descriptor (see PathMTU).
+	vec_last(&socketpool).mtu = mtu;
+
 	// Return success
 	return 0;
 }
@@ -111,6 +160,10 @@ int AddSocket(int fd, const char *addr, int type, socketstructs_t saddr, uint8_t
 	sock.type = saddr.sa.sa_family;
 	sock.fd = fd;
 	sock.flags = 0;
+	sock.mtu = 0;
+	sock.readhandler = sock.writehandler = NULL;
+	sock.closehandler = NULL;
+	sock.data = NULL;
 	memcpy(&(sock.addr), &saddr, sizeof(socketstructs_t));
 
 	// Allocate the packet.
@@ -144,6 +197,41 @@ int AddSocket(int fd, const char *addr, int type, socketstructs_t saddr, uint8_t
 	return 0;
 }
 
+// Add a descriptor which isn't a TFTP socket to the multiplexer, the
+// handlers are called instead of Send/ReceivePackets when it's ready.
+int AddHandlerSocket(int fd, int (*readhandler)(socket_t s), int (*writehandler)(socket_t s), void (*closehandler)(socket_t s), void *data)
+{
+	socket_t sock;
+	memset(&sock, 0, sizeof(socket_t));
+	sock.bindaddr     = strdup("");
+	sock.fd           = fd;
+	sock.type         = -1;
+	sock.readhandler  = readhandler;
+	sock.writehandler = writehandler;
+	sock.closehandler = closehandler;
+	sock.data         = data;
+
+	if (AddToMultiplexer(&sock) == -1)
+	{
+		free(sock.bindaddr);
+		return -1;
+	}
+
+	errno = 0;
+	vec_push(&socketpool, sock);
+	// Make sure we could add the socket, the caller still has
+	// the descriptor (and whatever the close handler is for).
+	if (errno == ENOMEM)
+	{
+		fprintf(stderr, "Failed to add socket to socket pool!\n");
+		RemoveFromMultiplexer(sock);
+		free(sock.bindaddr);
+		return -1;
+	}
+
+	return 0;
+}
+
 int FindSocket(int fd, socket_t *s)
 {
 	socket_t sock;
@@ -161,6 +249,45 @@ int FindSocket(int fd, socket_t *s)
 	return -1;
 }
 
+// The largest UDP payload we can send the client without it getting
+// fragmented, going by the MTU of the route to it and the MTU set for the
+// listen block it came in on. Returns -1 if neither is known.
+int MaxDatagram(socket_t s)
+{
+	socket_t listener;
+	int mtu = FindSocket(s.fd, &listener) == 0 ? listener.mtu : 0;
+
+	// IPv4 clients of an IPv6 socket still get IPv4 headers.
+	int ipv4 = s.addr.sa.sa_family == AF_INET
+		|| (s.addr.sa.sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&s.addr.in6.sin6_addr));
+
+#if defined(IP_MTU) && defined(IPV6_MTU)
+	// The route MTU (including anything path MTU discovery has learned)
+	// is only known to a connected socket. Connecting a UDP socket doesn't
+	// send anything, it just looks the route up.
+	int fd = socket(s.addr.sa.sa_family, SOCK_DGRAM, 0);
+	if (fd != -1)
+	{
+		int routemtu;
+		socklen_t len = sizeof(int);
+
+		if (connect(fd, &s.addr.sa, AddressLength(&s.addr)) == 0
+		    && getsockopt(fd, s.addr.sa.sa_family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
+		                  s.addr.sa.sa_family == AF_INET ? IP_MTU : IPV6_MTU, &routemtu, &len) == 0
+		    && routemtu > 0)
+			mtu = mtu ? MIN(mtu, routemtu) : routemtu;
+
+		close(fd);
+	}
+#endif
+
+	if (!mtu)
+		return -1;
+
+	// IP and UDP headers.
+	return mtu - (ipv4 ? 20 : 40) - 8;
+}
+
 short GetPort(socket_t s)
 {
 	// if IPv4, get IPv4 port
@@ -177,7 +304,10 @@ const char *GetAddress(socketstructs_t saddr)
 {
 	static char str[INET6_ADDRSTRLEN+1];
 
-	return inet_ntop(saddr.sa.sa_family, &saddr.sa, str, INET6_ADDRSTRLEN);
+	if (saddr.sa.sa_family == AF_INET)
+		return inet_ntop(AF_INET, &saddr.in.sin_addr, str, INET6_ADDRSTRLEN);
+
+	return inet_ntop(saddr.sa.sa_family, &saddr.in6.sin6_addr, str, INET6_ADDRSTRLEN);
 }
 
 void DestroySocket(socket_t s, uint8_t closefd)
@@ -189,7 +319,9 @@ void DestroySocket(socket_t s, uint8_t closefd)
 	// Now remove it from our vector
 	for (int idx = 0; idx < socketpool.length; idx++)
 	{
-		if (socketpool.data[idx].fd == s.fd && !strcmp(socketpool.data[idx].bindaddr, s.bindaddr))
+		// Clients share the listen socket's descriptor (and often its address),
+		// the packet buffer is the one thing every entry has to itself.
+		if (socketpool.data[idx].fd == s.fd && socketpool.data[idx].packet == s.packet)
 		{
 			vec_splice(&socketpool, idx, 1);
 			break;
@@ -199,6 +331,8 @@ void DestroySocket(socket_t s, uint8_t closefd)
 	// Close the socket
 	if (closefd)
 		close(s.fd);
+	if (s.closehandler)
+		s.closehandler(s);
 	// Free a string then free itself.
 	free(s.bindaddr);
 	free(s.packet);
@@ -231,7 +365,7 @@ int InitializeSockets(void)
 		if (!block->bindaddr)
 			block->bindaddr = strdup("::");
 
-		if (BindToSocket(block->bindaddr, block->port) == -1)
+		if (BindToSocket(block->bindaddr, block->port, block->mtu) == -1)
 		{
 			int isipv6 = strstr(block->bindaddr, ":") != NULL;
 			fprintf(stderr, "Failed to bind to %c%s%c:%d\n",
@@ -275,12 +409,17 @@ void QueuePacket(client_t *c, packet_t *p, size_t len, uint8_t allocated)
 	pack.p = p;
 	pack.len = len;
 	pack.allocated = allocated;
+	pack.txtime = c->txtime;
 
 	vec_push(&c->packetqueue_vec, pack);
 
 	// We're a resend, no need to redo the packet copy.
 	if (allocated != 2)
 	{
+		// Only the newest packet is kept around.
+		if (c->lastpacket.p)
+			free(c->lastpacket.p);
+
 		// Copy the packet structure
 		memcpy(&c->lastpacket, &pack, sizeof(packetqueue_t));
 		c->lastpacket.p = nmalloc(len);
@@ -296,55 +435,360 @@ void QueuePacket(client_t *c, packet_t *p, size_t len, uint8_t allocated)
 	SetSocketStatus(&c->s, SF_WRITABLE | SF_READABLE);
 }
 
+// Errors the kernel hands back from ICMP messages for something we sent
+// earlier. With IP_RECVERR any send or receive can return one of these
+// once, they're about one of our clients rather than the socket.
+static inline int PeerError(int err)
+{
+	return err == ECONNREFUSED || err == EHOSTUNREACH || err == ENETUNREACH || err == EHOSTDOWN || err == EACCES;
+}
+
+static inline int SameAddress(const socketstructs_t *a, const socketstructs_t *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family)
+		return 0;
+
+	if (a->sa.sa_family == AF_INET)
+		return a->in.sin_port == b->in.sin_port && a->in.sin_addr.s_addr == b->in.sin_addr.s_addr;
+
+	return a->in6.sin6_port == b->in6.sin6_port && !memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof(struct in6_addr));
+}
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+// A client that went away halfway through (eg, a PXE client rebooting) used
+// to hold on to its file and buffers until we gave up resending to it. The
+// kernel queues the ICMP port or host unreachable we get back for it on the
+// socket instead, abort the transfer right away. Returns -1 if the error
+// queue couldn't be read.
+int ReceiveErrors(socket_t s)
+{
+	if (s.readhandler)
+		return -1;
+
+	for (;;)
+	{
+		socketstructs_t ss;
+		union
+		{
+			char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg;
+
+		// We don't need the packet that bounced, just where it went.
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_name       = &ss;
+		msg.msg_namelen    = sizeof(socketstructs_t);
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		if (recvmsg(s.fd, &msg, MSG_ERRQUEUE) == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "Socket: Failed to read the error queue: %s\n", strerror(errno));
+			return -1;
+		}
+
+		struct sock_extended_err *ee = NULL;
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+			    || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				ee = (struct sock_extended_err*)CMSG_DATA(cm);
+		}
+
+		if (!ee || (ee->ee_origin != SO_EE_ORIGIN_ICMP && ee->ee_origin != SO_EE_ORIGIN_ICMP6))
+			continue;
+
+		if (!PeerError(ee->ee_errno))
+		{
+			bprintf("Ignoring ICMP error for %s: %s\n", GetAddress(ss), strerror(ee->ee_errno));
+			continue;
+		}
+
+		client_t *c;
+		int idx;
+		vec_foreach(&clientpool, c, idx)
+		{
+			if (c->s.fd != s.fd || c->destroy || !SameAddress(&c->s.addr, &ss))
+				continue;
+
+			printf("Client %s:%u is unreachable (%s), aborting transfer\n", GetAddress(ss), (uint16_t)GetPort(c->s), strerror(ee->ee_errno));
+
+			c->destroy = 1;
+			// Make sure the socket comes around to clean it up.
+			SetSocketStatus(&c->s, SF_READABLE | SF_WRITABLE);
+			break;
+		}
+	}
+}
+#else
+int ReceiveErrors(socket_t s)
+{
+	return -1;
+}
+#endif
+
+// The socket buffer (or the interface's queue) is full for now, what
+// didn't go out waits for the socket to be writable again.
+static inline int SocketFull(int err)
+{
+	return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+#ifdef HAVE_SO_TXTIME
+// Tell the kernel when to send the packet.
+static void SetTxTime(struct msghdr *msg, void *buf, uint64_t txtime)
+{
+	msg->msg_control    = buf;
+	msg->msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+
+	struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type  = SCM_TXTIME;
+	cm->cmsg_len   = CMSG_LEN(sizeof(uint64_t));
+	memcpy(CMSG_DATA(cm), &txtime, sizeof(uint64_t));
+}
+
+// Control message space for one SCM_TXTIME, aligned for cmsghdr.
+typedef union
+{
+	char buf[CMSG_SPACE(sizeof(uint64_t))];
+	struct cmsghdr align;
+} txtimebuf_t;
+#endif
+
+#ifdef HAVE_SENDMMSG
+// Most sendmmsg() will take in one call.
+# define SEND_BATCH 1024
+
+// Send a batch of queued packets with as few system calls as we can, a
+// boot storm means hundreds of clients all wanting a block at once.
+// Returns how many were sent, stopping at the first failure with errno set.
+static int SendBatch(int fd, packetqueue_t **pqs, client_t **clients, int count)
+{
+	static struct mmsghdr msgs[SEND_BATCH];
+	static struct iovec iovs[SEND_BATCH];
+#ifdef HAVE_SO_TXTIME
+	static txtimebuf_t cmsgs[SEND_BATCH];
+#endif
+	int sent = 0;
+
+	while (sent < count)
+	{
+		int n = MIN(count - sent, SEND_BATCH);
+
+		for (int i = 0; i < n; i++)
+		{
+			client_t *c = clients[sent + i];
+
+			iovs[i].iov_base = pqs[sent + i]->p;
+			iovs[i].iov_len  = pqs[sent + i]->len;
+
+			memset(&msgs[i], 0, sizeof(struct mmsghdr));
+			msgs[i].msg_hdr.msg_name    = &c->s.addr.sa;
+			msgs[i].msg_hdr.msg_namelen = AddressLength(&c->s.addr);
+			msgs[i].msg_hdr.msg_iov     = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen  = 1;
+
+#ifdef HAVE_SO_TXTIME
+			if (pqs[sent + i]->txtime)
+				SetTxTime(&msgs[i].msg_hdr, cmsgs[i].buf, pqs[sent + i]->txtime);
+#endif
+		}
+
+		int ret = sendmmsg(fd, msgs, n, 0);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// Nothing to do with this batch, a client we sent to earlier
+			// is gone. Deal with that and carry on.
+			if (PeerError(errno))
+			{
+				socket_t s = { .fd = fd };
+				if (ReceiveErrors(s) == 0)
+					continue;
+			}
+
+			if (!SocketFull(errno))
+				perror("sendmmsg failed");
+			return sent;
+		}
+
+		for (int i = 0; i < ret; i++)
+			clients[sent + i]->bytestransferred += msgs[i].msg_len;
+
+		sent += ret;
+	}
+
+	return sent;
+}
+#else
+static int SendBatch(int fd, packetqueue_t **pqs, client_t **clients, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		client_t *c = clients[i];
+		int sendlen;
+
+#ifdef HAVE_SO_TXTIME
+		if (pqs[i]->txtime)
+		{
+			txtimebuf_t cmsg;
+			struct iovec iov = { pqs[i]->p, pqs[i]->len };
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(struct msghdr));
+			msg.msg_name    = &c->s.addr.sa;
+			msg.msg_namelen = AddressLength(&c->s.addr);
+			msg.msg_iov     = &iov;
+			msg.msg_iovlen  = 1;
+			SetTxTime(&msg, cmsg.buf, pqs[i]->txtime);
+
+			sendlen = sendmsg(fd, &msg, 0);
+		}
+		else
+#endif
+			sendlen = sendto(fd, pqs[i]->p, pqs[i]->len, 0, &c->s.addr.sa, AddressLength(&c->s.addr));
+
+		if (sendlen == -1)
+		{
+			// Nothing to do with this packet, a client we sent to earlier
+			// is gone. Deal with that and try again.
+			if (PeerError(errno))
+			{
+				socket_t s = { .fd = fd };
+				if (ReceiveErrors(s) == 0)
+				{
+					i--;
+					continue;
+				}
+			}
+
+			if (!SocketFull(errno))
+				perror("sendto failed");
+			return i;
+		}
+		c->bytestransferred += sendlen;
+	}
+
+	return count;
+}
+#endif
+
 // Send packets out the socket, this will be called by the multiplexers
 // system in one of the multiplexers files
 int SendPackets(socket_t s)
 {
-	packetqueue_t pq;
+	static vec_t(packetqueue_t*) pqs;
+	static vec_t(client_t*) owners;
+	packetqueue_t *pq;
 	client_t *c = NULL;
 	int cidx, idx;
 
-	// Iterate over the entire client pool because there may be more than
-	// one client which needs to send packets. This should probably be
-	// improved in the future but it works for now.
+	if (s.writehandler)
+		return s.writehandler(s);
+
+	vec_clear(&pqs);
+	vec_clear(&owners);
+
+	// Every client of a listen block shares its socket, gather up what
+	// all of them have queued so it can go out in one batch.
 	vec_foreach(&clientpool, c, cidx)
 	{
-		vec_foreach(&c->packetqueue_vec, pq, idx)
+		if (c->s.fd != s.fd)
+			continue;
+
+		for (idx = 0; idx < c->packetqueue_vec.length; idx++)
 		{
-			bprintf("Sending packet %d length %zu\n", ntohs(pq.p->opcode), pq.len);
+			pq = &c->packetqueue_vec.data[idx];
+
+			bprintf("Sending packet %d length %zu\n", ntohs(pq->p->opcode), pq->len);
 
-			struct { socket_t *s; packet_t *p; client_t *c; size_t len; } ev = { &c->s, pq.p, c, pq.len };
+			evsending_t ev = { &c->s, pq->p, c, pq->len };
 			CallEvent(EV_SENDING_PACKETS, &ev);
 
-			int sendlen = sendto(c->s.fd, pq.p, pq.len, 0, &c->s.addr.sa, c->s.addr.sa.sa_family == AF_INET ? sizeof(c->s.addr.in) : sizeof(c->s.addr.in6));
-			if (sendlen == -1)
-			{
-				perror("sendto failed");
-				return -1;
-			}
-			c->bytestransferred += sendlen;
+			vec_push(&pqs, pq);
+			vec_push(&owners, c);
+		}
+	}
+
+	int sent = SendBatch(s.fd, pqs.data, owners.data, pqs.length);
+	int err = errno;
 
-			if (pq.allocated && pq.allocated != 2)
-				free(pq.p);
+	for (idx = 0; idx < sent; idx++)
+	{
+		if (pqs.data[idx]->allocated && pqs.data[idx]->allocated != 2)
+			free(pqs.data[idx]->p);
+	}
+
+	if (sent != pqs.length && SocketFull(err))
+	{
+		// Each client's packets are together and in order, take the ones
+		// that went out off the front of its queue. The rest stay queued
+		// and the socket stays writable for them.
+		for (idx = 0; idx < sent;)
+		{
+			c = owners.data[idx];
+
+			int n = 0;
+			for (; idx < sent && owners.data[idx] == c; idx++)
+				n++;
+
+			vec_splice(&c->packetqueue_vec, 0, n);
 		}
 
+		return 0;
+	}
+
+	if (sent != pqs.length)
+	{
+		// Don't leave the ones we did send queued up to be freed twice.
+		for (idx = 0; idx < sent; idx++)
+			pqs.data[idx]->allocated = 0;
+
+		return -1;
+	}
+
+	// Go backwards, removing a client shifts everything after it. Removing
+	// one can take others with it (eg, a multicast group) so don't run off
+	// the end if the pool shrank by more than one.
+	for (cidx = clientpool.length - 1; cidx >= 0; cidx = MIN(cidx, clientpool.length) - 1)
+	{
+		c = clientpool.data[cidx];
+
+		if (c->s.fd != s.fd)
+			continue;
+
 		vec_clear(&c->packetqueue_vec);
 
-		SetSocketStatus(&c->s, SF_READABLE);
+		// The block is on the wire, read the next one while the client ACKs it.
+		if (c->prefetch)
+			PrefetchBlock(c);
 
 		if (c->destroy)
-		{
-			// If we're reading or writing a file, close it.
-			if (c->f)
-			{
-				fflush(c->f);
-				fclose(c->f);
-			}
-
 			RemoveClient(c);
+	}
+
+	// They all share the socket, so one call does for all of them. It
+	// stays writable if any of that queued something (eg, removing a
+	// client made another the master and it owes an OACK).
+	int status = SF_READABLE;
+	vec_foreach(&clientpool, c, cidx)
+	{
+		if (c->s.fd == s.fd && c->packetqueue_vec.length)
+		{
+			status |= SF_WRITABLE;
+			break;
 		}
 	}
 
+	SetSocketStatus(&s, status);
 	return 0;
 }
 
@@ -352,6 +796,9 @@ int ReceivePackets(socket_t s)
 {
 	socketstructs_t ss;
 	socklen_t addrlen = sizeof(ss);
+
+	if (s.readhandler)
+		return s.readhandler(s);
 // 	uint8_t buf[MAX_PACKET_SIZE];
 	errno = 0;
 	// Clear out the old packet, since we're a synchronous process, we don't need
@@ -366,6 +813,9 @@ int ReceivePackets(socket_t s)
 	// we left off.
 	if (recvlen == -1 && (errno == EAGAIN || errno == EINTR))
 		return 0;
+	// An ICMP error for something we sent earlier.
+	else if (recvlen == -1 && PeerError(errno) && ReceiveErrors(s) == 0)
+		return 0;
 	else if (recvlen == -1)
 	{
 		fprintf(stderr, "Socket: Received an error when reading from the socket: %s\n", strerror(errno));
@@ -384,7 +834,7 @@ int ReceivePackets(socket_t s)
 
 	bprintf("Received %zu bytes from %s:%d on socket %d\n", recvlen, GetAddress(cs.addr), GetPort(cs), s.fd);
 
-	struct { socket_t *s; client_t *c; const void * const buf; size_t len; } ev = { &s, c, s.packet, recvlen };
+	evreceiving_t ev = { &s, c, s.packet, recvlen };
 	CallEvent(EV_RECEIVING_PACKETS, &ev);
 
 	// Process the packet received.
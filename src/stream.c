@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "stream.h"
+#include "client.h"
+#include "process.h"
+#include "packets.h"
+#include "misc.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Shared read streams. When a few hundred machines boot at once they all
+// fetch the same files at roughly the same time. Instead of every client
+// reading every block for itself, clients fetching the same file with the
+// same block size attach to one stream. A block is read from disk once,
+// kept in a small ring of recent blocks and handed to every client which
+// asks for it. Each client still keeps its own position in the file.
+
+static vec_t(stream_t*) streams;
+
+// Blocks read from disk and blocks handed out without reading.
+static uint64_t diskreads, sharedhits;
+
+static void FreeStream(stream_t *st)
+{
+	for (int i = 0; i < STREAM_BLOCKS; i++)
+	{
+		if (st->blocks[i].data)
+			free(st->blocks[i].data);
+
+		vec_deinit(&st->blocks[i].waiters);
+	}
+
+	vec_remove(&streams, st);
+	VFSClose(st->file);
+	free(st);
+}
+
+// Nobody is using the stream anymore, get rid of it once
+// the reads it still has in flight come back.
+static void ReleaseStream(stream_t *st)
+{
+	if (!st->clients && !st->iopending)
+		FreeStream(st);
+}
+
+// Attach a client to the stream for the file it just opened, making
+// a new stream if nobody else is reading that file right now.
+stream_t *AttachStream(client_t *c)
+{
+	assert(c && c->file);
+
+	vfile_t *vf = c->file;
+	stream_t *st = NULL;
+	int idx;
+
+	// Nothing to share if we can't tell files apart or they're in memory anyway.
+	if (!(vf->backend->caps & VFS_SHARED) || vf->map)
+		return NULL;
+
+	vec_foreach(&streams, st, idx)
+	{
+		if (st->file->backend == vf->backend && st->file->dev == vf->dev && st->file->ino == vf->ino
+		    && st->blksize == c->blksize)
+			goto found;
+	}
+
+	st = nmalloc(sizeof(stream_t));
+	st->blksize = c->blksize;
+	// The stream can outlive the client that made it.
+	st->file    = VFSRetain(vf);
+
+	for (int i = 0; i < STREAM_BLOCKS; i++)
+	{
+		st->blocks[i].stream = st;
+		vec_init(&st->blocks[i].waiters);
+	}
+
+	vec_push(&streams, st);
+
+found:
+	st->clients++;
+	c->stream = st;
+
+	bprintf("Client attached to shared stream for inode %lu (%d clients)\n", (unsigned long)st->file->ino, st->clients);
+
+	return st;
+}
+
+// Let go of the block the client was holding on to.
+void StreamRelease(client_t *c)
+{
+	if (!c->nextslot)
+		return;
+
+	c->nextslot->refs--;
+	c->nextslot = NULL;
+}
+
+void DetachStream(client_t *c)
+{
+	stream_t *st = c->stream;
+
+	if (!st)
+		return;
+
+	StreamRelease(c);
+
+	// Stop waiting on any reads, the client is going away.
+	for (int i = 0; i < STREAM_BLOCKS; i++)
+		vec_remove(&st->blocks[i].waiters, c);
+
+	c->stream = NULL;
+	c->nextpending = 0;
+	st->clients--;
+
+	ReleaseStream(st);
+}
+
+// Hand a finished block to a client.
+static void GiveBlock(client_t *c, streamblock_t *b)
+{
+	b->refs++;
+	c->nextslot    = b;
+	c->nextlen     = b->len;
+	c->nextpending = 0;
+	NextBlockReady(c);
+}
+
+static void StreamReadComplete(iorequest_t *req)
+{
+	streamblock_t *b = req->data;
+	stream_t *st = b->stream;
+	client_t *c;
+	int idx;
+
+	st->iopending--;
+
+	// Take the waiters, giving them the block may queue more reads.
+	client_vec_t waiters;
+	memcpy(&waiters, &b->waiters, sizeof(client_vec_t));
+	vec_init(&b->waiters);
+
+	if (req->result == -1)
+	{
+		b->state = SB_EMPTY;
+
+		vec_foreach(&waiters, c, idx)
+		{
+			c->nextpending = 0;
+			Error(c, ERROR_UNDEFINED, "Cannot read file: %s", strerror(req->error));
+		}
+	}
+	else
+	{
+		b->len = req->result;
+		b->state = SB_READY;
+
+		vec_foreach(&waiters, c, idx)
+			GiveBlock(c, b);
+	}
+
+	vec_deinit(&waiters);
+
+	ReleaseStream(st);
+}
+
+// Get the client's next block from its stream. Returns 0 if the block was
+// ready or is on its way, -1 if the ring is full of blocks other clients
+// still need and the client has to read this one for itself.
+int StreamFetch(client_t *c)
+{
+	stream_t *st = c->stream;
+	assert(st);
+
+	uint64_t index = c->offset / st->blksize;
+	streamblock_t *b = &st->blocks[index % STREAM_BLOCKS];
+
+	if (b->index == index && b->state == SB_READY)
+	{
+		sharedhits++;
+		GiveBlock(c, b);
+		return 0;
+	}
+
+	// Someone else already asked for it, wait with them.
+	if (b->index == index && b->state == SB_READING)
+	{
+		sharedhits++;
+		c->nextpending = 1;
+		vec_push(&b->waiters, c);
+		return 0;
+	}
+
+	// The slot has a different block in it that somebody still needs.
+	if (b->state == SB_READING || b->refs)
+		return -1;
+
+	if (!b->data)
+		b->data = nmalloc(st->blksize);
+
+	b->index = index;
+	b->state = SB_READING;
+	b->len = 0;
+	vec_push(&b->waiters, c);
+
+	iorequest_t *req = &b->req;
+	req->buf      = b->data;
+	req->len      = st->blksize;
+	req->offset   = index * st->blksize;
+	req->complete = StreamReadComplete;
+	req->data     = b;
+
+	diskreads++;
+	st->iopending++;
+	c->nextpending = 1;
+	VFSRead(st->file, req);
+
+	return 0;
+}
+
+void PrintStreamStatistics(void)
+{
+	uint64_t total = diskreads + sharedhits;
+
+	printf("Shared streams: %d active, %lu blocks read from disk, %lu blocks shared (%.1f%% shared)\n",
+	       streams.length, (unsigned long)diskreads, (unsigned long)sharedhits,
+	       total ? (sharedhits * 100.0) / total : 0.0);
+}
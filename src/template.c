@@ -0,0 +1,808 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "template.h"
+#include "config.h"
+#include "misc.h"
+#include "timer.h"
+#include "vec.h"
+#include "vfs.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+// Boot configs rendered per client. Provisioning tools end up writing a
+// pxelinux.cfg/01-<mac> (or an iPXE script, or a kickstart) for every
+// machine which differ only in a hostname or two. A template block serves
+// requests matching a pattern from one template instead, filling in
+// ${variables} from the request path, the client's address and a data file.
+//
+// Every client rebooting at once asks for the same few files, so what we
+// render is kept keyed by the values that went into it and served out of
+// memory (it's a VFS_MAPPED backend) until the template or data file changes.
+
+// How often we look at the template and data files to see if they changed.
+#define TEMPLATE_RECHECK SECONDS
+
+// When we last looked at a file and what it looked like.
+typedef struct filestamp_s
+{
+	uint64_t checked;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+} filestamp_t;
+
+// A template is literal text and ${variables} in between.
+typedef struct segment_s
+{
+	// The text, or the name of the variable if var is set.
+	char *text;
+	size_t len;
+	uint8_t var;
+} segment_t;
+
+typedef struct variable_s
+{
+	char *name, *value;
+} variable_t;
+
+// A line of a data file, the variables for whoever key is.
+typedef struct dataentry_s
+{
+	char *key;
+	vec_t(variable_t) vars;
+} dataentry_t;
+
+typedef struct datafile_s
+{
+	char *path;
+	filestamp_t stamp;
+	vec_t(dataentry_t*) entries;
+} datafile_t;
+
+typedef struct rendered_s rendered_t;
+
+typedef struct template_s
+{
+	char *path;
+	filestamp_t stamp;
+	vec_t(segment_t) segments;
+	// How many renders of it are cached, and which data file they were rendered with.
+	int cached;
+	datafile_t *data;
+} template_t;
+
+struct rendered_s
+{
+	// NULL once it's been thrown out of the cache, the last
+	// client reading it frees it.
+	template_t *tmpl;
+	// The values of the template's variables, one after the other.
+	uint64_t hash;
+	char *key;
+	size_t keylen;
+	uint8_t *buf;
+	size_t len;
+	int refs;
+	// Its bucket and the next render in it, and its neighbours
+	// in order of when they were last opened.
+	rendered_t *hnext, *prev, *next;
+};
+
+// What we know about the client asking.
+typedef struct request_s
+{
+	const char *path, *name;
+	char mac[18], uuid[37], ip[INET6_ADDRSTRLEN];
+	// Its entries in the data file, the defaults ("*") last.
+	dataentry_t *entries[4];
+	int nentries;
+} request_t;
+
+static vec_t(template_t*) templates;
+static vec_t(datafile_t*) datafiles;
+static rendered_t *buckets[TEMPLATE_BUCKETS];
+static rendered_t *newest, *oldest;
+static size_t cachedbytes;
+static uint64_t hits, renders;
+
+static char *ReadFile(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	char *buf = NULL;
+	size_t alloc = 0;
+	*len = 0;
+
+	do
+	{
+		alloc = alloc ? alloc * 2 : 4096;
+		buf = realloc(buf, alloc + 1);
+		*len += fread(buf + *len, 1, alloc - *len, f);
+	} while (*len == alloc);
+
+	int error = ferror(f);
+	fclose(f);
+
+	if (error)
+	{
+		free(buf);
+		errno = EIO;
+		return NULL;
+	}
+
+	buf[*len] = 0;
+	return buf;
+}
+
+// Returns 1 if the file at path isn't what it was when stamp was taken,
+// 0 if it is (or we looked at it too recently to bother), -1 if it's gone.
+static int FileChanged(const char *path, filestamp_t *stamp)
+{
+	uint64_t now = MonotonicTime();
+	if (stamp->checked && now - stamp->checked < TEMPLATE_RECHECK)
+		return 0;
+
+	struct stat sb;
+	if (stat(path, &sb) == -1)
+	{
+		stamp->checked = 0;
+		return -1;
+	}
+
+	stamp->checked = now;
+
+	if (sb.st_dev == stamp->dev && sb.st_ino == stamp->ino && sb.st_size == stamp->size &&
+	    sb.st_mtim.tv_sec == stamp->mtime.tv_sec && sb.st_mtim.tv_nsec == stamp->mtime.tv_nsec)
+		return 0;
+
+	stamp->dev   = sb.st_dev;
+	stamp->ino   = sb.st_ino;
+	stamp->size  = sb.st_size;
+	stamp->mtime = sb.st_mtim;
+	return 1;
+}
+
+static void FreeRendered(rendered_t *r)
+{
+	free(r->key);
+	free(r->buf);
+	free(r);
+}
+
+static void Unlink(rendered_t *r)
+{
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		newest = r->next;
+
+	if (r->next)
+		r->next->prev = r->prev;
+	else
+		oldest = r->prev;
+
+	r->prev = r->next = NULL;
+}
+
+static void MakeNewest(rendered_t *r)
+{
+	r->next = newest;
+	if (newest)
+		newest->prev = r;
+	else
+		oldest = r;
+	newest = r;
+}
+
+// Throw r out of the cache.
+static void Evict(rendered_t *r)
+{
+	rendered_t **p = &buckets[r->hash % TEMPLATE_BUCKETS];
+	while (*p != r)
+		p = &(*p)->hnext;
+	*p = r->hnext;
+
+	Unlink(r);
+	cachedbytes -= r->len;
+	r->tmpl->cached--;
+	r->tmpl = NULL;
+
+	if (!r->refs)
+		FreeRendered(r);
+}
+
+static void FlushTemplate(template_t *t)
+{
+	rendered_t *r, *next;
+
+	for (r = newest; r && t->cached; r = next)
+	{
+		next = r->next;
+		if (r->tmpl == t)
+			Evict(r);
+	}
+}
+
+// Make room for what we just rendered by dropping whatever
+// nobody's reading that was used the longest time ago.
+static void TrimCache(void)
+{
+	rendered_t *r, *prev;
+
+	for (r = oldest; r && cachedbytes > TEMPLATE_CACHE; r = prev)
+	{
+		prev = r->prev;
+		if (!r->refs)
+			Evict(r);
+	}
+}
+
+// Split the template into segments. ${name} is a variable, $$ is a $.
+static void ParseTemplate(template_t *t, const char *text, size_t len)
+{
+	const char *p = text, *end = text + len, *lit = text;
+
+	#define LITERAL(upto) \
+		if ((upto) > lit) \
+		{ \
+			segment_t s = { strndup(lit, (upto) - lit), (upto) - lit, 0 }; \
+			vec_push(&t->segments, s); \
+		}
+
+	while ((p = memchr(p, '$', end - p)))
+	{
+		if (p + 1 < end && p[1] == '$')
+		{
+			// Keep the first $ with the text before it, skip the second.
+			LITERAL(p + 1);
+			lit = p += 2;
+			continue;
+		}
+
+		const char *close;
+		if (p + 1 < end && p[1] == '{' && (close = memchr(p + 2, '}', end - p - 2)) && close > p + 2)
+		{
+			LITERAL(p);
+			segment_t s = { strndup(p + 2, close - p - 2), close - p - 2, 1 };
+			vec_push(&t->segments, s);
+			lit = p = close + 1;
+			continue;
+		}
+
+		p++;
+	}
+
+	LITERAL(end);
+	#undef LITERAL
+}
+
+static void ClearTemplate(template_t *t)
+{
+	segment_t s;
+	int i;
+
+	vec_foreach(&t->segments, s, i)
+		free(s.text);
+	vec_clear(&t->segments);
+}
+
+static void ClearDataFile(datafile_t *d)
+{
+	dataentry_t *e;
+	variable_t v;
+	int i, j;
+
+	vec_foreach(&d->entries, e, i)
+	{
+		vec_foreach(&e->vars, v, j)
+		{
+			free(v.name);
+			free(v.value);
+		}
+		vec_deinit(&e->vars);
+		free(e->key);
+		free(e);
+	}
+	vec_clear(&d->entries);
+}
+
+// Parse a MAC written as six pairs of hex digits separated by ':', '-'
+// or nothing at all into mac as aa:bb:cc:dd:ee:ff. Returns 1 if it was one.
+static int ParseMAC(const char *p, char *out)
+{
+	char mac[18], sep = 0;
+
+	for (int i = 0; i < 6; i++)
+	{
+		if (i == 1 && (*p == ':' || *p == '-'))
+			sep = *p;
+
+		if (i && sep && *p++ != sep)
+			return 0;
+
+		if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+			return 0;
+
+		mac[i * 3]     = tolower((unsigned char)p[0]);
+		mac[i * 3 + 1] = tolower((unsigned char)p[1]);
+		mac[i * 3 + 2] = i < 5 ? ':' : 0;
+		p += 2;
+	}
+
+	// Part of some longer string of hex.
+	if (isxdigit((unsigned char)*p) || (sep && *p == sep))
+		return 0;
+
+	memcpy(out, mac, sizeof(mac));
+	return 1;
+}
+
+// Parse a UUID (8-4-4-4-12 hex digits) into uuid, lowercased.
+static int ParseUUID(const char *p, char *out)
+{
+	char uuid[37];
+
+	for (int i = 0; i < 36; i++)
+	{
+		if (i == 8 || i == 13 || i == 18 || i == 23)
+		{
+			if (p[i] != '-')
+				return 0;
+		}
+		else if (!isxdigit((unsigned char)p[i]))
+			return 0;
+
+		uuid[i] = tolower((unsigned char)p[i]);
+	}
+
+	uuid[36] = 0;
+	if (isxdigit((unsigned char)p[36]) || p[36] == '-')
+		return 0;
+
+	memcpy(out, uuid, sizeof(uuid));
+	return 1;
+}
+
+// Does str have a UUID or MAC in it? Look at the start of every run of hex.
+static int FindIn(const char *str, int (*parse)(const char *, char *), char *out)
+{
+	for (const char *p = str; *p; p++)
+	{
+		if ((p == str || !isxdigit((unsigned char)p[-1])) && parse(p, out))
+			return 1;
+	}
+
+	return 0;
+}
+
+// Data files have one client per line, who it is (a MAC, a UUID, an
+// address, or * for everyone) and then name=value pairs. Values with
+// spaces in them go in double quotes. # starts a comment.
+static void ParseDataFile(datafile_t *d, char *text)
+{
+	char *line, *next;
+	int lineno = 0;
+
+	for (line = text; line; line = next)
+	{
+		lineno++;
+		if ((next = strchr(line, '\n')))
+			*next++ = 0;
+
+		char *p = line + strspn(line, " \t\r");
+		if (!*p || *p == '#')
+			continue;
+
+		size_t keylen = strcspn(p, " \t\r");
+		dataentry_t *e = nmalloc(sizeof(dataentry_t));
+		char key[37];
+
+		// Write addresses the same way the request's are so they can be compared.
+		if (ParseMAC(p, key) && (keylen == 12 || keylen == 17))
+			e->key = strdup(key);
+		else if (ParseUUID(p, key) && keylen == 36)
+			e->key = strdup(key);
+		else
+			e->key = strndup(p, keylen);
+
+		vec_init(&e->vars);
+		vec_push(&d->entries, e);
+
+		for (p += keylen;;)
+		{
+			p += strspn(p, " \t\r");
+			if (!*p || *p == '#')
+				break;
+
+			char *eq = p + strcspn(p, "= \t\r");
+			if (*eq != '=' || eq == p)
+			{
+				fprintf(stderr, "%s:%d: expected name=value\n", d->path, lineno);
+				break;
+			}
+
+			variable_t v;
+			v.name = strndup(p, eq - p);
+			p = eq + 1;
+
+			if (*p == '"')
+			{
+				char *q = strchr(++p, '"');
+				if (!q)
+					q = p + strlen(p);
+				v.value = strndup(p, q - p);
+				p = *q ? q + 1 : q;
+			}
+			else
+			{
+				size_t len = strcspn(p, " \t\r");
+				v.value = strndup(p, len);
+				p += len;
+			}
+
+			vec_push(&e->vars, v);
+		}
+	}
+}
+
+// Reread the data file if it changed. Returns 1 if it did.
+static int RefreshDataFile(datafile_t *d)
+{
+	int changed = FileChanged(d->path, &d->stamp);
+	if (!changed)
+		return 0;
+
+	size_t len;
+	char *text = changed == 1 ? ReadFile(d->path, &len) : NULL;
+
+	ClearDataFile(d);
+
+	if (!text)
+		fprintf(stderr, "Failed to read template data %s: %s\n", d->path, strerror(errno));
+	else
+	{
+		ParseDataFile(d, text);
+		free(text);
+	}
+
+	return 1;
+}
+
+static datafile_t *GetDataFile(const char *path)
+{
+	datafile_t *d;
+	int i;
+
+	vec_foreach(&datafiles, d, i)
+	{
+		if (!strcmp(d->path, path))
+			return d;
+	}
+
+	d = nmalloc(sizeof(datafile_t));
+	d->path = strdup(path);
+	vec_init(&d->entries);
+	vec_push(&datafiles, d);
+	return d;
+}
+
+// Reread the template if it changed, dropping everything rendered from it.
+static int RefreshTemplate(template_t *t)
+{
+	int changed = FileChanged(t->path, &t->stamp);
+	if (!changed)
+		return 0;
+
+	FlushTemplate(t);
+	ClearTemplate(t);
+
+	size_t len;
+	char *text = changed == 1 ? ReadFile(t->path, &len) : NULL;
+	if (!text)
+	{
+		int saved = errno;
+		fprintf(stderr, "Failed to read template %s: %s\n", t->path, strerror(errno));
+		t->stamp.checked = 0;
+		errno = saved;
+		return -1;
+	}
+
+	ParseTemplate(t, text, len);
+	free(text);
+	return 0;
+}
+
+static template_t *GetTemplate(const char *path)
+{
+	template_t *t;
+	int i;
+
+	vec_foreach(&templates, t, i)
+	{
+		if (!strcmp(t->path, path))
+			return t;
+	}
+
+	t = nmalloc(sizeof(template_t));
+	t->path = strdup(path);
+	vec_init(&t->segments);
+	vec_push(&templates, t);
+	return t;
+}
+
+static const char *Lookup(const request_t *rq, const char *name)
+{
+	if (!strcmp(name, "path"))
+		return rq->path;
+	if (!strcmp(name, "name"))
+		return rq->name;
+	if (!strcmp(name, "mac"))
+		return rq->mac;
+	if (!strcmp(name, "uuid"))
+		return rq->uuid;
+	if (!strcmp(name, "ip"))
+		return rq->ip;
+
+	for (int i = 0; i < rq->nentries; i++)
+	{
+		variable_t v;
+		int j;
+
+		vec_foreach(&rq->entries[i]->vars, v, j)
+		{
+			if (!strcmp(v.name, name))
+				return v.value;
+		}
+	}
+
+	// Unknown variables are just empty.
+	return "";
+}
+
+static dataentry_t *FindEntry(datafile_t *d, const char *key)
+{
+	dataentry_t *e;
+	int i;
+
+	if (!*key)
+		return NULL;
+
+	vec_foreach(&d->entries, e, i)
+	{
+		if (!strcasecmp(e->key, key))
+			return e;
+	}
+
+	return NULL;
+}
+
+// Work out everything the template could ask about this client.
+static void DescribeRequest(request_t *rq, const char *path, const socketstructs_t *peer, datafile_t *d)
+{
+	memset(rq, 0, sizeof(request_t));
+	rq->path = path;
+	rq->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+	// pxelinux asks for 01-aa-bb-cc-dd-ee-ff, 01 being the ARP hardware type.
+	// A UUID is checked for first so we don't take the end of one for a MAC.
+	if (!FindIn(rq->name, ParseUUID, rq->uuid) && !FindIn(path, ParseUUID, rq->uuid) &&
+	    !(!strncmp(rq->name, "01-", 3) && ParseMAC(rq->name + 3, rq->mac)))
+		FindIn(path, ParseMAC, rq->mac);
+
+	if (peer->sa.sa_family == AF_INET)
+		inet_ntop(AF_INET, &peer->in.sin_addr, rq->ip, sizeof(rq->ip));
+	else if (IN6_IS_ADDR_V4MAPPED(&peer->in6.sin6_addr))
+		inet_ntop(AF_INET, &peer->in6.sin6_addr.s6_addr[12], rq->ip, sizeof(rq->ip));
+	else
+		inet_ntop(AF_INET6, &peer->in6.sin6_addr, rq->ip, sizeof(rq->ip));
+
+	if (!d)
+		return;
+
+	const char *keys[] = { rq->mac, rq->uuid, rq->ip, "*" };
+	for (int i = 0; i < 4; i++)
+	{
+		dataentry_t *e = FindEntry(d, keys[i]);
+		if (e)
+			rq->entries[rq->nentries++] = e;
+	}
+}
+
+// FNV-1a, different for each template.
+static uint64_t Hash(template_t *t, const char *buf, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL ^ (uintptr_t)t;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (uint8_t)buf[i]) * 1099511628211ULL;
+
+	return h;
+}
+
+static rendered_t *Render(template_t *t, const request_t *rq)
+{
+	segment_t s;
+	size_t keylen = 0, len = 0;
+	int i;
+
+	// The key is the value of every variable in the template, it's all
+	// that can make one client's copy differ from another's.
+	vec_foreach(&t->segments, s, i)
+	{
+		if (s.var)
+			keylen += strlen(Lookup(rq, s.text)) + 1;
+	}
+
+	char *key = nmalloc(keylen + 1), *kp = key;
+	vec_foreach(&t->segments, s, i)
+	{
+		if (s.var)
+			kp = stpcpy(kp, Lookup(rq, s.text)) + 1;
+	}
+
+	uint64_t hash = Hash(t, key, keylen);
+	rendered_t **bucket = &buckets[hash % TEMPLATE_BUCKETS], *r;
+
+	for (r = *bucket; r; r = r->hnext)
+	{
+		if (r->hash == hash && r->tmpl == t && r->keylen == keylen && !memcmp(r->key, key, keylen))
+		{
+			free(key);
+			hits++;
+			Unlink(r);
+			MakeNewest(r);
+			return r;
+		}
+	}
+
+	// The values (and their NULs, a few bytes to spare) are in the key
+	// already, copy them from there instead of looking them all up again.
+	vec_foreach(&t->segments, s, i)
+		len += s.var ? 0 : s.len;
+	len += keylen;
+
+	r = nmalloc(sizeof(rendered_t));
+	r->tmpl   = t;
+	r->hash   = hash;
+	r->key    = key;
+	r->keylen = keylen;
+	r->buf    = nmalloc(len + 1);
+
+	uint8_t *out = r->buf;
+	kp = key;
+	vec_foreach(&t->segments, s, i)
+	{
+		if (s.var)
+		{
+			size_t vlen = strlen(kp);
+			memcpy(out, kp, vlen);
+			out += vlen;
+			kp += vlen + 1;
+		}
+		else
+		{
+			memcpy(out, s.text, s.len);
+			out += s.len;
+		}
+	}
+
+	r->len = out - r->buf;
+	r->hnext = *bucket;
+	*bucket = r;
+	MakeNewest(r);
+	cachedbytes += r->len;
+	t->cached++;
+	renders++;
+
+	return r;
+}
+
+static int TemplateOpen(vfile_t *vf, const char *path, const socketstructs_t *peer)
+{
+	conf_template_t *ct, *found = NULL;
+	int i;
+
+	vec_foreach(&config->templateblocks, ct, i)
+	{
+		const char *match = ct->match;
+		while (*match == '/')
+			match++;
+
+		if (fnmatch(match, path, FNM_PATHNAME) == 0)
+		{
+			found = ct;
+			break;
+		}
+	}
+
+	if (!found)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	template_t *t = GetTemplate(found->file);
+	if (RefreshTemplate(t) == -1)
+		return -1;
+
+	// Rendered with different data now, or the data changed.
+	datafile_t *d = found->data ? GetDataFile(found->data) : NULL;
+	if ((d && RefreshDataFile(d)) || t->data != d)
+	{
+		FlushTemplate(t);
+		t->data = d;
+	}
+
+	request_t rq;
+	DescribeRequest(&rq, path, peer, d);
+
+	rendered_t *r = Render(t, &rq);
+	r->refs++;
+
+	vf->size = r->len;
+	vf->map  = r->buf;
+	vf->data = r;
+
+	TrimCache();
+	return 0;
+}
+
+static void TemplateRead(vfile_t *vf, iorequest_t *req)
+{
+	// Never called, VFSRead copies out of the map.
+	req->result = -1;
+	req->error = EIO;
+	req->complete(req);
+}
+
+static void TemplateClose(vfile_t *vf)
+{
+	rendered_t *r = vf->data;
+	if (!r)
+		return;
+
+	if (!--r->refs && !r->tmpl)
+		FreeRendered(r);
+}
+
+static const backend_t templatebackend = {
+	"template", VFS_MAPPED,
+	TemplateOpen, NULL, TemplateRead, NULL, NULL, TemplateClose
+};
+
+void InitializeTemplates(void)
+{
+	vec_init(&templates);
+	vec_init(&datafiles);
+	RegisterBackend(&templatebackend);
+}
+
+void PrintTemplateStatistics(void)
+{
+	if (!renders)
+		return;
+
+	printf("Templates: %lu rendered, %lu served from cache, %s cached\n",
+	       (unsigned long)renders, (unsigned long)hits, SizeReduce(cachedbytes));
+}
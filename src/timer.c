@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "timer.h"
+#include "socket.h"
+#include "misc.h"
+#include "vec.h"
+#include "sysconf.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_TIMERFD
+# include <sys/timerfd.h>
+#endif
+
+// Timers for things which can't wait for readtimeout to come around, like
+// retransmits and spacing out windows. Pending timers are kept sorted by
+// when they're due. Where we have timerfd the multiplexer wakes us up when
+// the first one is due, otherwise they are checked every time around the
+// main loop (which means they're only as accurate as the readtimeout).
+
+static vec_t(timerevent_t*) timers;
+
+#ifdef HAVE_TIMERFD
+static int timerfd = -1;
+#endif
+
+uint64_t MonotonicTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * SECONDS + ts.tv_nsec;
+}
+
+// Make the timer descriptor go off when the first timer is due.
+static void UpdateTimerfd(void)
+{
+#ifdef HAVE_TIMERFD
+	if (timerfd == -1)
+		return;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(struct itimerspec));
+
+	// Leaving it zeroed disarms it.
+	if (timers.length)
+	{
+		uint64_t when = timers.data[0]->when;
+		// Zero would disarm it, make sure something is set.
+		if (!when)
+			when = 1;
+
+		its.it_value.tv_sec = when / SECONDS;
+		its.it_value.tv_nsec = when % SECONDS;
+	}
+
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+void CancelTimer(timerevent_t *t)
+{
+	assert(t);
+
+	if (!t->armed)
+		return;
+
+	int first = timers.length && timers.data[0] == t;
+
+	vec_remove(&timers, t);
+	t->armed = 0;
+
+	if (first)
+		UpdateTimerfd();
+}
+
+// Run the timer's callback delay nanoseconds from now, if it was
+// already armed it is moved.
+void ArmTimer(timerevent_t *t, uint64_t delay)
+{
+	assert(t && t->callback);
+
+	CancelTimer(t);
+
+	t->when = MonotonicTime() + delay;
+	t->armed = 1;
+
+	// Keep them sorted, there's only ever about one per client.
+	int idx = timers.length;
+	while (idx > 0 && timers.data[idx - 1]->when > t->when)
+		idx--;
+
+	vec_insert(&timers, idx, t);
+
+	if (idx == 0)
+		UpdateTimerfd();
+}
+
+void RunTimers(void)
+{
+	uint64_t now = MonotonicTime();
+
+	while (timers.length && timers.data[0]->when <= now)
+	{
+		timerevent_t *t = timers.data[0];
+		vec_splice(&timers, 0, 1);
+		t->armed = 0;
+
+		// This can arm more timers (even this one).
+		t->callback(t);
+	}
+
+	UpdateTimerfd();
+}
+
+#ifdef HAVE_TIMERFD
+static int TimerfdReady(socket_t s)
+{
+	uint64_t expirations;
+	read(s.fd, &expirations, sizeof(uint64_t));
+
+	RunTimers();
+
+	return 0;
+}
+#endif
+
+int InitializeTimers(void)
+{
+#ifdef HAVE_TIMERFD
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerfd == -1)
+	{
+		fprintf(stderr, "Failed to create timer descriptor: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (AddHandlerSocket(timerfd, TimerfdReady, NULL, NULL, NULL) == -1)
+	{
+		fprintf(stderr, "Failed to add timer descriptor to the multiplexer!\n");
+		close(timerfd);
+		timerfd = -1;
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+void ShutdownTimers(void)
+{
+	vec_deinit(&timers);
+
+#ifdef HAVE_TIMERFD
+	socket_t s;
+	if (timerfd != -1 && FindSocket(timerfd, &s) == 0)
+		DestroySocket(s, 1);
+
+	timerfd = -1;
+#endif
+}
@@ -0,0 +1,1349 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "upstream.h"
+#include "config.h"
+#include "misc.h"
+#include "sysconf.h"
+#include "timer.h"
+#include "vec.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// Pull-through caching from an HTTP origin. Files under an upstream
+// block's path come from the origin the first time they're asked for and
+// are kept in a cache directory after that, checked against the origin
+// with If-None-Match/If-Modified-Since every so often.
+//
+// Each fetch runs on a thread of its own, writing to the cache as the body
+// comes in. Clients are sent what's there already and reads past that wait
+// for the fetch thread to get to them, so nobody waits for the whole file.
+// Everyone asking for something already on its way gets the same fetch.
+// Finished files are mapped and sent straight out of memory.
+//
+// Before we can say we have a file we need the origin's answer (and how
+// big it is). Opens from VFSOpenAsync don't wait for it, they're parked
+// on the object and handed back to the event loop once the answer is in,
+// anyone else waits UPSTREAM_WAIT at most. An origin that can't be
+// reached is left alone for UPSTREAM_RETRY seconds, opens in the meantime
+// get our old copy or fail straight away.
+//
+// Peers (see peer.c) fetch from each other the same way, through origins
+// of their own without a path or a cache directory. What they fetch is
+// kept in memory, and let go of (least recently used first) once there's
+// more than UPSTREAM_MEMORY of it that nobody has open.
+//
+// We keep track of UPSTREAM_OBJECTS files at most, forgetting the least
+// recently used that nobody has open beyond that (what's in the cache
+// directory is picked up again next time), and run UPSTREAM_FETCHES
+// fetches at once with the rest waiting their turn.
+
+// An upstream block, with the URL taken apart. Opened by name
+// only if there's no path, in memory only if there's no cache.
+struct origin_s
+{
+	char *path, *url;
+	size_t pathlen;
+	char *host, *port, *base;
+	char *cache;
+	// How long opening a file waits for the origin to answer.
+	uint64_t revalidate, timeout, wait;
+	// Not asked again until then after it couldn't be reached.
+	uint64_t retry;
+	originstats_t stats;
+};
+
+// One version of a file, complete or still coming in.
+typedef struct content_s
+{
+	int refs;
+	int fd;
+	// Who it is for shared streams.
+	uint64_t id;
+	// size is known once we have it, have is how much is in the cache so far.
+	uint64_t size, have;
+	int complete, failed, error;
+	// Counted in what we have in memory.
+	int memory;
+	uint8_t *map;
+	// Reads of what isn't here yet.
+	vec_t(iorequest_t*) waiting;
+} content_t;
+
+typedef struct object_s
+{
+	origin_t *origin;
+	// Where it is under the origin, and where we keep it.
+	char *name, *datapath, *metapath;
+	// What we're serving and the validators the origin gave us for it.
+	content_t *cur;
+	char *etag, *lastmod;
+	uint64_t validated;
+	// A fetch is on its way, and what the last one said (0 for no answer).
+	int fetching, status, error;
+	int sock;
+	// Opens waiting for the answer (see VFSOpenAsync), and the ones
+	// handed back with it that haven't come back for it yet.
+	vec_t(iorequest_t*) parked, back;
+	// A fetch thread has it.
+	int busy;
+	// Its bucket and the next object in it, and its neighbours
+	// in order of when they were last opened.
+	uint64_t hash;
+	struct object_s *hnext, *prev, *next;
+} object_t;
+
+typedef struct reader_s
+{
+	int fd;
+	char buf[UPSTREAM_HEADERS];
+	size_t pos, len;
+} reader_t;
+
+// Everything here is shared with the fetch threads.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_cond_t changed;
+static vec_t(origin_t*) origins;
+// Everything we keep track of by name, and most recently opened first.
+static object_t *buckets[UPSTREAM_OBJECTS];
+static object_t *newest, *oldest;
+static int nobjects;
+// Fetches waiting for a thread.
+static vec_t(object_t*) queued;
+static uint64_t nextid;
+static int threads, stopping;
+static uint64_t inmemory;
+
+static void Unref(content_t *ct)
+{
+	if (!ct || --ct->refs)
+		return;
+
+	if (ct->memory)
+		inmemory -= ct->size;
+	if (ct->map)
+		munmap(ct->map, ct->size);
+	if (ct->fd != -1)
+		close(ct->fd);
+	vec_deinit(&ct->waiting);
+	free(ct);
+}
+
+static content_t *NewContent(int fd)
+{
+	content_t *ct = nmalloc(sizeof(content_t));
+	ct->refs = 1;
+	ct->fd = fd;
+	ct->id = ++nextid;
+	vec_init(&ct->waiting);
+	return ct;
+}
+
+// Finished files are read straight out of memory.
+static void MapContent(content_t *ct)
+{
+	void *map;
+
+	if (ct->size && (map = mmap(NULL, ct->size, PROT_READ, MAP_SHARED, ct->fd, 0)) != MAP_FAILED)
+		ct->map = map;
+}
+
+// Take the reads that can be done now, the lock must be held.
+static void TakeWaiting(content_t *ct, vec_void_t *ready)
+{
+	for (int i = 0; i < ct->waiting.length; i++)
+	{
+		iorequest_t *req = ct->waiting.data[i];
+		if (ct->complete || ct->failed || req->offset + req->len <= ct->have)
+		{
+			vec_push(ready, req);
+			vec_splice(&ct->waiting, i--, 1);
+		}
+	}
+}
+
+static void ServeWaiting(content_t *ct, vec_void_t *ready)
+{
+	iorequest_t *req;
+	int i;
+
+	vec_foreach(ready, req, i)
+	{
+		ssize_t n = ct->failed ? -1 : pread(ct->fd, req->buf, req->len, req->offset);
+		req->result = n;
+		req->error = ct->failed ? ct->error : n == -1 ? errno : 0;
+		CompleteIO(req);
+	}
+
+	vec_clear(ready);
+}
+
+static void MakeDirs(const char *path)
+{
+	char *p = strdup(path);
+
+	for (char *s = strchr(p + 1, '/'); s; s = strchr(s + 1, '/'))
+	{
+		*s = 0;
+		mkdir(p, 0755);
+		*s = '/';
+	}
+
+	free(p);
+}
+
+static void ReadMeta(object_t *obj)
+{
+	FILE *f = fopen(obj->metapath, "r");
+	char line[1024];
+
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (!strncmp(line, "etag: ", 6))
+			obj->etag = strdup(line + 6);
+		else if (!strncmp(line, "last-modified: ", 15))
+			obj->lastmod = strdup(line + 15);
+	}
+
+	fclose(f);
+}
+
+static void WriteMeta(const char *path, const char *etag, const char *lastmod)
+{
+	char *tmp = stringify("%s.XXXXXX", path);
+	int fd;
+
+	MakeDirs(path);
+
+	if ((fd = mkstemp(tmp)) != -1)
+	{
+		FILE *f = fdopen(fd, "w");
+		if (etag)
+			fprintf(f, "etag: %s\n", etag);
+		if (lastmod)
+			fprintf(f, "last-modified: %s\n", lastmod);
+		fchmod(fd, 0644);
+
+		if (fclose(f) == 0 && rename(tmp, path) == 0)
+		{
+			free(tmp);
+			return;
+		}
+		unlink(tmp);
+	}
+
+	fprintf(stderr, "WARNING: Failed to write %s: %s\n", path, strerror(errno));
+	free(tmp);
+}
+
+// FNV-1a of the name, different for each origin.
+static uint64_t HashName(origin_t *o, const char *name)
+{
+	uint64_t h = 14695981039346656037ULL ^ (uintptr_t)o;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+
+	return h;
+}
+
+// Which of the origin's versions of the file we have, from the validators
+// it gave us for it. 0 if it gave us none.
+static uint64_t Version(object_t *obj)
+{
+	if (!obj->etag && !obj->lastmod)
+		return 0;
+
+	return HashName(NULL, obj->etag ? obj->etag : "") * 1099511628211ULL ^ HashName(NULL, obj->lastmod ? obj->lastmod : "");
+}
+
+static void Unlink(object_t *obj)
+{
+	if (obj->prev)
+		obj->prev->next = obj->next;
+	else
+		newest = obj->next;
+
+	if (obj->next)
+		obj->next->prev = obj->prev;
+	else
+		oldest = obj->prev;
+
+	obj->prev = obj->next = NULL;
+}
+
+static void MakeNewest(object_t *obj)
+{
+	obj->next = newest;
+	if (newest)
+		newest->prev = obj;
+	else
+		oldest = obj;
+	newest = obj;
+}
+
+// Find name or start keeping track of it, the lock must be held.
+static object_t *GetObject(origin_t *o, const char *name)
+{
+	uint64_t hash = HashName(o, name);
+	object_t **bucket = &buckets[hash % UPSTREAM_OBJECTS], *obj;
+
+	for (obj = *bucket; obj; obj = obj->hnext)
+	{
+		if (obj->hash == hash && obj->origin == o && !strcmp(obj->name, name))
+		{
+			Unlink(obj);
+			MakeNewest(obj);
+			return obj;
+		}
+	}
+
+	obj = nmalloc(sizeof(object_t));
+	obj->origin = o;
+	obj->name   = strdup(name);
+	obj->sock   = -1;
+	obj->hash   = hash;
+	obj->hnext  = *bucket;
+	vec_init(&obj->parked);
+	vec_init(&obj->back);
+	*bucket = obj;
+	MakeNewest(obj);
+	nobjects++;
+
+	if (!o->cache)
+		return obj;
+
+	obj->datapath = stringify("%s/data/%s", o->cache, name);
+	obj->metapath = stringify("%s/meta/%s", o->cache, name);
+
+	// Left over from before we started, checked with the origin before it's used.
+	int fd = open(obj->datapath, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if (fd != -1 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode))
+	{
+		obj->cur = NewContent(fd);
+		obj->cur->size = obj->cur->have = sb.st_size;
+		obj->cur->complete = 1;
+		MapContent(obj->cur);
+		ReadMeta(obj);
+	}
+	else if (fd != -1)
+		close(fd);
+
+	return obj;
+}
+
+static void FreeObject(object_t *obj)
+{
+	Unref(obj->cur);
+	vec_deinit(&obj->parked);
+	vec_deinit(&obj->back);
+	free(obj->name);
+	free(obj->datapath);
+	free(obj->metapath);
+	free(obj->etag);
+	free(obj->lastmod);
+	free(obj);
+}
+
+static void DropObject(object_t *obj)
+{
+	object_t **p = &buckets[obj->hash % UPSTREAM_OBJECTS];
+
+	while (*p != obj)
+		p = &(*p)->hnext;
+	*p = obj->hnext;
+
+	Unlink(obj);
+	nobjects--;
+	FreeObject(obj);
+}
+
+// Let go of what nobody has open, oldest first, while there's too much
+// of it in memory or too many of them (the lock must be held).
+static void Trim(void)
+{
+	object_t *obj, *prev;
+
+	for (obj = oldest; obj && (inmemory > UPSTREAM_MEMORY || nobjects > UPSTREAM_OBJECTS); obj = prev)
+	{
+		prev = obj->prev;
+
+		if (obj->busy || obj->fetching || obj->parked.length || (obj->cur && obj->cur->refs > 1))
+			continue;
+
+		if (nobjects > UPSTREAM_OBJECTS || (obj->cur && obj->cur->memory))
+			DropObject(obj);
+	}
+}
+
+// The origin answered, the lock must be held. ct is the new content for a 200.
+static void Answered(object_t *obj, int status, int error, content_t *ct, char **etag, char **lastmod)
+{
+	iorequest_t *req;
+	int i;
+
+	obj->status = status;
+	obj->error = error;
+
+	if (status == 200 || status == 304)
+	{
+		if (status == 200)
+		{
+			Unref(obj->cur);
+			obj->cur = ct;
+			ct->refs++;
+		}
+
+		if (status == 200 || *etag || *lastmod)
+		{
+			free(obj->etag);
+			free(obj->lastmod);
+			obj->etag = *etag;
+			obj->lastmod = *lastmod;
+			*etag = *lastmod = NULL;
+		}
+
+		obj->validated = MonotonicTime();
+	}
+	// Gone from the origin, so gone from here. Not having it
+	// counts as fresh as having it.
+	else if (status == 404 || status == 410)
+	{
+		Unref(obj->cur);
+		obj->cur = NULL;
+		obj->validated = MonotonicTime();
+		if (obj->datapath)
+		{
+			unlink(obj->datapath);
+			unlink(obj->metapath);
+		}
+	}
+
+	obj->fetching = 0;
+	pthread_cond_broadcast(&changed);
+
+	// They open it again and get the answer.
+	vec_foreach(&obj->parked, req, i)
+	{
+		req->result = 0;
+		req->error = 0;
+		vec_push(&obj->back, req);
+		CompleteIO(req);
+	}
+	vec_clear(&obj->parked);
+}
+
+static int Connect(origin_t *o, int *error)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv = { o->timeout / SECONDS, 0 };
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(o->host, o->port, &hints, &res);
+	if (ret)
+	{
+		fprintf(stderr, "Failed to look up %s: %s\n", o->host, gai_strerror(ret));
+		*error = EHOSTUNREACH;
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next)
+	{
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+
+		*error = errno == EINPROGRESS ? ETIMEDOUT : errno;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+static ssize_t Fill(reader_t *r)
+{
+	ssize_t n;
+
+	while ((n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - r->len, 0)) == -1 && errno == EINTR)
+		;
+
+	// Timing out looks like this.
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		errno = ETIMEDOUT;
+	if (n > 0)
+		r->len += n;
+
+	return n;
+}
+
+// The next line without its CRLF, NULL if there isn't one.
+static char *ReadLine(reader_t *r)
+{
+	for (;;)
+	{
+		char *line = r->buf + r->pos, *nl = memchr(line, '\n', r->len - r->pos);
+		if (nl)
+		{
+			*nl = 0;
+			if (nl > line && nl[-1] == '\r')
+				nl[-1] = 0;
+			r->pos = nl + 1 - r->buf;
+			return line;
+		}
+
+		if (r->pos)
+		{
+			memmove(r->buf, line, r->len - r->pos);
+			r->len -= r->pos;
+			r->pos = 0;
+		}
+
+		if (r->len == sizeof(r->buf) || Fill(r) <= 0)
+			return NULL;
+	}
+}
+
+// Up to len bytes of the body, what we buffered reading headers first.
+static ssize_t ReadSome(reader_t *r, uint8_t *buf, size_t len)
+{
+	if (r->pos < r->len)
+	{
+		size_t n = MIN(len, r->len - r->pos);
+		memcpy(buf, r->buf + r->pos, n);
+		r->pos += n;
+		return n;
+	}
+
+	r->pos = r->len = 0;
+
+	ssize_t n;
+	while ((n = recv(r->fd, buf, len, 0)) == -1 && errno == EINTR)
+		;
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		errno = ETIMEDOUT;
+
+	return n;
+}
+
+static char *EncodePath(const char *name)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char *out = nmalloc(strlen(name) * 3 + 1), *o = out;
+
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+	{
+		if (isalnum(*p) || strchr("-._~/", *p))
+			*o++ = *p;
+		else
+		{
+			*o++ = '%';
+			*o++ = hex[*p >> 4];
+			*o++ = hex[*p & 15];
+		}
+	}
+
+	return out;
+}
+
+static int SendAll(int fd, const char *buf)
+{
+	size_t len = strlen(buf);
+
+	while (len)
+	{
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Read the body into ct, giving whoever's waiting their blocks as they
+// come in. Returns 0 or -1 with errno set.
+static int ReadBody(reader_t *r, origin_t *o, content_t *ct, int chunked, int64_t length)
+{
+	size_t bufsize = 64 * 1024;
+	uint8_t *buf = nmalloc(bufsize);
+	vec_void_t ready;
+	uint64_t left = length >= 0 ? (uint64_t)length : UINT64_MAX;
+	int ret = -1;
+
+	vec_init(&ready);
+
+	for (;;)
+	{
+		// Chunked bodies say how much is coming next, 0 is the end.
+		if (chunked)
+		{
+			char *line = ReadLine(r);
+			if (!line)
+				goto end;
+
+			if (!(left = strtoull(line, NULL, 16)))
+			{
+				while ((line = ReadLine(r)) && *line)
+					;
+				break;
+			}
+		}
+
+		while (left)
+		{
+			ssize_t n = ReadSome(r, buf, MIN(bufsize, left));
+			if (n == 0 && length < 0 && !chunked)
+				goto done;
+			if (n <= 0)
+			{
+				if (n == 0)
+					errno = EPIPE;
+				goto end;
+			}
+
+			for (ssize_t w = 0, done; w < n; w += done)
+			{
+				if ((done = pwrite(ct->fd, buf + w, n - w, ct->have + w)) == -1)
+				{
+					if (errno == EINTR)
+						done = 0;
+					else
+						goto end;
+				}
+			}
+
+			if (left != UINT64_MAX)
+				left -= n;
+
+			pthread_mutex_lock(&lock);
+			ct->have += n;
+			o->stats.fetched += n;
+			TakeWaiting(ct, &ready);
+			pthread_mutex_unlock(&lock);
+
+			ServeWaiting(ct, &ready);
+		}
+
+		if (!chunked)
+			break;
+
+		// The CRLF after the chunk.
+		if (!ReadLine(r))
+			goto end;
+	}
+
+done:
+	ret = 0;
+end:
+	free(buf);
+	vec_deinit(&ready);
+	return ret;
+}
+
+// Somewhere to write the body: next to where it goes (part is its
+// name until it's all here), or memory.
+static int CreateContent(object_t *obj, char **part)
+{
+	int fd;
+
+	if (!obj->datapath)
+	{
+#ifdef HAVE_MEMFD_CREATE
+		fd = memfd_create("nbstftp", MFD_CLOEXEC);
+#else
+		char tmp[] = "/tmp/nbstftp.XXXXXX";
+		if ((fd = mkostemp(tmp, O_CLOEXEC)) != -1)
+			unlink(tmp);
+#endif
+		if (fd == -1)
+			fprintf(stderr, "Failed to make room for %s/%s: %s\n", obj->origin->url, obj->name, strerror(errno));
+		return fd;
+	}
+
+	MakeDirs(obj->datapath);
+	*part = stringify("%s.XXXXXX", obj->datapath);
+	if ((fd = mkstemp(*part)) == -1)
+		fprintf(stderr, "Failed to create %s: %s\n", *part, strerror(errno));
+	else
+		fchmod(fd, 0644);
+
+	return fd;
+}
+
+static void Spawn(object_t *obj);
+
+static void *FetchThread(void *arg)
+{
+	object_t *obj = arg;
+	origin_t *o = obj->origin;
+	reader_t *r = nmalloc(sizeof(reader_t));
+	content_t *ct = NULL;
+	char *etag = NULL, *lastmod = NULL, *part = NULL, *line, *request;
+	int status = 0, error = EIO, chunked = 0, answered = 0, reached = 0;
+	int64_t length = -1;
+	vec_void_t ready;
+
+	vec_init(&ready);
+
+	// Signals are for the event loop.
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	char *path = EncodePath(obj->name);
+	pthread_mutex_lock(&lock);
+	request = stringify("GET %s/%s HTTP/1.1\r\nHost: %s%s%s\r\nUser-Agent: nbstftp\r\nConnection: close\r\n%s%s%s%s%s%s\r\n",
+	                    o->base, path, o->host, strcmp(o->port, "80") ? ":" : "", strcmp(o->port, "80") ? o->port : "",
+	                    obj->cur && obj->etag ? "If-None-Match: " : "", obj->cur && obj->etag ? obj->etag : "", obj->cur && obj->etag ? "\r\n" : "",
+	                    obj->cur && obj->lastmod ? "If-Modified-Since: " : "", obj->cur && obj->lastmod ? obj->lastmod : "", obj->cur && obj->lastmod ? "\r\n" : "");
+	pthread_mutex_unlock(&lock);
+	free(path);
+
+	r->fd = Connect(o, &error);
+
+	pthread_mutex_lock(&lock);
+	obj->sock = r->fd;
+	int stop = stopping;
+	pthread_mutex_unlock(&lock);
+
+	if (r->fd == -1 || stop)
+		goto answer;
+
+	if (SendAll(r->fd, request) == -1 || !(line = ReadLine(r)) || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+	{
+		error = errno ? errno : EPROTO;
+		status = 0;
+		goto answer;
+	}
+
+	reached = 1;
+	while ((line = ReadLine(r)) && *line)
+	{
+		char *value = strchr(line, ':');
+		if (!value)
+			continue;
+		*value++ = 0;
+		value += strspn(value, " \t");
+
+		if (!strcasecmp(line, "content-length"))
+			length = strtoll(value, NULL, 10);
+		else if (!strcasecmp(line, "transfer-encoding"))
+			chunked = !!strcasestr(value, "chunked");
+		else if (!strcasecmp(line, "etag"))
+			etag = strdup(value);
+		else if (!strcasecmp(line, "last-modified"))
+			lastmod = strdup(value);
+	}
+
+	if (!line)
+	{
+		error = errno ? errno : EPROTO;
+		status = 0;
+		goto answer;
+	}
+
+	if (status != 200)
+	{
+		if (status != 304 && status != 404 && status != 410)
+			fprintf(stderr, "%s/%s: origin answered %d\n", o->url, obj->name, status);
+		goto answer;
+	}
+
+	// Readers use the same descriptor as we write to.
+	int fd = CreateContent(obj, &part);
+	if (fd == -1)
+	{
+		error = errno;
+		status = 0;
+		goto answer;
+	}
+
+	pthread_mutex_lock(&lock);
+	o->stats.fetches++;
+	ct = NewContent(fd);
+	if (chunked)
+		length = -1;
+	// We have to know how big it is to serve it before it's all here.
+	if (length >= 0)
+	{
+		ct->size = length;
+		Answered(obj, 200, 0, ct, &etag, &lastmod);
+		answered = 1;
+	}
+	pthread_mutex_unlock(&lock);
+
+	int ret = ReadBody(r, o, ct, chunked, length);
+
+	pthread_mutex_lock(&lock);
+	stop = stopping;
+	pthread_mutex_unlock(&lock);
+
+	if (ret == -1 || stop || (length >= 0 && ct->have != (uint64_t)length))
+	{
+		error = ret == -1 ? errno : EPIPE;
+		fprintf(stderr, "Failed to fetch %s/%s: %s\n", o->url, obj->name, strerror(error));
+
+		pthread_mutex_lock(&lock);
+		ct->failed = 1;
+		ct->error = error;
+		if (obj->cur == ct)
+		{
+			Unref(ct);
+			obj->cur = NULL;
+			obj->validated = 0;
+		}
+		TakeWaiting(ct, &ready);
+		if (!answered)
+			Answered(obj, 0, error, NULL, &etag, &lastmod);
+		pthread_mutex_unlock(&lock);
+
+		ServeWaiting(ct, &ready);
+		if (part)
+			unlink(part);
+		answered = 1;
+		goto end;
+	}
+
+	if (part && rename(part, obj->datapath) == -1)
+		fprintf(stderr, "WARNING: Failed to keep %s: %s\n", obj->datapath, strerror(errno));
+	else if (part)
+	{
+		// Answering early gave the validators to the object.
+		pthread_mutex_lock(&lock);
+		char *e = strdup(etag ? etag : obj->etag ? obj->etag : ""), *l = strdup(lastmod ? lastmod : obj->lastmod ? obj->lastmod : "");
+		pthread_mutex_unlock(&lock);
+
+		WriteMeta(obj->metapath, *e ? e : NULL, *l ? l : NULL);
+		free(e);
+		free(l);
+	}
+
+	pthread_mutex_lock(&lock);
+	ct->size = ct->have;
+	ct->complete = 1;
+	if (!part)
+	{
+		ct->memory = 1;
+		inmemory += ct->size;
+	}
+	MapContent(ct);
+	TakeWaiting(ct, &ready);
+	if (!answered)
+		Answered(obj, 200, 0, ct, &etag, &lastmod);
+	pthread_mutex_unlock(&lock);
+
+	ServeWaiting(ct, &ready);
+	answered = 1;
+
+answer:
+	if (!answered)
+	{
+		if (!status)
+			fprintf(stderr, "Failed to fetch %s/%s: %s\n", o->url, obj->name, strerror(error));
+
+		pthread_mutex_lock(&lock);
+		if (status == 304)
+			o->stats.notmodified++;
+		// Don't hold everyone up asking again.
+		if (!status && !reached && !stopping && MonotonicTime() >= o->retry)
+		{
+			fprintf(stderr, "%s can't be reached, leaving it alone for %d seconds\n", o->url, UPSTREAM_RETRY);
+			o->retry = MonotonicTime() + UPSTREAM_RETRY * SECONDS;
+		}
+		Answered(obj, status, error, NULL, &etag, &lastmod);
+		pthread_mutex_unlock(&lock);
+	}
+
+end:
+	pthread_mutex_lock(&lock);
+	obj->sock = -1;
+	obj->busy = 0;
+	Unref(ct);
+	threads--;
+
+	// Our turn is over.
+	if (queued.length && !stopping)
+	{
+		object_t *next = queued.data[0];
+		vec_splice(&queued, 0, 1);
+		Spawn(next);
+	}
+
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+
+	if (r->fd != -1)
+		close(r->fd);
+	vec_deinit(&ready);
+	free(etag);
+	free(lastmod);
+	free(part);
+	free(request);
+	free(r);
+	return NULL;
+}
+
+// The lock must be held.
+static void Spawn(object_t *obj)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	char *none = NULL;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	int ret = pthread_create(&thread, &attr, FetchThread, obj);
+	pthread_attr_destroy(&attr);
+
+	if (ret)
+	{
+		fprintf(stderr, "Failed to fetch %s/%s: %s\n", obj->origin->url, obj->name, strerror(ret));
+		Answered(obj, 0, ret, NULL, &none, &none);
+		return;
+	}
+
+	obj->busy = 1;
+	threads++;
+}
+
+// The lock must be held. Past UPSTREAM_FETCHES at once it waits its turn.
+static void StartFetch(object_t *obj)
+{
+	obj->fetching = 1;
+	obj->status = obj->error = 0;
+	// Anyone still to come back for the last answer gets this one.
+	vec_clear(&obj->back);
+
+	if (threads >= UPSTREAM_FETCHES)
+		vec_push(&queued, obj);
+	else
+		Spawn(obj);
+}
+
+// Open name from o, see upstream.h.
+int OriginOpen(origin_t *o, vfile_t *vf, const char *name)
+{
+	pthread_mutex_lock(&lock);
+
+	object_t *obj = GetObject(o, name);
+	content_t *ct = obj->cur;
+
+	int asked = 0, away = 0, back;
+	uint64_t now = MonotonicTime();
+
+	// Only what we have already, without asking the origin.
+	if (vf->nowait)
+	{
+		if (!obj->fetching && ct && ct->complete)
+			goto have;
+
+		int error = !obj->fetching && !ct && (obj->status == 404 || obj->status == 410)
+		            && now - obj->validated < o->revalidate ? ENOENT : EWOULDBLOCK;
+		Trim();
+		pthread_mutex_unlock(&lock);
+		errno = error;
+		return -1;
+	}
+
+	// What parked opens come back for (counted when they were parked),
+	// however often we revalidate.
+	vec_find(&obj->back, vf->ready, back);
+	if (back != -1)
+	{
+		vec_splice(&obj->back, back, 1);
+		asked = 1;
+	}
+	else if (obj->fetching)
+	{
+		o->stats.coalesced++;
+		asked = 1;
+	}
+	// Still coming in counts as fresh.
+	else if (ct ? !ct->complete || now - obj->validated < o->revalidate
+	            : (obj->status == 404 || obj->status == 410) && now - obj->validated < o->revalidate)
+		o->stats.hits++;
+	// Our copy (if we have one) will have to do until we try it again.
+	else if (now < o->retry)
+	{
+		if (ct)
+			o->stats.stale++;
+		away = 1;
+	}
+	else
+	{
+		StartFetch(obj);
+		asked = 1;
+	}
+
+	// The event loop has better things to do than wait.
+	if (obj->fetching && vf->ready)
+	{
+		vec_push(&obj->parked, vf->ready);
+		pthread_mutex_unlock(&lock);
+		errno = EINPROGRESS;
+		return -1;
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += o->wait / SECONDS;
+	deadline.tv_nsec += o->wait % SECONDS;
+	if (deadline.tv_nsec >= (long)SECONDS)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= SECONDS;
+	}
+
+	while (obj->fetching)
+	{
+		if (pthread_cond_timedwait(&changed, &lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	ct = obj->cur;
+	if (!ct || ct->failed)
+	{
+		int error = obj->fetching ? ETIMEDOUT : obj->status == 404 || obj->status == 410 ? ENOENT
+		          : away ? EHOSTUNREACH : obj->error ? obj->error : EIO;
+		Trim();
+		pthread_mutex_unlock(&lock);
+		errno = error;
+		return -1;
+	}
+
+	// Better an old copy than nothing while the origin is away.
+	if (asked && obj->status != 200 && obj->status != 304)
+	{
+		fprintf(stderr, "Serving our copy of %s/%s, it didn't answer\n", o->url, name);
+		o->stats.stale++;
+	}
+
+have:
+	ct->refs++;
+	vf->data = ct;
+	vf->size = ct->size;
+	vf->map  = ct->map;
+	vf->ino  = ct->id;
+	vf->version = Version(obj);
+
+	Trim();
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static int UpstreamOpen(vfile_t *vf, const char *path, const socketstructs_t *peer)
+{
+	origin_t *o;
+	int i;
+
+	vec_foreach(&origins, o, i)
+	{
+		if (o->path && !strncmp(path, o->path, o->pathlen) && path[o->pathlen] == '/')
+			return OriginOpen(o, vf, path + o->pathlen + 1);
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+void OriginRead(vfile_t *vf, iorequest_t *req)
+{
+	content_t *ct = vf->data;
+
+	pthread_mutex_lock(&lock);
+
+	if (ct->failed)
+	{
+		pthread_mutex_unlock(&lock);
+		req->result = -1;
+		req->error = ct->error;
+		req->complete(req);
+		return;
+	}
+
+	// Not here yet, the fetch thread does it when it is.
+	if (!ct->complete && req->offset + req->len > ct->have)
+	{
+		vec_push(&ct->waiting, req);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	req->op = IO_READ;
+	req->fd = ct->fd;
+	SubmitIO(req);
+}
+
+void OriginClose(vfile_t *vf)
+{
+	pthread_mutex_lock(&lock);
+	Unref(vf->data);
+	Trim();
+	pthread_mutex_unlock(&lock);
+}
+
+static const backend_t upstreambackend = {
+	"upstream", VFS_SHARED | VFS_REMOTE,
+	UpstreamOpen, NULL, OriginRead, NULL, NULL, OriginClose
+};
+
+// Take http://host[:port][/base] apart.
+static int ParseURL(origin_t *o, const char *url)
+{
+	if (strncasecmp(url, "http://", 7))
+		return -1;
+
+	const char *host = url + 7, *end = host + strcspn(host, "/"), *colon;
+
+	// [v6 address]:port
+	if (*host == '[')
+	{
+		const char *close = memchr(host, ']', end - host);
+		if (!close)
+			return -1;
+		o->host = strndup(host + 1, close - host - 1);
+		colon = close[1] == ':' ? close + 1 : NULL;
+	}
+	else
+	{
+		colon = memchr(host, ':', end - host);
+		o->host = strndup(host, (colon ? colon : end) - host);
+	}
+
+	o->port = colon ? strndup(colon + 1, end - colon - 1) : strdup("80");
+	o->base = strdup(end);
+
+	size_t len = strlen(o->base);
+	while (len && o->base[len - 1] == '/')
+		o->base[--len] = 0;
+
+	len = strlen(o->url);
+	while (len && o->url[len - 1] == '/')
+		o->url[--len] = 0;
+
+	return *o->host && *o->port ? 0 : -1;
+}
+
+static void FreeOrigin(origin_t *o)
+{
+	free(o->path);
+	free(o->url);
+	free(o->host);
+	free(o->port);
+	free(o->base);
+	free(o->cache);
+	free(o);
+}
+
+// Waits for answers are timed on the same clock as everything else.
+static void InitializeChanged(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&changed, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static origin_t *AddOrigin(const char *url, const char *cache, uint64_t revalidate, uint64_t timeout, uint64_t wait)
+{
+	origin_t *o = nmalloc(sizeof(origin_t));
+
+	pthread_once(&once, InitializeChanged);
+
+	o->url = strdup(url);
+	o->cache = cache ? strdup(cache) : NULL;
+	o->revalidate = revalidate;
+	o->timeout = timeout;
+	o->wait = wait;
+
+	if (ParseURL(o, url) == -1)
+	{
+		FreeOrigin(o);
+		return NULL;
+	}
+
+	vec_push(&origins, o);
+	return o;
+}
+
+// An origin for someone else to open files from by name, see upstream.h.
+origin_t *NewOrigin(const char *url, const char *cache, uint64_t revalidate, uint64_t timeout, uint64_t wait)
+{
+	origin_t *o = AddOrigin(url, cache, revalidate, timeout, wait);
+
+	if (!o)
+		fprintf(stderr, "Error: %s is not a http:// URL.\n", url);
+
+	return o;
+}
+
+void InitializeUpstreams(void)
+{
+	conf_upstream_t *cu;
+	int i, upstreams = 0;
+
+	vec_foreach(&config->upstreamblocks, cu, i)
+	{
+		const char *path = cu->path;
+		origin_t *o;
+
+		while (*path == '/')
+			path++;
+
+		if (!*path || !(o = AddOrigin(cu->url, cu->cache, cu->revalidate * SECONDS, cu->timeout * SECONDS, UPSTREAM_WAIT)))
+		{
+			fprintf(stderr, "Error: upstream %s for /%s is not a http:// URL under a path, ignoring it.\n", cu->url, path);
+			continue;
+		}
+
+		o->path = strdup(path);
+		o->pathlen = strlen(o->path);
+		while (o->pathlen && o->path[o->pathlen - 1] == '/')
+			o->path[--o->pathlen] = 0;
+
+		printf("Fetching /%s from %s, cached in %s\n", o->path, o->url, o->cache);
+		upstreams++;
+	}
+
+	if (upstreams)
+		RegisterBackend(&upstreambackend);
+}
+
+// Cut off the fetches still going, before the I/O pool and the clients
+// go. Whatever was waiting on them (reads and parked opens) is handed
+// back failed on their way out.
+void StopUpstreams(void)
+{
+	object_t *obj;
+	char *none = NULL;
+	int i;
+
+	if (!origins.length)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+
+	vec_foreach(&queued, obj, i)
+		Answered(obj, 0, ECANCELED, NULL, &none, &none);
+	vec_clear(&queued);
+
+	for (obj = newest; obj; obj = obj->next)
+	{
+		if (obj->sock != -1)
+			shutdown(obj->sock, SHUT_RDWR);
+	}
+
+	while (threads)
+		pthread_cond_wait(&changed, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+// After the clients are gone.
+void ShutdownUpstreams(void)
+{
+	origin_t *o;
+	int i;
+
+	if (!origins.length)
+		return;
+
+	UnregisterBackend(&upstreambackend);
+
+	while (newest)
+		DropObject(newest);
+	vec_deinit(&queued);
+
+	vec_foreach(&origins, o, i)
+		FreeOrigin(o);
+	vec_deinit(&origins);
+}
+
+void GetOriginStatistics(origin_t *o, originstats_t *stats)
+{
+	pthread_mutex_lock(&lock);
+	*stats = o->stats;
+	pthread_mutex_unlock(&lock);
+}
+
+void PrintUpstreamStatistics(void)
+{
+	originstats_t total;
+	origin_t *o;
+	int i, upstreams = 0;
+
+	memset(&total, 0, sizeof(total));
+
+	pthread_mutex_lock(&lock);
+	vec_foreach(&origins, o, i)
+	{
+		if (!o->path)
+			continue;
+
+		total.fetches     += o->stats.fetches;
+		total.fetched     += o->stats.fetched;
+		total.coalesced   += o->stats.coalesced;
+		total.hits        += o->stats.hits;
+		total.notmodified += o->stats.notmodified;
+		total.stale       += o->stats.stale;
+		upstreams++;
+	}
+
+	if (upstreams)
+		printf("Upstream: %lu fetches (%s), %lu joined a fetch, %lu from cache, %lu not modified, %lu stale, %d fetching now\n",
+		       (unsigned long)total.fetches, SizeReduce(total.fetched), (unsigned long)total.coalesced, (unsigned long)total.hits,
+		       (unsigned long)total.notmodified, (unsigned long)total.stale, threads);
+	pthread_mutex_unlock(&lock);
+}
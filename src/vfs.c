@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2014-2015, Justin Crawford <Justasic@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "vfs.h"
+#include "config.h"
+#include "filesystem.h"
+#include "misc.h"
+#include "timer.h"
+#include "vec.h"
+#include "sysconf.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Registered backends (templates and modules), newest first. The served directory
+// (the disk backend below) comes after all of them.
+static vec_t(const backend_t*) backends;
+
+// The directory we serve. Uploads go to a temporary file next to the real
+// one and are renamed into place once they're all there (see uploadsync).
+typedef struct diskfile_s
+{
+	// The directory the upload is in, its temporary name there and
+	// where it goes once it's done.
+	int dirfd;
+	char *tmpname, *path;
+	// Syncing, renaming and syncing the directory are done one after
+	// the other with this, commitreq is told once they're all done.
+	iorequest_t syncreq;
+	iorequest_t *commitreq;
+} diskfile_t;
+
+static int DiskOpen(vfile_t *vf, const char *path, const socketstructs_t *peer)
+{
+	int fd = OpenBeneathRoot(path, O_RDONLY, 0);
+	if (fd == -1)
+		return -1;
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+	{
+		close(fd);
+		errno = ENOENT;
+		return -1;
+	}
+
+	vf->fd   = fd;
+	vf->size = sb.st_size;
+	vf->dev  = sb.st_dev;
+	vf->ino  = sb.st_ino;
+	vf->version = (uint64_t)sb.st_mtim.tv_sec * SECONDS + sb.st_mtim.tv_nsec;
+
+	return 0;
+}
+
+static int DiskCreate(vfile_t *vf, const char *path, uint64_t size)
+{
+	diskfile_t *df = nmalloc(sizeof(diskfile_t));
+
+	// Creating it is our access check, there is no point asking
+	// access() first and racing whatever changes in between.
+	int fd = CreateBeneathRoot(path, 0666, &df->dirfd, &df->tmpname);
+	if (fd == -1)
+	{
+		free(df);
+		return -1;
+	}
+
+	vf->fd   = fd;
+	vf->data = df;
+	df->path = strdup(path);
+
+#ifdef HAVE_FALLOCATE
+	// Knowing how big it will be lets the filesystem lay the file out in
+	// one go instead of growing it a block at a time, and tells us now
+	// rather than halfway through if it won't fit.
+	if (size && fallocate(fd, 0, 0, size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+	{
+		fprintf(stderr, "Failed to allocate %s for %s: %s\n", SizeReduce(size), path, strerror(errno));
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static void DiskRead(vfile_t *vf, iorequest_t *req)
+{
+	req->op = IO_READ;
+	req->fd = vf->fd;
+	SubmitIO(req);
+}
+
+static void DiskWrite(vfile_t *vf, iorequest_t *req)
+{
+	req->op = IO_WRITE;
+	req->fd = vf->fd;
+	SubmitIO(req);
+}
+
+static void DiskSynced(iorequest_t *req);
+
+static void DiskSync(vfile_t *vf, int fd)
+{
+	diskfile_t *df = vf->data;
+	iorequest_t *req = &df->syncreq;
+
+	req->op       = IO_SYNC;
+	req->fd       = fd;
+	req->iov      = NULL;
+	req->complete = DiskSynced;
+	req->data     = vf;
+	SubmitIO(req);
+}
+
+static void DiskCommitted(vfile_t *vf, ssize_t result, int error)
+{
+	diskfile_t *df = vf->data;
+	iorequest_t *req = df->commitreq;
+
+	df->commitreq = NULL;
+	req->result = result;
+	req->error = error;
+	req->complete(req);
+}
+
+// Put the finished upload in place of the file it's replacing.
+static void DiskRename(vfile_t *vf)
+{
+	diskfile_t *df = vf->data;
+
+	if (RenameBeneathRoot(df->dirfd, df->tmpname, df->path) == -1)
+	{
+		fprintf(stderr, "Failed to rename upload to %s: %s\n", df->path, strerror(errno));
+		DiskCommitted(vf, -1, errno);
+		return;
+	}
+
+	free(df->tmpname);
+	df->tmpname = NULL;
+
+	if (config->uploadsync == SYNC_FULL)
+		DiskSync(vf, df->dirfd);
+	else
+		DiskCommitted(vf, 0, 0);
+}
+
+static void DiskSynced(iorequest_t *req)
+{
+	vfile_t *vf = req->data;
+	diskfile_t *df = vf->data;
+
+	if (req->result == -1)
+		DiskCommitted(vf, -1, req->error);
+	// Synced the file, otherwise it was the directory after the rename.
+	else if (df->tmpname)
+		DiskRename(vf);
+	else
+		DiskCommitted(vf, 0, 0);
+}
+
+static void DiskCommit(vfile_t *vf, iorequest_t *req)
+{
+	diskfile_t *df = vf->data;
+
+	df->commitreq = req;
+
+	// The client sent less than it said it would, give back the
+	// rest of what we allocated for it.
+	struct stat sb;
+	if (fstat(vf->fd, &sb) == -1 || ((uint64_t)sb.st_size > req->offset && ftruncate(vf->fd, req->offset) == -1))
+	{
+		DiskCommitted(vf, -1, errno);
+		return;
+	}
+
+	if (config->uploadsync == SYNC_OFF)
+		DiskRename(vf);
+	else
+		DiskSync(vf, vf->fd);
+}
+
+static void DiskClose(vfile_t *vf)
+{
+	diskfile_t *df = vf->data;
+
+	if (vf->fd != -1)
+		close(vf->fd);
+
+	if (!df)
+		return;
+
+	// An upload that never finished, don't leave it lying around.
+	if (df->tmpname)
+	{
+		unlinkat(df->dirfd, df->tmpname, 0);
+		free(df->tmpname);
+	}
+
+	if (df->dirfd != -1)
+		close(df->dirfd);
+
+	free(df->path);
+	free(df);
+}
+
+static const backend_t disk = {
+	"disk", VFS_SHARED | VFS_WRITABLE,
+	DiskOpen, DiskCreate, DiskRead, DiskWrite, DiskCommit, DiskClose
+};
+
+void RegisterBackend(const backend_t *b)
+{
+	assert(b && b->open && b->read && b->close);
+	assert(!(b->caps & VFS_WRITABLE) || (b->create && b->write && b->commit));
+
+	vec_insert(&backends, 0, b);
+}
+
+// Files the backend has open keep using it, so don't unload a
+// module until they're closed.
+void UnregisterBackend(const backend_t *b)
+{
+	vec_remove(&backends, b);
+}
+
+// Find the backend for path and have it open or create the file,
+// skipping backends with any of the exclude caps.
+static vfile_t *Open(const char *path, const socketstructs_t *peer, int create, uint64_t size, int exclude, iorequest_t *ready, int nowait)
+{
+	// Lots of netboot clients ask for "/pxelinux.0".
+	while (*path == '/')
+		path++;
+
+	// Nothing gets to climb out of the root, whatever the backend.
+	for (const char *p = path; (p = strstr(p, "..")); p += 2)
+	{
+		if ((p == path || p[-1] == '/') && (p[2] == '/' || !p[2]))
+		{
+			errno = EXDEV;
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i <= backends.length; i++)
+	{
+		const backend_t *b = i < backends.length ? backends.data[i] : &disk;
+
+		if ((create && !(b->caps & VFS_WRITABLE)) || b->caps & exclude)
+			continue;
+
+		vfile_t *vf = nmalloc(sizeof(vfile_t));
+		vf->backend = b;
+		vf->refs = 1;
+		vf->fd = -1;
+		vf->ready = ready;
+		vf->nowait = nowait;
+
+		if ((create ? b->create(vf, path, size) : b->open(vf, path, peer)) == 0)
+			return vf;
+
+		// Some backends get part of the way there.
+		int saved = errno;
+		b->close(vf);
+		free(vf);
+		errno = saved;
+
+		if (errno != ENOENT)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+// Open path for peer to read. Returns NULL with errno set if nobody has it.
+vfile_t *VFSOpen(const char *path, const socketstructs_t *peer)
+{
+	assert(path && peer);
+	return Open(path, peer, 0, 0, 0, NULL, 0);
+}
+
+// The same without waiting on the event loop for files from somewhere
+// else. Fails with EINPROGRESS if the file is on its way, ready is
+// completed when it's here and the caller should open it again.
+vfile_t *VFSOpenAsync(const char *path, const socketstructs_t *peer, iorequest_t *ready)
+{
+	assert(path && peer && ready && ready->complete);
+	return Open(path, peer, 0, 0, 0, ready, 0);
+}
+
+// The same but only from what we have here, for peers asking us for it.
+vfile_t *VFSOpenLocal(const char *path, const socketstructs_t *peer, iorequest_t *ready)
+{
+	assert(path && peer && ready && ready->complete);
+	return Open(path, peer, 0, 0, VFS_PEER, ready, 0);
+}
+
+// Or only if it can be opened right away, for getting files ready before
+// anyone asks for them. Fails with EWOULDBLOCK if it'd have to come from
+// somewhere else.
+vfile_t *VFSOpenNoWait(const char *path, const socketstructs_t *peer)
+{
+	assert(path && peer);
+	return Open(path, peer, 0, 0, 0, NULL, 1);
+}
+
+// Start an upload of path, see backend_t's create.
+vfile_t *VFSCreate(const char *path, uint64_t size)
+{
+	assert(path);
+	return Open(path, NULL, 1, size, 0, NULL, 0);
+}
+
+// Streams and multicast groups hold on to the file
+// for as long as they need it, not the client.
+vfile_t *VFSRetain(vfile_t *vf)
+{
+	vf->refs++;
+	return vf;
+}
+
+void VFSClose(vfile_t *vf)
+{
+	if (!vf || --vf->refs)
+		return;
+
+	vf->backend->close(vf);
+	free(vf);
+}
+
+void VFSRead(vfile_t *vf, iorequest_t *req)
+{
+	assert(vf && req && req->complete);
+
+	// No point involving anyone for memory.
+	if (vf->map)
+	{
+		size_t len = req->offset < vf->size ? MIN(req->len, vf->size - req->offset) : 0;
+		memcpy(req->buf, vf->map + req->offset, len);
+		req->result = len;
+		req->error = 0;
+		req->complete(req);
+		return;
+	}
+
+	vf->backend->read(vf, req);
+}
+
+void VFSWrite(vfile_t *vf, iorequest_t *req)
+{
+	assert(vf && req && req->complete);
+	vf->backend->write(vf, req);
+}
+
+void VFSCommit(vfile_t *vf, iorequest_t *req)
+{
+	assert(vf && req && req->complete);
+	vf->backend->commit(vf, req);
+}
@@ -0,0 +1,186 @@
+# Serving files out of tar and cpio archives (archive.c): each kind of
+# archive we understand, archives cut off halfway through a header, and
+# indexes that are out of date or broken.
+#
+#   python3 tests/archive.py path/to/nbstftp
+import io
+import os
+import struct
+import sys
+import tarfile
+import tempfile
+import time
+
+from harness import Check, Get, Server, TFTPError
+
+binary = os.path.abspath(sys.argv[1])
+
+longdir = 'boot/' + 'd' * 120
+files = {
+    'boot/kernel': os.urandom(5000),
+    'boot/empty': b'',
+    longdir + '/long': b'long name\n',
+}
+# Hard links to other files in the archive, by name.
+links = {'boot/linked': 'boot/kernel', longdir + '/linked': longdir + '/long'}
+
+
+def Tar(format):
+    out = io.BytesIO()
+    with tarfile.open(fileobj=out, mode='w', format=format) as t:
+        for name, data in files.items():
+            info = tarfile.TarInfo(name)
+            info.size = len(data)
+            t.addfile(info, io.BytesIO(data))
+        for name, target in links.items():
+            info = tarfile.TarInfo(name)
+            info.type = tarfile.LNKTYPE
+            info.linkname = target
+            t.addfile(info)
+    return out.getvalue()
+
+
+# cpio keeps the data with the last link to it, the others are empty.
+def CpioEntries():
+    inos = {name: i + 1 for i, name in enumerate(files)}
+    entries = [(name, inos[target], 2, b'') for name, target in links.items()]
+    for name, data in files.items():
+        nlink = 2 if name in links.values() else 1
+        entries.append((name, inos[name], nlink, data))
+    return entries + [('TRAILER!!!', 0, 1, b'')]
+
+
+def Newc():
+    out = b''
+    for name, ino, nlink, data in CpioEntries():
+        name = name.encode() + b'\0'
+        out += b'070701' + b''.join(b'%08x' % n for n in (ino, 0o100644, 0, 0, nlink, 0, len(data), 0, 0, 0, 0, len(name), 0))
+        out += name + b'\0' * (-(110 + len(name)) % 4)
+        out += data + b'\0' * (-len(data) % 4)
+    return out + b'\0' * (-len(out) % 512)
+
+
+def Odc():
+    out = b''
+    for name, ino, nlink, data in CpioEntries():
+        name = name.encode() + b'\0'
+        out += b'070707' + b''.join(b'%06o' % n for n in (0, ino, 0o100644, 0, 0, nlink, 0))
+        out += b'%011o%06o%011o' % (0, len(name), len(data)) + name + data
+    return out + b'\0' * (-len(out) % 512)
+
+
+def Archive(work, name, data):
+    path = os.path.join(work, name)
+    with open(path, 'wb') as f:
+        f.write(data)
+    return path
+
+
+def Block(path, under):
+    return 'archive\n{\n\tfile = "%s";\n\tpath = "%s";\n}\n' % (path, under)
+
+
+def Missing(port, name):
+    try:
+        Get(port, name)
+        return False
+    except TFTPError:
+        return True
+
+
+with tempfile.TemporaryDirectory() as work:
+    root = os.path.join(work, 'root')
+    os.mkdir(root)
+
+    kinds = {
+        'gnu': Tar(tarfile.GNU_FORMAT),
+        'pax': Tar(tarfile.PAX_FORMAT),
+        'newc': Newc(),
+        'odc': Odc(),
+    }
+    archives = {kind: Archive(work, kind, data) for kind, data in kinds.items()}
+
+    # Plain ustar has no long names, only ones it can split in two.
+    short = {name: data for name, data in files.items() if name != longdir + '/long'}
+    ustar = io.BytesIO()
+    with tarfile.open(fileobj=ustar, mode='w', format=tarfile.USTAR_FORMAT) as t:
+        for name, data in list(short.items()) + [('boot/' + 'p' * 120 + '/split', b'split\n')]:
+            info = tarfile.TarInfo(name)
+            info.size = len(data)
+            t.addfile(info, io.BytesIO(data))
+    archives['ustar'] = Archive(work, 'ustar', ustar.getvalue())
+
+    # Cut off in the middle of the header after the kernel. A tar archive
+    # keeps what came before it, a cpio archive isn't served at all.
+    gnu = kinds['gnu']
+    second = 512 + ((len(files['boot/kernel']) + 511) & ~511)
+    archives['cuttar'] = Archive(work, 'cuttar', gnu[:second + 100])
+    newc = kinds['newc']
+    archives['cutcpio'] = Archive(work, 'cutcpio', newc[:newc.index(b'boot/empty\0') - 110 + 50])
+
+    blocks = ''.join(Block(path, kind) for kind, path in archives.items())
+    server = Server(binary, work, 'archive', root, blocks)
+
+    try:
+        for kind in kinds:
+            for name, data in files.items():
+                Check(Get(server.port, '%s/%s' % (kind, name)) == data, '%s: %s' % (kind, name[:40]), server)
+            for name, target in links.items():
+                Check(Get(server.port, '%s/%s' % (kind, name)) == files[target], '%s: link %s' % (kind, name[:40]), server)
+
+        for name, data in short.items():
+            Check(Get(server.port, 'ustar/' + name) == data, 'ustar: %s' % name, server)
+        Check(Get(server.port, 'ustar/boot/' + 'p' * 120 + '/split') == b'split\n', 'ustar: split name', server)
+
+        Check(Missing(server.port, 'gnu/boot/nothing'), 'not in the archive', server)
+        Check(Missing(server.port, 'gnu/boot'), 'directories are not files', server)
+
+        Check(Get(server.port, 'cuttar/boot/kernel') == files['boot/kernel'], 'cut tar keeps what came before', server)
+        Check(Missing(server.port, 'cuttar/boot/empty'), 'cut tar loses the cut header', server)
+        Check(Missing(server.port, 'cutcpio/boot/kernel'), 'cut cpio is not served', server)
+    finally:
+        server.Stop()
+
+    log = open(server.log).read()
+    Check(os.path.exists(archives['gnu'] + '.idx') and 'index built' in log, 'indexes are written', server)
+
+    # Serve only gnu from here on, through its index.
+    def Restart():
+        server = Server(binary, work, 'archive', root, Block(archives['gnu'], 'gnu'))
+        try:
+            ok = all(Get(server.port, 'gnu/' + name) == data for name, data in files.items())
+        finally:
+            server.Stop()
+        return ok, open(server.log).read()
+
+    ok, log = Restart()
+    Check(ok and 'index loaded' in log, 'index is used again', server)
+
+    index = archives['gnu'] + '.idx'
+    good = open(index, 'rb').read()
+
+    # Entries pointing past the end of the archive.
+    header = struct.calcsize('8sQQqqII')
+    count, = struct.unpack_from('I', good, header - 8)
+    bad = bytearray(good)
+    struct.pack_into('Q', bad, header, len(gnu) + 4096)
+    open(index, 'wb').write(bad)
+    ok, log = Restart()
+    Check(count and ok and 'index built' in log, 'index pointing outside the archive is rebuilt', server)
+
+    # Cut short, and not an index at all.
+    for what, data in (('cut short', good[:len(good) - 3]), ('garbage', os.urandom(len(good)))):
+        open(index, 'wb').write(data)
+        ok, log = Restart()
+        Check(ok and 'index built' in log, 'index that is %s is rebuilt' % what, server)
+
+    # The archive changed under its index: the same file, the same size,
+    # the files somewhere else in it.
+    time.sleep(0.01)
+    files['boot/kernel'], files[longdir + '/long'] = files[longdir + '/long'], files['boot/kernel']
+    moved = Tar(tarfile.GNU_FORMAT)
+    with open(archives['gnu'], 'r+b') as f:
+        f.write(moved)
+        f.truncate()
+    ok, log = Restart()
+    Check(ok and 'index built' in log, 'index for an archive that changed is rebuilt', server)
@@ -0,0 +1,159 @@
+# What the tests share: a TFTP client, a stand-in HTTP origin, and
+# nbstftp running on the loopback with a config of the test's own.
+import hashlib
+import http.server
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+
+class TFTPError(Exception):
+    pass
+
+
+def FreePort(kind):
+    s = socket.socket(socket.AF_INET, kind)
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+# Fetch name in octet mode, raises TFTPError for an ERROR packet.
+def Get(port, name, timeout=10):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(timeout)
+    s.sendto(struct.pack('!H', 1) + name.encode() + b'\0octet\0', ('127.0.0.1', port))
+
+    data, expect = b'', 1
+    try:
+        while True:
+            d, addr = s.recvfrom(65536)
+            op, = struct.unpack('!H', d[:2])
+            if op == 5:
+                raise TFTPError(d[4:].split(b'\0')[0].decode())
+
+            block, = struct.unpack('!H', d[2:4])
+            if block == expect & 0xffff:
+                data += d[4:]
+                expect += 1
+            s.sendto(struct.pack('!HH', 4, block), addr)
+
+            if block == (expect - 1) & 0xffff and len(d) - 4 < 512:
+                return data
+    finally:
+        s.close()
+
+
+# Serves files (a dict of name to bytes) under /base/ with ETags, counting
+# what it's asked for. delay holds up every answer.
+class Origin:
+    def __init__(self, files, delay=0):
+        self.files, self.delay = files, delay
+        self.asked, self.notmodified = {}, 0
+        self.lock = threading.Lock()
+        self.port = FreePort(socket.SOCK_STREAM)
+
+        origin = self
+
+        class Handler(http.server.BaseHTTPRequestHandler):
+            protocol_version = 'HTTP/1.1'
+
+            def log_message(self, *args):
+                pass
+
+            def do_GET(self):
+                name = self.path[len('/base/'):]
+                with origin.lock:
+                    origin.asked[name] = origin.asked.get(name, 0) + 1
+                time.sleep(origin.delay)
+
+                data = origin.files.get(name)
+                if data is None:
+                    self.send_response(404)
+                    self.send_header('Content-Length', '0')
+                    self.end_headers()
+                    return
+
+                etag = '"%s"' % hashlib.md5(data).hexdigest()
+                if self.headers.get('If-None-Match') == etag:
+                    with origin.lock:
+                        origin.notmodified += 1
+                    self.send_response(304)
+                    self.send_header('ETag', etag)
+                    self.end_headers()
+                    return
+
+                self.send_response(200)
+                self.send_header('ETag', etag)
+                self.send_header('Content-Length', str(len(data)))
+                self.end_headers()
+                self.wfile.write(data)
+
+        self.server = http.server.ThreadingHTTPServer(('127.0.0.1', self.port), Handler)
+        threading.Thread(target=self.server.serve_forever, daemon=True).start()
+
+    def Asked(self, name):
+        with self.lock:
+            return self.asked.get(name, 0)
+
+    def Stop(self):
+        self.server.shutdown()
+        self.server.server_close()
+
+
+# nbstftp serving directory on port with the extra config blocks given.
+class Server:
+    def __init__(self, binary, workdir, name, directory, blocks):
+        self.port = FreePort(socket.SOCK_DGRAM)
+        self.log = os.path.join(workdir, name + '.log')
+        conf = os.path.join(workdir, name + '.conf')
+
+        with open(conf, 'w') as f:
+            f.write('server\n{\n\tdirectory = "%s";\n\tpidfile = "%s";\n\tdaemonize = false;\n}\n'
+                    % (directory, os.path.join(workdir, name + '.pid')))
+            f.write('listen\n{\n\tbind = "127.0.0.1";\n\tport = %d;\n}\n' % self.port)
+            f.write(blocks)
+
+        self.proc = subprocess.Popen([binary, '-c', conf], stdout=open(self.log, 'w'), stderr=subprocess.STDOUT)
+
+        # It's up once it turns something down. Nothing is asked
+        # for outside the root, not even from a peer or an origin.
+        for _ in range(50):
+            try:
+                Get(self.port, '../ready', timeout=0.2)
+            except TFTPError:
+                return
+            except OSError:
+                time.sleep(0.1)
+        self.Stop()
+        Fail('%s never answered' % name, self)
+
+    def Stop(self):
+        if self.proc.poll() is None:
+            self.proc.send_signal(signal.SIGTERM)
+            try:
+                self.proc.wait(10)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+
+
+def Fail(what, *servers):
+    print('FAIL:', what)
+    for s in servers:
+        s.Stop()
+        print('--- %s' % s.log)
+        sys.stdout.write(open(s.log).read())
+    sys.exit(1)
+
+
+def Check(ok, what, *servers):
+    if not ok:
+        Fail(what, *servers)
+    print('ok:', what)
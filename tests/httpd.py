@@ -0,0 +1,128 @@
+# Serving files over HTTP (http.c): whole files, HEAD, byte ranges and
+# what can't be satisfied, If-Range and If-None-Match, and ETags that
+# change when the file does, also for files out of an archive.
+#
+#   python3 tests/httpd.py path/to/nbstftp
+import http.client
+import io
+import os
+import socket
+import sys
+import tarfile
+import tempfile
+
+from harness import Check, FreePort, Server
+
+binary = os.path.abspath(sys.argv[1])
+data = os.urandom(10000)
+size = len(data)
+
+
+def Tar(content):
+    out = io.BytesIO()
+    with tarfile.open(fileobj=out, mode='w', format=tarfile.GNU_FORMAT) as t:
+        info = tarfile.TarInfo('inside')
+        info.size = len(content)
+        t.addfile(info, io.BytesIO(content))
+    return out.getvalue()
+
+
+with tempfile.TemporaryDirectory() as work:
+    root = os.path.join(work, 'root')
+    os.mkdir(root)
+    with open(os.path.join(root, 'file'), 'wb') as f:
+        f.write(data)
+    with open(os.path.join(root, 'empty'), 'wb') as f:
+        pass
+
+    archive = os.path.join(work, 'archive.tar')
+    with open(archive, 'wb') as f:
+        f.write(Tar(b'a' * 1000))
+
+    port = FreePort(socket.SOCK_STREAM)
+    blocks = 'http\n{\n\tbind = "127.0.0.1";\n\tport = %d;\n}\n' % port
+    blocks += 'archive\n{\n\tfile = "%s";\n\tpath = "tar";\n}\n' % archive
+
+    def Start():
+        return Server(binary, work, 'http', root, blocks)
+
+    server = Start()
+    # One connection for everything, it's kept alive between requests.
+    conn = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+
+    def Ask(method, path, **headers):
+        conn.request(method, path, headers=headers)
+        r = conn.getresponse()
+        return r, r.read()
+
+    try:
+        r, body = Ask('GET', '/file')
+        etag = r.getheader('ETag')
+        Check(r.status == 200 and body == data and r.getheader('Content-Length') == str(size), 'whole file', server)
+        Check(etag and r.getheader('Accept-Ranges') == 'bytes', 'ETag and Accept-Ranges', server)
+
+        r, body = Ask('HEAD', '/file')
+        Check(r.status == 200 and body == b'' and r.getheader('Content-Length') == str(size) and r.getheader('ETag') == etag,
+              'HEAD has the headers and no body', server)
+
+        def Ranged(value, first, last, what, **headers):
+            r, body = Ask('GET', '/file', Range=value, **headers)
+            Check(r.status == 206 and body == data[first:last + 1]
+                  and r.getheader('Content-Range') == 'bytes %d-%d/%d' % (first, last, size), what, server)
+
+        Ranged('bytes=10-19', 10, 19, 'range')
+        Ranged('bytes=9000-', 9000, size - 1, 'open ended range')
+        Ranged('bytes=9990-20000', 9990, size - 1, 'range past the end is cut short')
+        Ranged('bytes=-50', size - 50, size - 1, 'last 50 bytes')
+        Ranged('bytes=-20000', 0, size - 1, 'more last bytes than there are')
+        Ranged('bytes=100-199', 100, 199, 'If-Range with the ETag', **{'If-Range': etag})
+
+        for value in ('bytes=%d-' % size, 'bytes=-0'):
+            r, body = Ask('GET', '/file', Range=value)
+            Check(r.status == 416 and r.getheader('Content-Range') == 'bytes */%d' % size, '416 for %s' % value, server)
+
+        r, body = Ask('GET', '/empty', Range='bytes=0-')
+        Check(r.status == 416, '416 for any range of an empty file', server)
+
+        for value, what in (('bytes=0-1,5-6', 'several ranges'), ('lines=1-2', 'other units'), ('bytes=20-10', 'backwards range')):
+            r, body = Ask('GET', '/file', Range=value)
+            Check(r.status == 200 and body == data, 'whole file for %s' % what, server)
+
+        r, body = Ask('GET', '/file', Range='bytes=0-9', **{'If-Range': '"old"'})
+        Check(r.status == 200 and body == data, 'whole file when If-Range is out of date', server)
+
+        r, body = Ask('GET', '/file', **{'If-None-Match': etag})
+        Check(r.status == 304 and body == b'' and r.getheader('ETag') == etag, '304 for the ETag', server)
+
+        r, body = Ask('GET', '/file', **{'If-None-Match': '"old"'})
+        Check(r.status == 200 and body == data, 'whole file for another ETag', server)
+
+        r, body = Ask('GET', '/nothing')
+        Check(r.status == 404, '404', server)
+
+        # Changed, so the old ETag is no good any more.
+        st = os.stat(os.path.join(root, 'file'))
+        os.utime(os.path.join(root, 'file'), ns=(st.st_atime_ns, st.st_mtime_ns + 1000000000))
+        r, body = Ask('GET', '/file', **{'If-None-Match': etag})
+        Check(r.status == 200 and r.getheader('ETag') != etag, 'changed file gets a new ETag', server)
+
+        r, body = Ask('GET', '/tar/inside')
+        tagged = r.getheader('ETag')
+        Check(r.status == 200 and body == b'a' * 1000 and tagged, 'file out of an archive', server)
+    finally:
+        conn.close()
+        server.Stop()
+
+    # Rebuilt with the file in the same place in it.
+    with open(archive, 'wb') as f:
+        f.write(Tar(b'b' * 1000))
+
+    server = Start()
+    conn = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+    try:
+        r, body = Ask('GET', '/tar/inside', **{'If-None-Match': tagged})
+        Check(r.status == 200 and body == b'b' * 1000 and r.getheader('ETag') != tagged,
+              'rebuilt archive gets a new ETag', server)
+    finally:
+        conn.close()
+        server.Stop()
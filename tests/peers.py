@@ -0,0 +1,41 @@
+# Sharing files between nodes (peer.c): two nodes with different copies
+# of the same files each serve the other's share from the other node.
+#
+#   python3 tests/peers.py path/to/nbstftp
+import os
+import socket
+import sys
+import tempfile
+
+from harness import Check, FreePort, Get, Server
+
+binary = os.path.abspath(sys.argv[1])
+names = ['file%d' % i for i in range(16)]
+
+with tempfile.TemporaryDirectory() as work:
+    ports = {node: FreePort(socket.SOCK_STREAM) for node in ('a', 'b')}
+    peers = ''.join('\tpeer = "127.0.0.1:%d";\n' % port for port in ports.values())
+    servers = {}
+
+    try:
+        for node, port in ports.items():
+            root = os.path.join(work, node)
+            os.mkdir(root)
+            for name in names:
+                with open(os.path.join(root, name), 'w') as f:
+                    f.write('%s has %s\n' % (node, name))
+
+            servers[node] = Server(binary, work, node, root,
+                                   'peers\n{\n\tbind = "127.0.0.1";\n\tport = %d;\n\tself = "127.0.0.1:%d";\n%s\ttimeout = 2;\n}\n'
+                                   % (port, port, peers))
+
+        owners = set()
+        for name in names:
+            got = [Get(servers[node].port, name) for node in ('a', 'b')]
+            Check(got[0] == got[1], '%s is the same from both nodes' % name, *servers.values())
+            owners.add(got[0].split()[0])
+
+        Check(owners == {b'a', b'b'}, 'each node gets files from the other', *servers.values())
+    finally:
+        for s in servers.values():
+            s.Stop()
@@ -0,0 +1,40 @@
+# Clients that go away halfway through (socket.c, ReceiveErrors): the
+# ICMP port unreachable for our resend aborts the transfer right away
+# instead of after every retry.
+#
+#   python3 tests/unreachable.py path/to/nbstftp
+import os
+import socket
+import struct
+import sys
+import tempfile
+import time
+
+from harness import Check, Server
+
+binary = os.path.abspath(sys.argv[1])
+
+with tempfile.TemporaryDirectory() as work:
+    root = os.path.join(work, 'root')
+    os.mkdir(root)
+    with open(os.path.join(root, 'big'), 'wb') as f:
+        f.write(os.urandom(64 * 1024))
+
+    server = Server(binary, work, 'unreachable', root, '')
+
+    try:
+        # Take the first block and leave without acking it.
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.settimeout(5)
+        s.sendto(struct.pack('!H', 1) + b'big\0octet\0', ('127.0.0.1', server.port))
+        d, addr = s.recvfrom(65536)
+        Check(struct.unpack('!HH', d[:4]) == (3, 1), 'first block', server)
+        s.close()
+
+        # The first resend is at most a few seconds away, all of the
+        # retries would take much longer.
+        time.sleep(4)
+    finally:
+        server.Stop()
+
+    Check('is unreachable' in open(server.log).read(), 'transfer to a closed port is aborted', server)
@@ -0,0 +1,55 @@
+# Pulling files through from an HTTP origin (upstream.c):
+# concurrent requests share one fetch, changed files are checked
+# with If-None-Match and files the origin doesn't have are remembered.
+#
+#   python3 tests/upstream.py path/to/nbstftp
+import os
+import sys
+import tempfile
+import threading
+import time
+
+from harness import Check, Get, Origin, Server, TFTPError
+
+binary = os.path.abspath(sys.argv[1])
+files = {'boot/big': os.urandom(300 * 1024), 'boot/small': b'small file\n'}
+
+with tempfile.TemporaryDirectory() as work:
+    root = os.path.join(work, 'root')
+    os.mkdir(root)
+
+    origin = Origin(files, delay=0.5)
+    server = Server(binary, work, 'upstream', root,
+                    'upstream\n{\n\tpath = "remote";\n\turl = "http://127.0.0.1:%d/base/";\n\tcache = "%s";\n'
+                    '\trevalidate = 1;\n\ttimeout = 3;\n}\n' % (origin.port, os.path.join(work, 'cache')))
+
+    try:
+        got = {}
+
+        def Fetch(i):
+            got[i] = Get(server.port, 'remote/boot/big')
+
+        threads = [threading.Thread(target=Fetch, args=(i,)) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        Check(all(got.get(i) == files['boot/big'] for i in range(4)), 'concurrent requests get the file', server)
+        Check(origin.Asked('boot/big') == 1, 'concurrent requests share one fetch', server)
+
+        Check(Get(server.port, 'remote/boot/small') == files['boot/small'], 'small file', server)
+        time.sleep(1.2)
+        Check(Get(server.port, 'remote/boot/small') == files['boot/small'], 'revalidated file', server)
+        Check(origin.Asked('boot/small') == 2 and origin.notmodified == 1, 'revalidating gets a 304', server)
+
+        for _ in range(2):
+            try:
+                Get(server.port, 'remote/boot/missing')
+                Check(False, 'missing file is an error', server)
+            except TFTPError:
+                pass
+        Check(origin.Asked('boot/missing') == 1, 'missing file is remembered', server)
+    finally:
+        server.Stop()
+        origin.Stop()